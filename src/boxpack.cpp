@@ -24,24 +24,36 @@ except that their width is defined by the size of the bin. So basically
 they stretch as the bin stretchs from some x to the edge of the bin.
 
 To place a box we first iterate through every element of the free list
-and every boxes to find the biggest box that will fit in one of our free
-boxes. The box is then placed along the top left corner of the free box.
+and look up the biggest box that will fit in each of our free boxes (see
+t_box_index). The box is then placed along the top left corner of the free box.
 The free box is then split in two (under and to the right). Finally, we
 adjust any other free boxes that might overlap with the new box.
 
 We repeat this process until no more boxes can be placed and then it's
 back to step 1) till there's no more boxes to place.
 
-Asymptoticly, this algo is O(n^3) but since the free list is kept
-pretty small, it's probably closer to O(n^2). Not that great but better
-then the O(2^n) naive algo and much nicer results then the various
-greedy algos.
+Asymptoticly, this algo is O(n^2 log n) since every placement looks at
+the whole free list but since the free list is kept pretty small, it's
+probably closer to O(n log n). Better then the O(2^n) naive algo and much
+nicer results then the various greedy algos.
 
 Note that this algorithm could be improved further by using unbounded 
 height as well as width for the free boxes. This would allow us to
 grow our bin in both dimensions but would also require an heuristic
 to determine when to grow horrizontally. This would allow us to also
 expand our solution to other problem type like texture packing.
+
+For that kind of problem, there's a second engine (-e skyline) that
+packs the boxes against a skyline (see t_skyline). One side of its bin
+can be fixed (-W or -H) like the size of a texture atlas and the bin
+only grows along the other one. It's usually faster but looser since
+the space under the skyline is lost.
+
+The bin also depends a lot on the order of the boxes and on which free
+box gets filled first. The portfolio engine (-e portfolio) packs with
+every combination of these (see t_pack_strategy) and with shuffled
+orders on every core until its time budget (-t) runs out and keeps the
+smallest bin.
  */
 
 
@@ -50,14 +62,23 @@ expand our solution to other problem type like texture packing.
  ******************************************************************************/
 
 #include <iostream>  
+#include <string>
 
-#include <set>
-#include <list>
 #include <vector>
 #include <algorithm>
 
 #include <cstdlib>
 #include <cstdio>
+#include <climits>
+#include <cassert>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 
 /*******************************************************************************
@@ -81,62 +102,312 @@ struct t_box {
 
 
 /*******************************************************************************
- * Typedefs
+ * struct t_box_list
  ******************************************************************************/
 
-typedef std::list<t_box> t_box_list;
-typedef t_box_list::iterator t_box_it;
-typedef t_box_list::const_iterator t_box_cit;
+//! Position of a box in the t_box_list.
+typedef std::size_t t_box_id;
+
+
+/*!
+  The boxes to pack with one array per field so that the loops over them stay in
+  cache. Boxes are referred to by their position in the list.
+*/
+struct t_box_list {
+  std::vector<int> width;
+  std::vector<int> height;
+  std::vector<int> x;
+  std::vector<int> y;
+
+  std::size_t size () const {return width.size();}
+  int area (t_box_id id) const {return width[id] * height[id];}
+
+  void push_back (const t_box& box) {
+    width.push_back(box.width);
+    height.push_back(box.height);
+    x.push_back(box.x);
+    y.push_back(box.y);
+  }
+
+  t_box get (t_box_id id) const {
+    t_box box (width[id], height[id]);
+    box.x = x[id];
+    box.y = y[id];
+    return box;
+  }
+};
 
 
 /*******************************************************************************
- * t_box utilities
+ * struct t_pack_strategy
  ******************************************************************************/
 
-//! Sorts by placing tallest boxes first.
-struct t_box_ref_height_comp : 
-  public std::binary_function<t_box_it, t_box_it, bool>
-{
-  bool operator() (const t_box_it& lhs, const t_box_it& rhs) const {
-    if (lhs->height == rhs->height) 
-      return lhs->area() > rhs->area();
-    return lhs->height > rhs->height;
+//! Order in which the greedy solver takes the boxes (see t_box_queue).
+enum t_box_order {
+  e_by_height,
+  e_by_area,
+  e_by_width,
+  e_by_shuffled_height
+};
+
+
+//! Free box that the free list solver fills next (see free_list_search()).
+enum t_free_policy {
+  e_biggest_box,
+  e_first_free,
+  e_tightest_free
+};
+
+
+/*!
+  Knobs of pack_boxes(), the default being the original algorithm. The seed shuffles
+  the boxes of the same height for e_by_shuffled_height. The trace of the placed 
+  boxes can be turned off for the packings of the portfolio that run in parallel.
+*/
+struct t_pack_strategy {
+  t_box_order order;
+  t_free_policy policy;
+  unsigned seed;
+  bool is_traced;
+
+  t_pack_strategy () : 
+    order(e_by_height), policy(e_biggest_box), seed(0), is_traced(true) 
+  {}
+};
+
+
+/*******************************************************************************
+ * class t_box_queue
+ ******************************************************************************/
+
+/*!
+  Boxes left to place in the order of the strategy. By default that's tallest to 
+  smallest (ties go to the biggest box and then to the first one in the list). The
+  boxes placed out of order by the free list solver are only flagged and skipped
+  once they come up.
+*/
+class t_box_queue {
+
+  // Equivalent of boost::noncopyable.
+  t_box_queue(const t_box_queue& src) {}
+  t_box_queue& operator= (const t_box_queue& src) {return *this;}
+
+public :
+
+  t_box_queue (const t_box_list& boxes, const t_pack_strategy& strategy);
+
+  std::size_t size () const {return left;}
+  t_box_id front () const {return order[first];}
+  void erase (t_box_id id);
+
+private :
+
+  std::vector<t_box_id> order;
+  std::vector<char> is_placed;
+
+  // Position of the front in order.
+  std::size_t first;
+  std::size_t left;
+
+};
+
+
+/*******************************************************************************
+ * class t_free_list
+ ******************************************************************************/
+
+//! Position of a free box in the t_free_list.
+typedef std::size_t t_free_pos;
+
+
+/*!
+  Free boxes ordered by position (no duplicates) with one array per field. The
+  width of a free box is implicit since it goes to the edge of the bin. Most edits 
+  keep the position of the box so they're done in place.
+*/
+struct t_free_list {
+  std::vector<int> x;
+  std::vector<int> y;
+  std::vector<int> height;
+
+  std::size_t size () const {return x.size();}
+  int top (t_free_pos pos) const {return y[pos] + height[pos];}
+
+  t_box get (t_free_pos pos) const {
+    t_box box (0, height[pos]);
+    box.x = x[pos];
+    box.y = y[pos];
+    return box;
   }
-} box_ref_height_comp;
 
+  //! True if a box at the given position would come before the free box at pos.
+  bool is_before (int box_x, int box_y, t_free_pos pos) const {
+    return box_x != x[pos] ? box_x < x[pos] : box_y < y[pos];
+  }
 
-//! List of boxes to add ordered by tallest to smallest.
-typedef std::multiset<t_box_it, t_box_ref_height_comp> t_box_ref_list;
-typedef t_box_ref_list::iterator t_box_ref_it;
+  bool insert (int box_x, int box_y, int box_height);
+  void erase (t_free_pos pos);
+};
 
 
-//! Orders by box position
-struct t_box_pos_comp :
-  public std::binary_function<t_box, t_box, bool>
-{
-  bool operator() (const t_box& lhs, const t_box& rhs) const {
-    if (lhs.x != rhs.x)
-      return lhs.x < rhs.x;
-    return lhs.y < rhs.y;
+/*******************************************************************************
+ * class t_box_index
+ ******************************************************************************/
+
+/*!
+  Index of the boxes left in the queue that finds the biggest box that fits in a
+  free box without going through the whole queue.
+
+  Boxes of the same size are interchangeable so they're grouped by size and taken
+  in the order of the list. Each size gets a rank in the order of the queue (by area
+  then height) so that "bigger" is a single comparison.
+
+  The sizes are sorted by their long side (the height) and cut into blocks of
+  BLOCK_SIZE sizes which are the leaves of a segment tree. Each node keeps the best
+  rank left under it and the smallest short side left under it. A search only goes 
+  down the nodes that are under the long side of the free box, that have something 
+  narrow enough and that could beat what was already found. The blocks it reaches 
+  are scanned whole by search_block() which checks the sizes 8 at a time with AVX2.
+*/
+class t_box_index {
+
+  // Equivalent of boost::noncopyable.
+  t_box_index(const t_box_index& src) {}
+  t_box_index& operator= (const t_box_index& src) {return *this;}
+
+public :
+
+  t_box_index (const t_box_list& boxes);
+
+  void erase (t_box_id id);
+  bool search (int free_width, int free_height, t_box_id& found, int& area) const;
+
+private :
+
+  enum { BLOCK_SIZE = 16 };
+
+  struct t_size {
+    // Range of ids of the boxes of this size. Those before next were placed.
+    std::size_t next;
+    std::size_t end;
+  };
+
+  int search_block (std::size_t block, int long_side, int short_side) const;
+  void update (std::size_t block);
+  void search (std::size_t node, std::size_t first, std::size_t last, 
+	       std::size_t end, int long_side, int short_side, int& found) const;
+
+  std::vector<t_size> sizes;
+  std::vector<t_box_id> ids;
+
+  // Size of each box.
+  std::vector<std::size_t> box_sizes;
+
+  // Short side, long side and rank of each size (-1 once there's no box left). 
+  //   Padded to a whole number of blocks with sizes that never fit.
+  std::vector<int> widths;
+  std::vector<int> heights;
+  std::vector<int> ranks;
+
+  // Size of each rank.
+  std::vector<std::size_t> rank_sizes;
+
+  // Number of leaves (power of 2). The children of node i are 2i and 2i+1.
+  std::size_t leaf_count;
+
+  // Best rank (-1 if none) and smallest short side left under each node.
+  std::vector<int> best;
+  std::vector<int> min_short;
+
+};
+
+
+/*******************************************************************************
+ * class t_skyline
+ ******************************************************************************/
+
+/*!
+  Free space of the skyline engine. The bin has a fixed span along one axis (u) and
+  grows along the other one (v). The skyline is made of segments that cover the 
+  whole span, each one at the v above which everything is still free. Whatever is
+  left under the skyline is lost.
+
+  A box goes where its top is the lowest (bottom-left). Looking up that spot is
+  linear in the number of segments since the highest segment under each candidate 
+  spot is tracked with a sliding window maximum.
+*/
+class t_skyline {
+
+  // Equivalent of boost::noncopyable.
+  t_skyline(const t_skyline& src) {}
+  t_skyline& operator= (const t_skyline& src) {return *this;}
+
+public :
+
+  t_skyline (int span);
+
+  int top () const {return max_top;}
+
+  bool find (int width, int height, int& u, int& v) const;
+  void place (int u, int width, int top);
+
+private :
+
+  // A segment goes from its u to the u of the next one (or to the span).
+  struct t_segment {
+    int u;
+    int v;
+  };
+
+  int end (std::size_t pos) const {
+    return pos + 1 < segments.size() ? segments[pos + 1].u : span;
   }
-} box_pos_comp;
 
+  std::vector<t_segment> segments;
+  int span;
+  int max_top;
 
-//! Ordered by position list of free box (no duplicates).
-typedef std::set<t_box, t_box_pos_comp> t_free_list;
-typedef t_free_list::iterator t_free_it;
+};
 
 
 /*******************************************************************************
  * Prototypes
  ******************************************************************************/
 
+enum t_engine {
+  e_free_list,
+  e_skyline,
+  e_portfolio
+};
+
+
+/*!
+  Engine and fixed side of the bin (0 if it's not fixed, only for the skyline). 
+  The portfolio runs on nb_threads threads (0 for one per core) and keeps starting
+  packings until time_budget seconds have passed (see pack_boxes_portfolio()).
+*/
+struct t_pack_config {
+  t_engine engine;
+  int bin_width;
+  int bin_height;
+  int nb_threads;
+  double time_budget;
+
+  t_pack_config () : 
+    engine(e_free_list), bin_width(0), bin_height(0), nb_threads(0), time_budget(0) 
+  {}
+};
+
+
 bool read_boxes (t_box_list& out_list);
-t_box pack_boxes (t_box_list& box_list);
+t_box pack_boxes (t_box_list& box_list, const t_pack_strategy& strategy = t_pack_strategy());
+t_box pack_boxes_skyline (t_box_list& box_list, const t_pack_config& config);
+t_box pack_boxes_portfolio (t_box_list& box_list, const t_pack_config& config);
+double now_seconds ();
 void print_boxes (const t_box_list& box_list, const t_box& bin);
 
 void run_tests();
-void run_packer(t_box_list& list);
+void run_packer(t_box_list& list, const t_pack_config& config = t_pack_config());
 
 int min (int a, int b) {return a < b ? a : b;}
 int max (int a, int b) {return a > b ? a : b;}
@@ -146,10 +417,60 @@ int max (int a, int b) {return a > b ? a : b;}
  * Entry Point
  ******************************************************************************/
 
-//! Entry point. Command line defines whether we do tests or user inputs.
+/*!
+  Entry point. Command line defines whether we do tests or user inputs: any
+  non-option argument runs the tests. The -e option picks the engine and the -W 
+  or -H option fixes a side of the bin for the skyline engine. The -j and -t options
+  set the number of threads and the time budget of the portfolio engine.
+*/
 int main (int argc, char** argv) {
 
-  if (argc > 1) {
+  t_pack_config config;
+  const char* engine = "free";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "e:W:H:j:t:")) != -1) {
+    switch (opt) {
+    case 'e': engine = optarg; break;
+    case 'W': config.bin_width = atoi(optarg); break;
+    case 'H': config.bin_height = atoi(optarg); break;
+    case 'j': config.nb_threads = atoi(optarg); break;
+    case 't': config.time_budget = atof(optarg); break;
+    default:
+      std::cerr << "Usage: " << argv[0] 
+		<< " [-e free|skyline|portfolio] [-W width | -H height]"
+		<< " [-j threads] [-t seconds] [test]" << std::endl;
+      exit(1);
+    }
+  }
+
+  if (std::string(engine) == "skyline") config.engine = e_skyline;
+  else if (std::string(engine) == "portfolio") config.engine = e_portfolio;
+  else if (std::string(engine) != "free") {
+    std::cerr << "Unknown engine: " << engine << std::endl;
+    exit(1);
+  }
+
+  bool is_fixed = config.bin_width != 0 || config.bin_height != 0;
+  if (config.bin_width < 0 || config.bin_height < 0 || 
+      (config.bin_width > 0 && config.bin_height > 0) ||
+      (is_fixed && config.engine != e_skyline)) 
+  {
+    std::cerr << "Only one of -W and -H can be given and only to the skyline engine." 
+	      << std::endl;
+    exit(1);
+  }
+
+  bool is_portfolio = config.nb_threads != 0 || config.time_budget != 0;
+  if (config.nb_threads < 0 || config.time_budget < 0 || 
+      (is_portfolio && config.engine != e_portfolio))
+  {
+    std::cerr << "The -j and -t options can't be negative and are only for the portfolio engine."
+	      << std::endl;
+    exit(1);
+  }
+
+  if (optind < argc) {
     run_tests();
   }
   else {
@@ -158,7 +479,7 @@ int main (int argc, char** argv) {
       std::cerr << "Unable to read the box list!" << std::endl;
       exit(1);
     }
-    run_packer(box_list);
+    run_packer(box_list, config);
   }
   return 0;
 }
@@ -168,31 +489,41 @@ int main (int argc, char** argv) {
  * Main solver.
  ******************************************************************************/
 
-void place_first_box (t_box_ref_list& box_queue, t_box& bin);
-void place_box_greedy (t_box& new_box, t_box& bin, t_free_list& free_list);
-void place_box_free_list (t_box_ref_list& box_queue, t_free_list& free_list, const t_box& bin);
+void place_first_box (t_box_list& boxes, t_box_queue& box_queue, t_box& bin,
+		      const t_pack_strategy& strategy);
+void place_box_greedy (t_box_list& boxes, t_box_id id, t_box& bin, t_free_list& free_list,
+		       const t_pack_strategy& strategy);
+void place_box_free_list (t_box_list& boxes,
+			  t_box_queue& box_queue, 
+			  t_box_index& box_index,
+			  t_free_list& free_list, 
+			  const t_box& bin,
+			  const t_pack_strategy& strategy);
 void extend_bin (t_box& bin, const t_box& new_box);
+void free_list_trim (const t_box& new_box, t_free_list& free_list);
 
 
 //! Main loop of the algorithm. Nothing too fancy so just read it.
-t_box pack_boxes (t_box_list& box_list) {
+t_box pack_boxes (t_box_list& box_list, const t_pack_strategy& strategy) {
   
-  t_box_ref_list box_queue;
-  for (t_box_it it = box_list.begin(); it != box_list.end(); ++it) {
-    box_queue.insert(it);
-  }
-
   t_box bin;
+  if (box_list.size() == 0)
+    return bin;
+
+  t_box_queue box_queue (box_list, strategy);
+  t_box_index box_index (box_list);
   t_free_list free_list;
 
-  place_first_box(box_queue, bin);
+  box_index.erase(box_queue.front());
+  place_first_box(box_list, box_queue, bin, strategy);
 
   while (box_queue.size() > 0) {
-    t_box_it first_box = *(box_queue.begin());
-    place_box_greedy(*first_box, bin, free_list);
-    box_queue.erase(box_queue.begin());
+    t_box_id first_box = box_queue.front();
+    box_index.erase(first_box);
+    place_box_greedy(box_list, first_box, bin, free_list, strategy);
+    box_queue.erase(first_box);
     
-    place_box_free_list(box_queue, free_list, bin);
+    place_box_free_list(box_list, box_queue, box_index, free_list, bin, strategy);
   }
 
   return bin;
@@ -210,36 +541,50 @@ void extend_bin (t_box& bin, const t_box& new_box) {
  * Greedy solver
  ******************************************************************************/
 
-//! The first box defines the height of the bin so we treat it specially.
-void place_first_box (t_box_ref_list& box_queue, t_box& bin) {
-  t_box_ref_it first_ref = box_queue.begin();
-  t_box_it first_box = *first_ref;
+/*!
+  The first box defines the height of the bin so we treat it specially. With an
+  order other then by height, a later box can still raise the bin but the space
+  above the boxes that were placed before it is then lost.
+*/
+void place_first_box (t_box_list& boxes, t_box_queue& box_queue, t_box& bin,
+		      const t_pack_strategy& strategy) 
+{
+  t_box_id first_box = box_queue.front();
 
-  extend_bin(bin, *first_box);
-  first_box->x = first_box->y = 0;
+  boxes.x[first_box] = boxes.y[first_box] = 0;
+  extend_bin(bin, boxes.get(first_box));
 
-  std::cerr << "1 ";
-  first_box->print();
+  if (strategy.is_traced) {
+    std::cerr << "1 ";
+    boxes.get(first_box).print();
+  }
 
-  box_queue.erase(first_ref);
+  box_queue.erase(first_box);
 }
 
 
-//! Places the tallest box at the end of the bin and updates the free list accordingly.
-void place_box_greedy (t_box& new_box, t_box& bin, t_free_list& free_list) {
-  new_box.x = bin.width;
-  new_box.y = 0;
+//! Places the next box of the queue at the end of the bin and updates the free list accordingly.
+void place_box_greedy (t_box_list& boxes, t_box_id id, t_box& bin, t_free_list& free_list,
+		       const t_pack_strategy& strategy) 
+{
+  boxes.x[id] = bin.width;
+  boxes.y[id] = 0;
+
+  const t_box new_box = boxes.get(id);
   extend_bin (bin, new_box);
 
-  std::cerr << "G ";
-  new_box.print();
+  if (strategy.is_traced) {
+    std::cerr << "G ";
+    new_box.print();
+  }
+
+  // The free boxes go to the end of the bin so they now cover the new box. They're 
+  // all above it when the tallest boxes come first but not with the other orders.
+  free_list_trim(new_box, free_list);
 
-  t_box free_box;
-  free_box.x = new_box.x;
-  free_box.y = new_box.top();
-  free_box.height = bin.height - new_box.height;
-  if (free_box.height > 0) 
-    free_list.insert(free_box);
+  int free_height = bin.height - new_box.height;
+  if (free_height > 0) 
+    free_list.insert(new_box.x, new_box.top(), free_height);
 }
 
 
@@ -247,97 +592,110 @@ void place_box_greedy (t_box& new_box, t_box& bin, t_free_list& free_list) {
  * Free list solver.
  ******************************************************************************/
 
-std::pair<t_free_it, t_box_ref_it> 
-free_list_search (t_box_ref_list& box_queue, t_free_list& free_list, const t_box& bin);
-void free_list_update (t_free_it free_it, 
-		       const t_box_it& queue_box, 
+std::pair<t_free_pos, t_box_id>
+free_list_search (const t_box_index& box_index, const t_free_list& free_list, const t_box& bin,
+		  t_free_policy policy);
+void free_list_update (t_free_pos free_pos, 
+		       const t_box& new_box, 
 		       t_free_list& free_list, 
 		       const t_box& bin);
-void set_free_height (t_free_it free_it, t_free_list& free_list, int height);
-void set_free_y (t_free_it free_it, t_free_list& free_list, int new_y);
-bool is_free_redundant (t_free_list& free_list, const t_box& new_free);
+bool set_free_height (t_free_pos free_pos, t_free_list& free_list, int height);
+bool set_free_y (t_free_pos free_pos, t_free_list& free_list, int new_y);
+bool is_free_redundant (const t_free_list& free_list, int x, int y, int top);
 
 
 //! Places the biggest possible boxes in the available free list entries.
-void place_box_free_list (t_box_ref_list& box_queue, 
+void place_box_free_list (t_box_list& boxes,
+			  t_box_queue& box_queue, 
+			  t_box_index& box_index,
 			  t_free_list& free_list,
-			  const t_box& bin) 
+			  const t_box& bin,
+			  const t_pack_strategy& strategy) 
 {
 
   while (true) {
     
     /*
       std::cerr << std::endl << "F LIST (" << free_list.size() << ")" << std::endl;
-      for (t_free_it it = free_list.begin(); it != free_list.end(); it++) {
+      for (t_free_pos pos = 0; pos < free_list.size(); pos++) {
       std::cerr << "\t";
-      it->print(); 
+      free_list.get(pos).print(); 
       }
     */
 
-    std::pair<t_free_it, t_box_ref_it> result = 
-      free_list_search(box_queue, free_list, bin);
+    std::pair<t_free_pos, t_box_id> result = 
+      free_list_search(box_index, free_list, bin, strategy.policy);
     
-    const t_free_it free_it = result.first;
-    const t_box_ref_it queue_it = result.second;
-    if (free_it == free_list.end())
+    const t_free_pos free_pos = result.first;
+    const t_box_id id = result.second;
+    if (free_pos == free_list.size())
       return;
 
+    box_index.erase(id);
+    box_queue.erase(id);
+
     // Place the new box along the the top (rotate as needed).
-    const t_box& old_free = *free_it;
-    const t_box_it& queue_box = *queue_it;
+    const t_box old_free = free_list.get(free_pos);
 
-    if (queue_box->height > old_free.height) {
-      std::swap(queue_box->height, queue_box->width);
+    if (boxes.height[id] > old_free.height) {
+      std::swap(boxes.height[id], boxes.width[id]);
     }
 
-    queue_box->x = old_free.x;
-    queue_box->y = old_free.top() - queue_box->height;
-    box_queue.erase(queue_it);
+    boxes.x[id] = old_free.x;
+    boxes.y[id] = old_free.top() - boxes.height[id];
 
-    std::cerr << "F ";
-    queue_box->print();
-    std::cerr << "\tfrom Free";  
-    old_free.print();
+    const t_box new_box = boxes.get(id);
+
+    if (strategy.is_traced) {
+      std::cerr << "F ";
+      new_box.print();
+      std::cerr << "\tfrom Free";  
+      old_free.print();
+    }
 
     // Update the free box list.
-    free_list_update(free_it, queue_box, free_list, bin);
+    free_list_update(free_pos, new_box, free_list, bin);
   }
 }
 
 
 /*!
   Find the biggest box we can shove in a free spot (if any).
-  This is the slowest spot of our algorithm. Lots of stuff to check.
-  Luckily, free_list usually remains pretty small so it's not as bad as it looks.
-*/
-std::pair<t_free_it, t_box_ref_it> 
-free_list_search (t_box_ref_list& box_queue, t_free_list& free_list, const t_box& bin) {
+  This is still the slowest spot of our algorithm since every free box is looked
+  up but the index saves us from going through the queue for each of them.
 
-  int max_area = -1;
-  t_free_it found_free = free_list.end();
-  t_box_ref_it found_box = box_queue.end();
-  
-
-  for (t_free_it free_it = free_list.begin(); free_it != free_list.end(); ++free_it) {
-    int free_width = bin.width - free_it->x;
-
-    for (t_box_ref_it queue_it = box_queue.begin(); queue_it != box_queue.end(); ++queue_it) {
-      const t_box_it& queue_box = *queue_it;
-      
-      // Is it worth continuing?
-      if (queue_box->area() <= max_area) 
-	continue;
-      
-      // Can we fit it in?
-      if (queue_box->height > max(free_width, free_it->height))
-	continue;
-      if (queue_box->width > min(free_width, free_it->height))
-	continue;
-
-      max_area = queue_box->area();
-      found_free = free_it;
-      found_box = queue_it;
+  The policy picks the spot: the one that takes the biggest box, the first one that
+  takes any box or the one that's left with the least space once its box is in.
+  On a tie, the first free box wins.
+*/
+std::pair<t_free_pos, t_box_id>
+free_list_search (const t_box_index& box_index, const t_free_list& free_list, const t_box& bin,
+		  t_free_policy policy) 
+{
+  long long best_score = LLONG_MIN;
+  t_free_pos found_free = free_list.size();
+  t_box_id found_box = 0;
+
+  for (t_free_pos pos = 0; pos < free_list.size(); ++pos) {
+    int free_width = bin.width - free_list.x[pos];
+
+    t_box_id id;
+    int area;
+    if (!box_index.search(free_width, free_list.height[pos], id, area))
+      continue;
+
+    long long score = area;
+    if (policy == e_tightest_free)
+      score = area - static_cast<long long>(free_width) * free_list.height[pos];
+
+    if (score > best_score) {
+      best_score = score;
+      found_free = pos;
+      found_box = id;
     }
+
+    if (policy == e_first_free)
+      break;
   }
 
   return std::make_pair(found_free, found_box);
@@ -345,91 +703,821 @@ free_list_search (t_box_ref_list& box_queue, t_free_list& free_list, const t_box
 
 
 //! Updates the free list to take into account the added block.
-void free_list_update (t_free_it free_it, 
-		       const t_box_it& queue_box, 
+void free_list_update (t_free_pos free_pos, 
+		       const t_box& new_box, 
 		       t_free_list& free_list, 
 		       const t_box& bin) 
 {
-  t_free_it old_free = free_it;
-  int new_free_x = queue_box->right();
+  int new_free_x = new_box.right();
  
-  int old_y = old_free->y;
-  int old_height = old_free->height;
+  int old_y = free_list.y[free_pos];
+  int old_height = free_list.height[free_pos];
  
-  // Update the entries.
-  //  Trim the free blocks so that they don't overlap our new block.
-  for (t_free_it it = free_list.begin(); it != free_list.end(); ++it) {
+  free_list_trim(new_box, free_list);
+
+  // Create the new free box on the right.
+  if (new_free_x < bin.width) {
+    if (!is_free_redundant(free_list, new_free_x, old_y, old_y + old_height)) {
+      free_list.insert(new_free_x, old_y, old_height);
+    }
+  }
+}
+
+
+/*!
+  Trims the free blocks so that they don't overlap our new block.
+  An entry that is removed or moved further down the list is replaced by the
+  next one so we only move on if the entry stayed in place.
+*/
+void free_list_trim (const t_box& new_box, t_free_list& free_list) {
+  int new_free_x = new_box.right();
+
+  t_free_pos pos = 0;
+  while (pos < free_list.size()) {
     
     // If the free block apears after then it can't overlap anything.
-    if (it->x >= new_free_x)
+    if (free_list.x[pos] >= new_free_x)
       break;
 
-    int height_diff = it->top() - queue_box->y;
-    int y_diff = queue_box->top() - it->y;
+    int height_diff = free_list.top(pos) - new_box.y;
+    int y_diff = new_box.top() - free_list.y[pos];
+
+    bool is_in_place = true;
 
     // A block is overlapping the bottom of the free block so trim the bottom.
-    if (y_diff > 0 && queue_box->top() < it->top()) {
-      set_free_y(it, free_list, it->y + y_diff);
+    if (y_diff > 0 && new_box.top() < free_list.top(pos)) {
+      is_in_place = set_free_y(pos, free_list, free_list.y[pos] + y_diff);
     }
     // A block is overlapping the top of a the free block so trim the top.
-    else if (height_diff > 0 && queue_box->y >= it->y) {
-      set_free_height(it, free_list, it->height - height_diff);
+    else if (height_diff > 0 && new_box.y >= free_list.y[pos]) {
+      is_in_place = set_free_height(pos, free_list, free_list.height[pos] - height_diff);
     }
     // The block is overlapping the entire free block, get rid of it.
     else if (y_diff > 0 && height_diff > 0) {
-      set_free_height(it, free_list, 0);
+      is_in_place = set_free_height(pos, free_list, 0);
     }
+
+    if (is_in_place)
+      ++pos;
   }
+}
 
-  // Create the new free box on the right.
-  if (new_free_x < bin.width) {
-    t_box new_free;
-    new_free.x = new_free_x;
-    new_free.y = old_y;
-    new_free.height = old_height;
-    if (!is_free_redundant(free_list, new_free)) {
-      free_list.insert(new_free);
+
+/*!
+  Checks to see if the free box is completely covered by another freebox.
+  Only the free boxes that start before it can cover it.
+*/
+bool is_free_redundant (const t_free_list& free_list, int x, int y, int top) {
+  for (t_free_pos pos = 0; pos < free_list.size() && free_list.x[pos] <= x; ++pos) {
+    if (free_list.y[pos] <= y && free_list.top(pos) >= top) {
+      return true;
     }
   }
+  return false;
 }
 
 
-//! Checks to see if the free box is completely covered by another freebox.
-bool is_free_redundant (t_free_list& free_list, const t_box& new_free) {
-  for (t_free_it it = free_list.begin(); it != free_list.end(); ++it) {
-    if (it->x <= new_free.x && it->y <= new_free.y) {
-      if (it->top() >= new_free.top()) {
-	return true;
-      }
-    }
+/*!
+  Sets the free box's height to a new value or deletes it if the height becomes 0.
+  Returns true if the free box is still at the same position in the list.
+*/
+bool set_free_height (t_free_pos free_pos, t_free_list& free_list, int height) {
+  if (height <= 0) {
+    free_list.erase(free_pos);
+    return false;
   }
+
+  free_list.height[free_pos] = height;
+  return true;
+}
+
+
+/*!
+  Sets the free box's y to a new value or deletes it if the height becomes 0.
+  Returns true if the free box is still at the same position in the list.
+*/
+bool set_free_y (t_free_pos free_pos, t_free_list& free_list, int new_y) {
+  int x = free_list.x[free_pos];
+  int new_height = free_list.height[free_pos] - (new_y - free_list.y[free_pos]);
+
+  // The y only goes up so the box can only move further down the list.
+  t_free_pos next_pos = free_pos + 1;
+  bool is_in_place = new_height > 0 && 
+    (next_pos == free_list.size() || free_list.is_before(x, new_y, next_pos));
+
+  if (is_in_place) {
+    free_list.y[free_pos] = new_y;
+    free_list.height[free_pos] = new_height;
+    return true;
+  }
+
+  free_list.erase(free_pos);
+  if (new_height > 0) 
+    free_list.insert(x, new_y, new_height);
   return false;
 }
 
 
-//! Sets the free box's height to a new value or deletes it if the height becomes 0.
-void set_free_height (t_free_it free_it, t_free_list& free_list, int height) {
-  free_list.erase(free_it);
-  if (height <= 0) 
+/*******************************************************************************
+ * Box queue
+ ******************************************************************************/
+
+//! Sorts by placing tallest boxes first.
+struct t_box_height_comp {
+  t_box_height_comp (const t_box_list& boxes) : boxes(boxes) {}
+
+  bool operator() (t_box_id lhs, t_box_id rhs) const {
+    if (boxes.height[lhs] != boxes.height[rhs])
+      return boxes.height[lhs] > boxes.height[rhs];
+    if (boxes.area(lhs) != boxes.area(rhs))
+      return boxes.area(lhs) > boxes.area(rhs);
+    return lhs < rhs;
+  }
+
+  const t_box_list& boxes;
+};
+
+
+//! Sorts by placing biggest boxes first (ties go to the tallest).
+struct t_box_area_comp {
+  t_box_area_comp (const t_box_list& boxes) : boxes(boxes) {}
+
+  bool operator() (t_box_id lhs, t_box_id rhs) const {
+    if (boxes.area(lhs) != boxes.area(rhs))
+      return boxes.area(lhs) > boxes.area(rhs);
+    if (boxes.height[lhs] != boxes.height[rhs])
+      return boxes.height[lhs] > boxes.height[rhs];
+    return lhs < rhs;
+  }
+
+  const t_box_list& boxes;
+};
+
+
+//! Sorts by placing widest boxes first (ties go to the tallest).
+struct t_box_width_comp {
+  t_box_width_comp (const t_box_list& boxes) : boxes(boxes) {}
+
+  bool operator() (t_box_id lhs, t_box_id rhs) const {
+    if (boxes.width[lhs] != boxes.width[rhs])
+      return boxes.width[lhs] > boxes.width[rhs];
+    if (boxes.height[lhs] != boxes.height[rhs])
+      return boxes.height[lhs] > boxes.height[rhs];
+    return lhs < rhs;
+  }
+
+  const t_box_list& boxes;
+};
+
+
+/*!
+  Sorts by placing tallest boxes first with the ties broken by random keys. The 
+  boxes of a size share their key so they still come in the order of the list 
+  (see t_box_index::erase()).
+*/
+struct t_box_shuffled_comp {
+  t_box_shuffled_comp (const t_box_list& boxes, const std::vector<unsigned>& keys) : 
+    boxes(boxes), keys(keys) 
+  {}
+
+  bool operator() (t_box_id lhs, t_box_id rhs) const {
+    if (boxes.height[lhs] != boxes.height[rhs])
+      return boxes.height[lhs] > boxes.height[rhs];
+    if (keys[lhs] != keys[rhs])
+      return keys[lhs] < keys[rhs];
+    return lhs < rhs;
+  }
+
+  const t_box_list& boxes;
+  const std::vector<unsigned>& keys;
+};
+
+
+t_box_queue::t_box_queue (const t_box_list& boxes, const t_pack_strategy& strategy) :
+  order(), is_placed(boxes.size(), false), first(0), left(boxes.size())
+{
+  for (t_box_id id = 0; id < boxes.size(); ++id) {
+    order.push_back(id);
+  }
+
+  switch (strategy.order) {
+  case e_by_height: 
+    std::sort(order.begin(), order.end(), t_box_height_comp(boxes)); 
+    break;
+  case e_by_area: 
+    std::sort(order.begin(), order.end(), t_box_area_comp(boxes)); 
+    break;
+  case e_by_width: 
+    std::sort(order.begin(), order.end(), t_box_width_comp(boxes)); 
+    break;
+  case e_by_shuffled_height: {
+    std::vector<unsigned> keys;
+    for (t_box_id id = 0; id < boxes.size(); ++id) {
+      unsigned seed = strategy.seed ^ (boxes.width[id] * 73856093u) ^ (boxes.height[id] * 19349663u);
+      keys.push_back(rand_r(&seed));
+    }
+    std::sort(order.begin(), order.end(), t_box_shuffled_comp(boxes, keys));
+    break;
+  }
+  }
+}
+
+
+void t_box_queue::erase (t_box_id id) {
+  assert(!is_placed[id] && "Box placed twice");
+  is_placed[id] = true;
+  --left;
+
+  while (first < order.size() && is_placed[order[first]]) {
+    ++first;
+  }
+}
+
+
+/*******************************************************************************
+ * Free list
+ ******************************************************************************/
+
+//! Returns false if there's already a free box at that position.
+bool t_free_list::insert (int box_x, int box_y, int box_height) {
+  t_free_pos first = 0;
+  t_free_pos last = size();
+  while (first < last) {
+    t_free_pos mid = (first + last) / 2;
+    if (is_before(box_x, box_y, mid) || (x[mid] == box_x && y[mid] == box_y))
+      last = mid;
+    else
+      first = mid + 1;
+  }
+
+  if (first < size() && x[first] == box_x && y[first] == box_y)
+    return false;
+
+  x.insert(x.begin() + first, box_x);
+  y.insert(y.begin() + first, box_y);
+  height.insert(height.begin() + first, box_height);
+  return true;
+}
+
+
+void t_free_list::erase (t_free_pos pos) {
+  x.erase(x.begin() + pos);
+  y.erase(y.begin() + pos);
+  height.erase(height.begin() + pos);
+}
+
+
+/*******************************************************************************
+ * Box index
+ ******************************************************************************/
+
+//! Orders by long side, short side and then by the order of the list.
+struct t_box_size_comp {
+  t_box_size_comp (const t_box_list& boxes) : boxes(boxes) {}
+
+  bool operator() (t_box_id lhs, t_box_id rhs) const {
+    int lhs_long = max(boxes.width[lhs], boxes.height[lhs]);
+    int rhs_long = max(boxes.width[rhs], boxes.height[rhs]);
+    if (lhs_long != rhs_long)
+      return lhs_long < rhs_long;
+
+    int lhs_short = min(boxes.width[lhs], boxes.height[lhs]);
+    int rhs_short = min(boxes.width[rhs], boxes.height[rhs]);
+    if (lhs_short != rhs_short)
+      return lhs_short < rhs_short;
+
+    return lhs < rhs;
+  }
+
+  const t_box_list& boxes;
+};
+
+
+//! Orders the sizes like the queue does (smallest first).
+struct t_size_rank_comp {
+  t_size_rank_comp (const std::vector<int>& widths, const std::vector<int>& heights) : 
+    widths(widths), heights(heights) 
+  {}
+
+  bool operator() (std::size_t lhs, std::size_t rhs) const {
+    int lhs_area = widths[lhs] * heights[lhs];
+    int rhs_area = widths[rhs] * heights[rhs];
+    if (lhs_area != rhs_area)
+      return lhs_area < rhs_area;
+    return heights[lhs] < heights[rhs];
+  }
+
+  const std::vector<int>& widths;
+  const std::vector<int>& heights;
+};
+
+
+t_box_index::t_box_index (const t_box_list& boxes) :
+  sizes(), ids(), box_sizes(boxes.size()), widths(), heights(), ranks(), rank_sizes(),
+  leaf_count(1), best(), min_short()
+{
+  for (t_box_id id = 0; id < boxes.size(); ++id) {
+    ids.push_back(id);
+  }
+  std::sort(ids.begin(), ids.end(), t_box_size_comp(boxes));
+
+  for (std::size_t i = 0; i < ids.size(); ++i) {
+    t_box_id id = ids[i];
+    int width = min(boxes.width[id], boxes.height[id]);
+    int height = max(boxes.width[id], boxes.height[id]);
+
+    if (sizes.empty() || widths.back() != width || heights.back() != height) {
+      t_size size;
+      size.next = i;
+      size.end = i;
+      sizes.push_back(size);
+      widths.push_back(width);
+      heights.push_back(height);
+    }
+
+    sizes.back().end++;
+    box_sizes[id] = sizes.size() - 1;
+  }
+
+  for (std::size_t size = 0; size < sizes.size(); ++size) {
+    rank_sizes.push_back(size);
+  }
+  std::sort(rank_sizes.begin(), rank_sizes.end(), t_size_rank_comp(widths, heights));
+
+  ranks.resize(sizes.size());
+  for (std::size_t rank = 0; rank < rank_sizes.size(); ++rank) {
+    ranks[rank_sizes[rank]] = rank;
+  }
+
+  std::size_t block_count = (sizes.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  widths.resize(block_count * BLOCK_SIZE, INT_MAX);
+  heights.resize(block_count * BLOCK_SIZE, INT_MAX);
+  ranks.resize(block_count * BLOCK_SIZE, -1);
+
+  while (leaf_count < block_count) 
+    leaf_count *= 2;
+
+  best.resize(2 * leaf_count, -1);
+  min_short.resize(2 * leaf_count, INT_MAX);
+
+  for (std::size_t block = 0; block < block_count; ++block) {
+    best[leaf_count + block] = search_block(block, INT_MAX, INT_MAX);
+    min_short[leaf_count + block] = 
+      *std::min_element(widths.begin() + block * BLOCK_SIZE, 
+			widths.begin() + (block + 1) * BLOCK_SIZE);
+  }
+
+  for (std::size_t node = leaf_count - 1; node > 0; --node) {
+    best[node] = max(best[2 * node], best[2 * node + 1]);
+    min_short[node] = min(min_short[2 * node], min_short[2 * node + 1]);
+  }
+}
+
+
+//! The boxes of a size must be removed in the order of the list.
+void t_box_index::erase (t_box_id id) {
+  std::size_t size = box_sizes[id];
+  assert(ids[sizes[size].next] == id && "Box taken out of order");
+
+  if (++sizes[size].next < sizes[size].end)
     return;
 
-  t_box free_copy = *free_it;
-  free_copy.height = height;
-  free_list.insert(free_copy);
+  ranks[size] = -1;
+  widths[size] = INT_MAX;
+  update(size / BLOCK_SIZE);
 }
 
 
-//! Sets the free box's y to a new value or deletes it if the height becomes 0.
-void set_free_y (t_free_it free_it, t_free_list& free_list, int new_y) {
-  free_list.erase(free_it);
-  int new_height = free_it->height - (new_y - free_it->y);
-  if (new_height <= 0) 
+//! Looks up the biggest box that fits in the free box.
+bool t_box_index::search (int free_width, int free_height, t_box_id& found, int& area) const {
+  int long_side = max(free_width, free_height);
+  int short_side = min(free_width, free_height);
+
+  // Sizes that aren't too tall.
+  std::size_t first = 0;
+  std::size_t last = sizes.size();
+  while (first < last) {
+    std::size_t mid = (first + last) / 2;
+    if (heights[mid] <= long_side)
+      first = mid + 1;
+    else
+      last = mid;
+  }
+
+  int found_rank = -1;
+  search(1, 0, leaf_count, first, long_side, short_side, found_rank);
+  if (found_rank < 0)
+    return false;
+
+  std::size_t size = rank_sizes[found_rank];
+  found = ids[sizes[size].next];
+  area = widths[size] * heights[size];
+  return true;
+}
+
+
+/*!
+  Returns the best rank of the block that fits in long_side by short_side (-1 if
+  none). The sizes that were used up never fit since their rank is -1.
+*/
+int t_box_index::search_block (std::size_t block, int long_side, int short_side) const {
+  std::size_t first = block * BLOCK_SIZE;
+
+#ifdef __AVX2__
+  const __m256i long_limit = _mm256_set1_epi32(long_side);
+  const __m256i short_limit = _mm256_set1_epi32(short_side);
+  __m256i found = _mm256_set1_epi32(-1);
+
+  for (std::size_t i = first; i < first + BLOCK_SIZE; i += 8) {
+    __m256i height = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&heights[i]));
+    __m256i width = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&widths[i]));
+    __m256i rank = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&ranks[i]));
+
+    // The rank of the sizes that don't fit becomes -1.
+    __m256i is_too_big = _mm256_or_si256(_mm256_cmpgt_epi32(height, long_limit), 
+					 _mm256_cmpgt_epi32(width, short_limit));
+    found = _mm256_max_epi32(found, _mm256_or_si256(rank, is_too_big));
+  }
+
+  __m128i half = _mm_max_epi32(_mm256_castsi256_si128(found), 
+			       _mm256_extracti128_si256(found, 1));
+  half = _mm_max_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+  half = _mm_max_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(half);
+
+#else
+  int found = -1;
+  for (std::size_t i = first; i < first + BLOCK_SIZE; ++i) {
+    if (heights[i] <= long_side && widths[i] <= short_side && ranks[i] > found)
+      found = ranks[i];
+  }
+  return found;
+#endif
+}
+
+
+//! A size of the block was used up so the leaf and the nodes above it are updated.
+void t_box_index::update (std::size_t block) {
+  std::size_t node = leaf_count + block;
+  best[node] = search_block(block, INT_MAX, INT_MAX);
+  min_short[node] = *std::min_element(widths.begin() + block * BLOCK_SIZE, 
+				      widths.begin() + (block + 1) * BLOCK_SIZE);
+
+  for (node /= 2; node > 0; node /= 2) {
+    best[node] = max(best[2 * node], best[2 * node + 1]);
+    min_short[node] = min(min_short[2 * node], min_short[2 * node + 1]);
+  }
+}
+
+
+/*!
+  Searches the blocks of the node which covers [first, last) that start before the
+  size end. The child with the best rank is searched first so the other one can 
+  usually be skipped.
+*/
+void t_box_index::search (std::size_t node, std::size_t first, std::size_t last,
+			  std::size_t end, int long_side, int short_side, int& found) const
+{
+  if (first * BLOCK_SIZE >= end || min_short[node] > short_side || best[node] <= found)
     return;
 
-  t_box free_copy = *free_it;
-  free_copy.height = new_height;
-  free_copy.y = new_y;
-  free_list.insert(free_copy);
+  if (last - first == 1) {
+    found = max(found, search_block(first, long_side, short_side));
+    return;
+  }
+
+  std::size_t mid = (first + last) / 2;
+  if (best[2 * node + 1] > best[2 * node]) {
+    search(2 * node + 1, mid, last, end, long_side, short_side, found);
+    search(2 * node, first, mid, end, long_side, short_side, found);
+  }
+  else {
+    search(2 * node, first, mid, end, long_side, short_side, found);
+    search(2 * node + 1, mid, last, end, long_side, short_side, found);
+  }
+}
+
+
+/*******************************************************************************
+ * Skyline solver
+ ******************************************************************************/
+
+/*!
+  Packs the boxes tallest first against a skyline that spans the fixed side of the
+  bin. If no side is fixed, the height is set by the tallest box like pack_boxes()
+  does. Every box must fit across the span.
+*/
+t_box pack_boxes_skyline (t_box_list& box_list, const t_pack_config& config) {
+  t_box bin;
+  if (box_list.size() == 0)
+    return bin;
+
+  // The span is along y unless the width is fixed.
+  bool is_span_x = config.bin_width > 0;
+  int span = is_span_x ? config.bin_width : config.bin_height;
+
+  if (span == 0) {
+    for (t_box_id id = 0; id < box_list.size(); ++id) {
+      span = max(span, max(box_list.width[id], box_list.height[id]));
+    }
+  }
+
+  std::vector<t_box_id> order;
+  for (t_box_id id = 0; id < box_list.size(); ++id) {
+    order.push_back(id);
+  }
+  std::sort(order.begin(), order.end(), t_box_height_comp(box_list));
+
+  t_skyline skyline (span);
+
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    t_box_id id = order[i];
+    int long_side = max(box_list.width[id], box_list.height[id]);
+    int short_side = min(box_list.width[id], box_list.height[id]);
+
+    // Try the box across (w along u) and along the skyline.
+    int u = 0, v = 0, across = -1;
+    int along_u = 0, along_v = 0;
+    if (skyline.find(short_side, long_side, u, v)) {
+      along_u = u;
+      along_v = v;
+      across = short_side;
+    }
+    if (skyline.find(long_side, short_side, u, v) && 
+	(across < 0 || v + short_side < along_v + long_side))
+    {
+      along_u = u;
+      along_v = v;
+      across = long_side;
+    }
+    assert(across > 0 && "Box wider then the span of the bin");
+
+    int along = across == short_side ? long_side : short_side;
+    skyline.place(along_u, across, along_v + along);
+
+    if (is_span_x) {
+      box_list.width[id] = across;
+      box_list.height[id] = along;
+      box_list.x[id] = along_u;
+      box_list.y[id] = along_v;
+    }
+    else {
+      box_list.width[id] = along;
+      box_list.height[id] = across;
+      box_list.x[id] = along_v;
+      box_list.y[id] = along_u;
+    }
+
+    std::cerr << "S ";
+    box_list.get(id).print();
+  }
+
+  bin.width = is_span_x ? span : skyline.top();
+  bin.height = is_span_x ? skyline.top() : span;
+  return bin;
+}
+
+
+t_skyline::t_skyline (int span) : segments(), span(span), max_top(0) {
+  t_segment ground;
+  ground.u = 0;
+  ground.v = 0;
+  segments.push_back(ground);
+}
+
+
+/*!
+  Looks up the lowest spot for a box that's width across the span and height along
+  it. On a tie, the spot closest to 0 wins. Returns false if the box is too wide.
+
+  The candidate spots start at each segment. As the start moves along, the end of 
+  the box only moves forward so the segments under the box are kept in a deque 
+  where each one is lower then the one before it, the first one being the highest.
+*/
+bool t_skyline::find (int width, int height, int& u, int& v) const {
+  if (width > span)
+    return false;
+
+  std::vector<std::size_t> window (segments.size());
+  std::size_t window_first = 0, window_last = 0;
+
+  bool is_found = false;
+  std::size_t next = 0;
+
+  for (std::size_t first = 0; first < segments.size(); ++first) {
+    int first_u = segments[first].u;
+    if (first_u + width > span)
+      break;
+
+    // Add the segments that the box covers.
+    while (next < segments.size() && segments[next].u < first_u + width) {
+      while (window_last > window_first && segments[window[window_last - 1]].v <= segments[next].v)
+	--window_last;
+      window[window_last++] = next++;
+    }
+
+    // Drop the segments that are now behind the box.
+    while (window[window_first] < first) 
+      ++window_first;
+
+    int level = segments[window[window_first]].v;
+    if (!is_found || level + height < v + height) {
+      is_found = true;
+      u = first_u;
+      v = level;
+    }
+  }
+
+  return is_found;
+}
+
+
+//! Raises the skyline to top from u over width (u must be the start of a segment).
+void t_skyline::place (int u, int width, int top) {
+  std::size_t first = 0;
+  std::size_t last = segments.size();
+  while (first < last) {
+    std::size_t mid = (first + last) / 2;
+    if (segments[mid].u < u)
+      first = mid + 1;
+    else
+      last = mid;
+  }
+  assert(first < segments.size() && segments[first].u == u);
+
+  // Segments covered by the box. The last one might go past it in which case
+  // what's left of it now starts after the box.
+  std::size_t covered = first;
+  while (covered < segments.size() && end(covered) <= u + width)
+    ++covered;
+
+  t_segment replacement[2];
+  replacement[0].u = u;
+  replacement[0].v = top;
+  std::size_t count = 1;
+
+  if (covered < segments.size() && segments[covered].u < u + width) {
+    replacement[1].u = u + width;
+    replacement[1].v = segments[covered].v;
+    ++count;
+    ++covered;
+  }
+
+  segments.erase(segments.begin() + first, segments.begin() + covered);
+  segments.insert(segments.begin() + first, replacement, replacement + count);
+
+  // Merge with the neighbours that are at the same level.
+  if (first + 1 < segments.size() && segments[first + 1].v == top) 
+    segments.erase(segments.begin() + first + 1);
+  if (first > 0 && segments[first - 1].v == top)
+    segments.erase(segments.begin() + first);
+
+  max_top = max(max_top, top);
+}
+
+
+/*******************************************************************************
+ * Portfolio solver
+ ******************************************************************************/
+
+/*!
+  Every order with every policy. They always run so the portfolio is never worse 
+  then the free list engine (which is the first one).
+*/
+const std::size_t FIXED_STRATEGIES = 9;
+
+
+//! Strategy of a packing of the portfolio. The shuffled ones are endless.
+t_pack_strategy portfolio_strategy (std::size_t index) {
+  t_pack_strategy strategy;
+  strategy.is_traced = false;
+  strategy.policy = static_cast<t_free_policy>(index % 3);
+
+  if (index < FIXED_STRATEGIES) {
+    strategy.order = static_cast<t_box_order>(index / 3);
+  }
+  else {
+    strategy.order = e_by_shuffled_height;
+    strategy.seed = index;
+  }
+  return strategy;
+}
+
+
+/*!
+  State shared by the threads of the portfolio. Each thread pulls the next strategy
+  and packs its own copy of the boxes. The smallest bin is kept along with its 
+  boxes (on a tie, the first strategy wins so the result doesn't depend on timing).
+*/
+struct t_portfolio {
+  t_portfolio (const t_box_list& boxes, double deadline) :
+    boxes(boxes), deadline(deadline), next(0), done(0), 
+    best_index(0), best_bin(), best_boxes()
+  {
+    pthread_mutex_init(&lock, NULL);
+  }
+
+  ~t_portfolio () {
+    pthread_mutex_destroy(&lock);
+  }
+
+  const t_box_list& boxes;
+  double deadline;
+
+  pthread_mutex_t lock;
+  std::size_t next;
+  std::size_t done;
+
+  std::size_t best_index;
+  t_box best_bin;
+  t_box_list best_boxes;
+
+private :
+
+  // Equivalent of boost::noncopyable.
+  t_portfolio(const t_portfolio& src) : boxes(src.boxes) {}
+  t_portfolio& operator= (const t_portfolio& src) {return *this;}
+
+};
+
+
+void* run_portfolio (void* arg) {
+  t_portfolio* portfolio = static_cast<t_portfolio*>(arg);
+
+  while (true) {
+    pthread_mutex_lock(&portfolio->lock);
+    std::size_t index = portfolio->next;
+    bool is_over = index >= FIXED_STRATEGIES && now_seconds() >= portfolio->deadline;
+    if (!is_over) 
+      ++portfolio->next;
+    pthread_mutex_unlock(&portfolio->lock);
+
+    if (is_over)
+      break;
+
+    t_box_list boxes = portfolio->boxes;
+    t_box bin = pack_boxes(boxes, portfolio_strategy(index));
+
+    pthread_mutex_lock(&portfolio->lock);
+    // The area of a big bin doesn't fit in an int.
+    long long area = static_cast<long long>(bin.width) * bin.height;
+    long long best_area = static_cast<long long>(portfolio->best_bin.width) * 
+      portfolio->best_bin.height;
+
+    bool is_best = portfolio->done == 0 || area < best_area ||
+      (area == best_area && index < portfolio->best_index);
+    if (is_best) {
+      portfolio->best_index = index;
+      portfolio->best_bin = bin;
+      portfolio->best_boxes = boxes;
+    }
+    ++portfolio->done;
+    pthread_mutex_unlock(&portfolio->lock);
+  }
+
+  return NULL;
+}
+
+
+/*!
+  Packs the boxes with many strategies at once and keeps the smallest bin. The 
+  fixed strategies always run and the shuffled ones are started on every thread 
+  until the time budget runs out (a packing that was started is always finished).
+  None of the packings are traced.
+*/
+t_box pack_boxes_portfolio (t_box_list& box_list, const t_pack_config& config) {
+  if (box_list.size() == 0)
+    return t_box();
+
+  int nb_threads = config.nb_threads;
+  if (nb_threads == 0)
+    nb_threads = max(1, static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)));
+
+  t_portfolio portfolio (box_list, now_seconds() + config.time_budget);
+
+  std::vector<pthread_t> threads (nb_threads);
+  for (int i = 0; i < nb_threads; ++i) {
+    int err = pthread_create(&threads[i], NULL, run_portfolio, &portfolio);
+    if (err != 0) {
+      std::cerr << "Unable to create the packing threads!" << std::endl;
+      exit(1);
+    }
+  }
+
+  for (int i = 0; i < nb_threads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  const char* order_names[] = {"height", "area", "width", "shuffled height"};
+  const char* policy_names[] = {"biggest box", "first free", "tightest free"};
+  t_pack_strategy best = portfolio_strategy(portfolio.best_index);
+  
+  std::cerr << "Portfolio: " << portfolio.done << " packings on " << nb_threads 
+	    << " threads, best by " << order_names[best.order] 
+	    << " with " << policy_names[best.policy] << std::endl;
+
+  box_list = portfolio.best_boxes;
+  return portfolio.best_bin;
 }
 
 
@@ -439,21 +1527,55 @@ void set_free_y (t_free_it free_it, t_free_list& free_list, int new_y) {
 
 /*!
   Properly orders the blocks before running the solution on our dataset.
-  It also prints out the results.
+  It also prints out the results along with the time it took and the density of
+  the bin (the area of the boxes over the area of the bin) so the engines can be
+  compared.
 */
-void run_packer (t_box_list& list) {
+void run_packer (t_box_list& list, const t_pack_config& config) {
 
   // Algo requires that every box be taller then they are long.
-  for (t_box_it it = list.begin(); it != list.end(); ++it) {
-    if (it->height < it->width) {
-      std::swap(it->height, it->width);
+  long long box_area = 0;
+  int max_short = 0;
+  for (t_box_id id = 0; id < list.size(); ++id) {
+    if (list.height[id] < list.width[id]) {
+      std::swap(list.height[id], list.width[id]);
     }
+    box_area += list.area(id);
+    max_short = max(max_short, list.width[id]);
+  }
+
+  int fixed_side = max(config.bin_width, config.bin_height);
+  if (fixed_side > 0 && max_short > fixed_side) {
+    std::cerr << "A box of width " << max_short << " doesn't fit in the bin." << std::endl;
+    exit(1);
   }
 
   // Execute the algo.
-  t_box bin = pack_boxes (list);
+  double start = now_seconds();
+  t_box bin;
+  switch (config.engine) {
+  case e_free_list: bin = pack_boxes(list); break;
+  case e_skyline: bin = pack_boxes_skyline(list, config); break;
+  case e_portfolio: bin = pack_boxes_portfolio(list, config); break;
+  }
+  double seconds = now_seconds() - start;
+
   print_boxes(list, bin);
-  std::cout << bin.area() << std::endl;
+  std::cout << static_cast<long long>(bin.width) * bin.height << std::endl;
+
+  double density = bin.width > 0 && bin.height > 0 ? 
+    box_area / (double(bin.width) * bin.height) : 0;
+  const char* engine_names[] = {"free list", "skyline", "portfolio"};
+  fprintf(stderr, "%s engine: %lu boxes in %.3fs with a density of %.3f\n", 
+	  engine_names[config.engine], 
+	  static_cast<unsigned long>(list.size()), seconds, density);
+}
+
+
+double now_seconds () {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
 }
 
 
@@ -530,6 +1652,53 @@ void run_tests () {
     run_packer(list);
   }
 
+  // Same boxes with the skyline engine, on its own and in a fixed width atlas.
+  {
+    t_pack_config config;
+    config.engine = e_skyline;
+
+    for (int run = 0; run < 2; ++run) {
+      srand(1);
+      t_box_list list;
+      for (int i = 0; i < 20; ++i) {
+	int w = rand() % 97 + 3;
+	int h = rand() % 97 + 3;
+	list.push_back(t_box(w,h));
+      }
+      for (int i = 0; i < 80; ++i) {
+	int w = rand() % 17 + 3;
+	int h = rand() % 17 + 3;
+	list.push_back(t_box(w,h));
+      }
+
+      run_packer(list, config);
+      config.bin_width = 256;
+    }
+  }
+
+  // Same boxes with the portfolio on a few threads and a short time budget.
+  {
+    t_pack_config config;
+    config.engine = e_portfolio;
+    config.nb_threads = 4;
+    config.time_budget = 0.1;
+
+    srand(1);
+    t_box_list list;
+    for (int i = 0; i < 20; ++i) {
+      int w = rand() % 97 + 3;
+      int h = rand() % 97 + 3;
+      list.push_back(t_box(w,h));
+    }
+    for (int i = 0; i < 80; ++i) {
+      int w = rand() % 17 + 3;
+      int h = rand() % 17 + 3;
+      list.push_back(t_box(w,h));
+    }
+
+    run_packer(list, config);
+  }
+
 }
 
 
@@ -575,8 +1744,8 @@ void print_boxes (const t_box_list& box_list, const t_box& bin) {
   // We first print to a 2d array which we then output to the stream.
   //   Note that we also try to detect any overlapping squares while doing this.
   //   While that doesn't happen anymore it's still a good idea to check the output.
-  for (t_box_cit box_it = box_list.begin(); box_it != box_list.end(); ++box_it) {
-    const t_box& box = *box_it; 
+  for (t_box_id id = 0; id < box_list.size(); ++id) {
+    const t_box box = box_list.get(id);
     //    box.print();
 
     // Print the height side.
@@ -12,17 +12,24 @@ Considering the vagueness of the original question, we worked with a few assumpt
   - It's difficult to achieve user friendly-ness without an actual target user so
     this program uses the "plain english" part of the question for it's output.
     Note that modifying the output to suit any type of user is quite trivial (see
-    the print() functions in the t_event structs).
+    the t_event_writer class). JSON lines and a compact binary record are also
+    available for other programs.
 
   - We assume that the event stream is a strict substream of a larger event stream.
     Given this assumption, detecting folder copy is prone to false negatives/positives.
-    For that we reason, we don't detect it.
+    For that reason, only the folders that were created within the stream are used as
+    the source of a folder copy since those are the only ones we know the content of.
 
-  - We currently assume that the input events are ordered by their timestamp.
+  - We assume that the input events are ordered by their timestamp. Events that are
+    slightly out of order can be put back in order with the -w (timestamps) and -c
+    (events) options. Events that arrive after the window closed are reported.
 
   - We assume that only one higher level event can be executed at any time. For example,
     if two folder moves are executed then all the event for the first move will be present
     before all the events for the second move (as oposed to the events being interleaved).
+    The -i option relaxes this: a DEL event can then be paired with any ADD event that
+    comes within the given number of timestamps. The ADD events of a folder still have
+    to come together.
 
   - We assume that we need to display a history of all manipulations and not just the
     end result like a diff. This means that a single file being moved twice won't
@@ -31,12 +38,19 @@ Considering the vagueness of the original question, we worked with a few assumpt
   - We can't know how long an operation takes so for this reason we don't use the
     timestamp for anything.
 
+  - Events are simplified as they arrive. An event stays in the event list only as
+    long as a later event could still be merged with it. When the -s option is
+    given, every other event is printed and dropped right away so that memory
+    stays proportional to the folder operations currently in flight and not to
+    the length of the log (the hash index and the path trie still hold every
+    live file).
+
 
 Given those assumptions, here are the operations supported:
 
   - Move file and folder.
   - Rename file and folder.
-  - Copy file.
+  - Copy file and folder.
   - Delete folder (collapses multiple delete events for a folder).
 
 
@@ -60,23 +74,85 @@ have the time to write a full suite of proper tests for it.
 #include <sstream>
 
 #include <string>
-#include <list>
+#include <vector>
+#include <deque>
+#include <queue>
 #include <map>
-#include <set>
 #include <algorithm>
 #include <iterator>
 
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
 #include <cassert>
 
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "filevents.h"
+
+#ifdef FILEVENTS_STATS
+#include <csignal>
+#include <time.h>
+#endif
+
+#ifdef FILEVENTS_BENCHMARK
+#include <new>
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+// The internals of the library are kept out of the programs that link with it.
+#ifdef FILEVENTS_LIBRARY
+namespace {
+#endif
+
 
 /*******************************************************************************
  * Constants
  ******************************************************************************/
 
 static const std::string SEP("/");
-static const std::string NULL_HASH("-");
+
+// Hash of the folders in the input.
+static const char* NULL_HASH_TEXT = "-";
+
+// Size of the reads when the input can't be memory mapped.
+static const std::size_t READ_BLOCK_SIZE = 1 << 20;
+
+// Size of the output buffer.
+static const std::size_t WRITE_BLOCK_SIZE = 1 << 20;
+
+// Parent of the root and of relative paths. Also marks the empty slots of the trie.
+static const unsigned NULL_PATH = 0;
+static const unsigned ROOT_PATH = 1;
+
+// Largest content hash we can hold (256 bits).
+static const std::size_t HASH_SIZE = 32;
+
+// Flags kept in the size of a t_hash along with its length.
+static const unsigned char HASH_RAW = 0x80;
+static const unsigned char HASH_LONG = 0x40;
+
+// Number of events allocated at once by the event pool.
+static const std::size_t EVENT_CHUNK_SIZE = 1 << 10;
+
+// Number of paths the trie holds before it's first collected (see collect_paths()).
+static const std::size_t TRIE_COLLECT_SIZE = 1 << 16;
+
+// First bytes of a checkpoint file and version of its layout.
+static const char CHECKPOINT_MAGIC[] = "FEVCKPT";
+static const uint64_t CHECKPOINT_VERSION = 6;
 
 
 /*******************************************************************************
@@ -85,37 +161,22 @@ static const std::string NULL_HASH("-");
 
 struct t_algo_state;
 
+class t_checkpoint_writer;
+class t_checkpoint_reader;
+
 struct t_event;
 typedef t_event* p_event;
 
-typedef std::list<std::string> t_path;
-typedef t_path::iterator t_path_it;
-typedef t_path::const_iterator t_path_cit;
-
-typedef std::string t_hash;
-
-typedef std::multimap<t_hash, t_path> t_hash_index;
-typedef t_hash_index::value_type t_index_pair;
-typedef t_hash_index::iterator t_index_it;
-typedef t_hash_index::const_iterator t_index_cit;
-
-// Maps a sub-path to a hash value.
-typedef std::map<std::string, t_hash> t_tree;
-typedef t_tree::value_type t_tree_pair;
-typedef t_tree::iterator t_tree_it;
-typedef t_tree::const_iterator t_tree_cit;
-
-// Maps folder names to their tree.
-typedef std::multimap<std::string, t_tree> t_tree_index;
-typedef t_tree_index::value_type t_tree_index_pair;
-typedef t_tree_index::iterator t_tree_index_it;
-typedef t_tree_index::const_iterator t_tree_index_cit;
+//! Events ordered by their timestamp.
+typedef std::deque<p_event> t_event_list;
+typedef t_event_list::iterator t_event_it;
+typedef t_event_list::const_iterator t_event_cit;
 
+// Id of a node in the path trie.
+typedef unsigned t_path;
 
-typedef std::map<std::string, t_hash> t_tree;
-typedef t_tree::value_type t_tree_pair;
-typedef t_tree::iterator t_tree_it;
-typedef t_tree::const_iterator t_tree_cit;
+// Hash of a set of sub-paths and their content.
+typedef uint64_t t_digest;
 
 
 /*******************************************************************************
@@ -135,933 +196,6940 @@ enum t_file_type {
   e_folder
 };
 
+enum t_output_format {
+  e_text,
+  e_json,
+  e_binary
+};
+
 
 /*******************************************************************************
- * Iterator utilities
+ * class t_path_trie
  ******************************************************************************/
 
-template <typename Iterator>
-Iterator dec(const Iterator& it) {
-  Iterator copy = it;
-  copy--;
-  return copy;
-}
-
+/*!
+  Interns every path we come across in a single trie so that a path can be passed
+  around as the id of its last node. Nodes keep a link to their parent and their
+  depth which turns parent lookups, comparisons and prefix checks into integer
+  manipulations.
 
-template <typename Iterator>
-Iterator inc(const Iterator& it) {
-  Iterator copy = it;
-  copy++;
-  return copy;
-}
+  Children are found through an open addressing table keyed on the parent id and
+  the name. Names are packed together in a single buffer. Each node also caches the
+  digest values of its name (see entry_digest()).
 
+  The nodes that are no longer used are freed by collect() once the users marked the 
+  ones they still hold (see collect_paths()). The ids of the freed nodes are reused so
+  the trie only grows with the number of paths in use.
 
-/*******************************************************************************
- * Prototypes
- ******************************************************************************/
+  The trie also interns the content hashes that are too long to be held by a t_hash
+  (see make_hash()). There are usually few of them and they're never freed.
 
-bool operator== (const t_path& lhs, const t_path& rhs);
-t_path get_parent (const t_path& path);
-std::string get_name (const t_path& path);
-t_path make_path (const std::string& raw_path);
-std::string path_to_string (const t_path& path);
-std::string path_to_string (const t_path_cit start, const t_path_cit end);
+  Paths are always made and read through path_trie(), the trie of the current thread.
+  The program only ever uses main_trie while each t_filevents has its own trie that is
+  current for the duration of its calls (see t_trie_scope).
+*/
+class t_path_trie {
 
+  // Equivalent of boost::noncopyable.
+  t_path_trie(const t_path_trie& src) {}
+  t_path_trie& operator= (const t_path_trie& src) {return *this;}
 
-/*******************************************************************************
- * struct t_event
- ******************************************************************************/
+public :
+  t_path_trie ();
 
-struct t_event { 
+  t_path intern (t_path parent, const char* first, const char* last);
 
-  t_file_type file_type;
-  t_event_type event_type;
-  long timestamp;
+  t_path parent (t_path path) const {return nodes[path].parent;}
+  unsigned depth (t_path path) const {return nodes[path].depth;}
+  std::string name (t_path path) const {
+    return std::string(name_data(path), nodes[path].name_size);
+  }
+  const char* name_data (t_path path) const {return &names[nodes[path].name_offset];}
+  std::size_t name_size (t_path path) const {return nodes[path].name_size;}
+  bool is_same_name (t_path lhs, t_path rhs) const;
+  bool is_named (t_path path, const char* first, const char* last) const {
+    return nodes[path].name_size == static_cast<std::size_t>(last - first) &&
+      std::equal(first, last, name_data(path));
+  }
+  t_path ancestor (t_path path, unsigned depth) const;
 
-  virtual ~t_event() {} 
+  t_digest name_digest (t_path path) const {return nodes[path].name_digest;}
+  t_digest scale (t_path path) const {return nodes[path].scale;}
 
-  virtual void print() = 0;
-  std::string get_type_name() {return file_type == e_file ? "file" : "folder";}
+  unsigned intern_hash (const char* first, const char* last);
+  const std::string& long_hash (unsigned id) const {return long_hashes[id];}
+  std::size_t long_hash_count () const {return long_hashes.size();}
 
-protected :
+  //! Every id is below the size (including the ids of the freed nodes).
+  std::size_t size () const {return nodes.size();}
+  std::size_t live () const {return nodes.size() - free_nodes.size();}
 
-  t_event(t_file_type f, t_event_type ev, long ts) : 
-    file_type(f), event_type(ev), timestamp(ts) 
-  {}
+  bool should_collect () const {return live() >= collect_size;}
+  void mark (t_path path, std::vector<char>& marks) const;
+  void collect (const std::vector<char>& marks);
 
-};
+  void save (t_checkpoint_writer& out) const;
+  void load (t_checkpoint_reader& in);
 
+private :
 
-/*******************************************************************************
- * t_event Utilities
- ******************************************************************************/
+  struct t_node {
+    t_path parent;
+    unsigned depth;
+    unsigned name_offset;
+    unsigned name_size;
 
-struct t_event_set_comp : public std::binary_function<p_event, p_event, bool> {
-  bool operator() (const p_event lhs, const p_event rhs) const {
-    return lhs->timestamp < rhs->timestamp;
-  }
-};
+    // See entry_digest().
+    t_digest name_digest;
+    t_digest scale;
+  };
 
+  std::size_t hash (t_path parent, const char* first, const char* last) const;
+  void rehash (std::size_t table_size);
 
-typedef std::multiset<p_event, t_event_set_comp> t_event_list;
-typedef t_event_list::iterator t_event_it;
-typedef t_event_list::const_iterator t_event_cit;
+  std::vector<t_node> nodes;
+  std::vector<char> names;
+  std::vector<t_path> children;
 
+  // Freed nodes (depth of 0) with the lowest id at the back.
+  std::vector<t_path> free_nodes;
+  std::size_t collect_size;
 
-bool operator== (const t_event_list& lhs, const t_event_list& rhs) {
-  if (lhs.size() != rhs.size()) 
-    return false;
+  std::vector<std::string> long_hashes;
+  std::map<std::string, unsigned> long_hash_ids;
 
-  t_event_cit lhs_it = lhs.begin();
-  t_event_cit rhs_it = rhs.begin();
+};
 
-  for (; lhs_it != lhs.end(); ++lhs_it, ++rhs_it) {
-    if (*lhs_it != *rhs_it)
-      return false;
-  }
-  return true;  
-}
+t_path_trie main_trie;
 
+// The shard threads of the program read main_trie as well.
+__thread t_path_trie* cur_trie = &main_trie;
 
-/*******************************************************************************
- * struct t_event_new
- ******************************************************************************/
+inline t_path_trie& path_trie () {return *cur_trie;}
 
-struct t_event_new : public t_event { 
-  t_path path;
-  t_hash hash;
 
-  t_event_new(t_file_type f, long ts, const t_path& p, t_hash h = NULL_HASH) : 
-    t_event::t_event(f, e_new, ts), path(p), hash(h)
-  {}
+/*!
+  Makes a trie current for the lifetime of the scope and puts the previous one back
+  afterward.
+*/
+class t_trie_scope {
 
-  virtual void print() {
-    if (file_type ==  e_file) {
-      printf("Created the %s \"%s\" in the folder \"%s\" with the hash value \"%s\".\n",
-	     get_type_name().c_str(), 
-	     get_name(path).c_str(), 
-	     path_to_string(get_parent(path)).c_str(),
-	     hash.c_str());
-    }
+  // Equivalent of boost::noncopyable.
+  t_trie_scope(const t_trie_scope& src) {}
+  t_trie_scope& operator= (const t_trie_scope& src) {return *this;}
 
-    else {
-      printf("Created the %s \"%s\" in the folder \"%s\".\n",
-	     get_type_name().c_str(), 
-	     get_name(path).c_str(), 
-	     path_to_string(get_parent(path)).c_str(),
-	     hash.c_str());   
-    }
-  }
+public :
+  explicit t_trie_scope (t_path_trie& trie) : prev_trie(cur_trie) {cur_trie = &trie;}
+  ~t_trie_scope () {cur_trie = prev_trie;}
 
+private :
+  t_path_trie* prev_trie;
 };
 
 
 /*******************************************************************************
- * struct t_event_delete
+ * struct t_hash
  ******************************************************************************/
 
-struct t_event_delete : public t_event { 
-  t_path path;
-  t_hash hash;
+struct t_hash;
 
-  t_tree subtree;
+t_hash make_hash (const char* first, const char* last);
+const char* format_hash (const t_hash& hash, char* buffer, std::size_t& size);
+std::string hash_to_string (const t_hash& hash);
 
-  t_event_delete(t_file_type f, long ts, const t_path& p, const t_hash& h = NULL_HASH) : 
-    t_event::t_event(f, e_delete, ts), path(p), hash(h), subtree() {}
 
-  virtual void print() {
-    printf("Deleted the %s \"%s\" in the folder \"%s\".\n",
-	   get_type_name().c_str(), 
-	   get_name(path).c_str(), 
-	   path_to_string(get_parent(path)).c_str());
+/*!
+  Content hash of a file, decoded once when it's read. Hex hashes are stored as bytes
+  (so the case of the letters doesn't matter) while anything else is kept as is with
+  HASH_RAW set in the size so that the two can't be mixed up. A hash that doesn't fit
+  either way is interned as is in the path trie and only its id is kept with HASH_LONG
+  set. Whatever the case, the hash prints back to the same text.
+
+  The unused bytes are always 0 so the size and the bytes are compared and hashed as
+  a whole. The folders don't have a hash which is the all 0 NULL_HASH.
+*/
+struct t_hash {
+  t_hash () {std::memset(this, 0, sizeof(*this));}
+  t_hash (const char* str) {*this = make_hash(str, str + std::strlen(str));}
+  t_hash (const std::string& str) {*this = make_hash(str.data(), str.data() + str.size());}
+
+  std::size_t length () const {return size & ~(HASH_RAW | HASH_LONG);}
+  bool is_long () const {return size & HASH_LONG;}
+
+  //! Id of a long hash in the path trie.
+  unsigned long_id () const {
+    unsigned id;
+    std::memcpy(&id, bytes, sizeof(id));
+    return id;
   }
 
+  unsigned char size;
+  unsigned char bytes[HASH_SIZE];
+
+  // Only used to print the hash back.
+  bool is_upper;
 };
 
+static const t_hash NULL_HASH;
+
+inline bool operator== (const t_hash& lhs, const t_hash& rhs) {
+  return std::memcmp(&lhs.size, &rhs.size, 1 + HASH_SIZE) == 0;
+}
+
+inline bool operator!= (const t_hash& lhs, const t_hash& rhs) {
+  return !(lhs == rhs);
+}
+
 
 /*******************************************************************************
- * struct t_event_modify
+ * class t_hash_index
  ******************************************************************************/
 
-struct t_event_modify : public t_event {
-  t_path path;
-  t_hash old_hash;
-  t_hash new_hash;
-
-  t_event_modify(t_file_type f, 
-		 long ts,
-		 const t_path& p, 
-		 const t_hash& old_h, 
-		 const t_hash& new_h) : 
-    t_event::t_event(f, e_modify, ts), path(p), old_hash(old_h), new_hash(new_h) 
-  {}
-  virtual void print() {
-    printf("Modified the %s \"%s\" in the folder \"%s\". The new hash value is \"%s\".\n",
-	   get_type_name().c_str(), 
-	   get_name(path).c_str(), 
-	   path_to_string(get_parent(path)).c_str(), 
-	   new_hash.c_str());
+/*!
+  Maps the hash of every live file to the paths that have this content. 
+
+  Each distinct hash gets a bucket which holds a list of entries in insertion order
+  so that the oldest file is used as the source of a copy. Buckets are found through
+  an open addressing table (linear probing with backward shift deletion) and a path
+  finds its entry directly through its trie id. Everything lives in flat vectors
+  with free lists so nothing is allocated per file once the vectors are warm.
+*/
+class t_hash_index {
+
+  // Equivalent of boost::noncopyable.
+  t_hash_index(const t_hash_index& src) {}
+  t_hash_index& operator= (const t_hash_index& src) {return *this;}
+
+public :
+  t_hash_index ();
+
+  void insert (const t_hash& hash, t_path path);
+  void erase (const t_hash& hash, t_path path);
+  void erase (t_path path);
+  bool find (const t_hash& hash, t_path& path) const;
+  bool contains (t_path path) const {
+    return path < path_entries.size() && path_entries[path] != NIL;
   }
 
-};
+  std::size_t size () const {return entry_count;}
+  void print () const;
+  void mark_paths (std::vector<char>& marks) const;
 
+  void save (t_checkpoint_writer& out) const;
+  void load (t_checkpoint_reader& in);
 
-/*******************************************************************************
- * struct t_event_move
- ******************************************************************************/
+private :
 
-struct t_event_move : public t_event {
-  t_path old_path;
-  t_path new_path;
+  static const unsigned NIL = ~0U;
 
-  t_event_move(t_file_type f, long ts, const t_path& old_p, const t_path& new_p):
-    t_event::t_event(f, e_move, ts), old_path(old_p), new_path(new_p)
-  {}
+  struct t_bucket {
+    t_hash key;
+    std::size_t hash;
+    unsigned head;
+    unsigned tail;
+  };
 
-  bool is_rename() const { return get_name(old_path) != get_name(new_path);}
-  bool is_move() const { return get_parent(old_path) != get_parent(new_path);}
+  struct t_entry {
+    t_path path;
+    unsigned bucket;
+    unsigned prev;
+    unsigned next;
+  };
 
-  virtual void print() {
-    if (is_rename() && is_move()) {
-      printf("Moved the %s \"%s\" in the folder \"%s\" to the folder \"%s\" with the name \"%s\".\n",
-	     get_type_name().c_str(), 
-	     get_name(old_path).c_str(), 
-	     path_to_string(get_parent(old_path)).c_str(), 
-	     path_to_string(get_parent(new_path)).c_str(),
-	     get_name(new_path).c_str());
-    }
+  static std::size_t hash_key (const t_hash& key);
+  static bool is_index (unsigned index, std::size_t size) {return index == NIL || index < size;}
+  unsigned find_bucket (const t_hash& key, std::size_t hash, std::size_t& slot) const;
+  void erase_entry (unsigned entry);
+  void erase_slot (std::size_t slot);
+  void grow ();
 
-    else if (is_rename()) {
-      printf("Renamed the %s \"%s\" in the folder \"%s\" to \"%s\".\n",
-	     get_type_name().c_str(), 
-	     get_name(old_path).c_str(), 
-	     path_to_string(get_parent(old_path)).c_str(), 
-	     get_name(new_path).c_str());
-    }
+  std::vector<unsigned> table;
 
-    else if (is_move()) {
-      printf("Moved the %s \"%s\" in the folder \"%s\" to the folder \"%s\".\n",
-	     get_type_name().c_str(), 
-	     get_name(old_path).c_str(), 
-	     path_to_string(get_parent(old_path)).c_str(), 
-	     path_to_string(get_parent(new_path)).c_str());
-    }
-    
-    else { 
-      // We do nothing in this case since we removed and added the same file
-      //  at the same spot with the same hash.
-    }
+  std::vector<t_bucket> buckets;
+  unsigned free_bucket;
+  std::size_t bucket_count;
 
-  }
+  std::vector<t_entry> entries;
+  unsigned free_entry;
+  std::size_t entry_count;
+
+  // Entry of every indexed path.
+  std::vector<unsigned> path_entries;
 
 };
 
 
 /*******************************************************************************
- * struct t_event_copy
+ * Iterator utilities
  ******************************************************************************/
 
-struct t_event_copy : public t_event {
-  t_path src_path;
-  t_path dest_path;
-  
-  t_event_copy(t_file_type f, long ts, const t_path& src_p, const t_path& dest_p) :
-    t_event::t_event(f, e_copy, ts), src_path(src_p), dest_path(dest_p)
-  {}
-  virtual void print() {
-    printf("Copied the %s \"%s\" from the folder \"%s\" to the folder \"%s\" with the name \"%s\".\n",
-	   get_type_name().c_str(), 
-	   get_name(src_path).c_str(), 
-	   path_to_string(get_parent(src_path)).c_str(), 
-	   path_to_string(get_parent(dest_path)).c_str(),
-	   get_name(dest_path).c_str());
-  }
+template <typename Iterator>
+Iterator dec(const Iterator& it) {
+  Iterator copy = it;
+  copy--;
+  return copy;
+}
 
-};
+
+template <typename Iterator>
+Iterator inc(const Iterator& it) {
+  Iterator copy = it;
+  copy++;
+  return copy;
+}
 
 
 /*******************************************************************************
  * Prototypes
  ******************************************************************************/
 
-void add_to_state (t_algo_state& state, p_event ev);
-void simplify_state (t_algo_state& state);
-void print_state (t_algo_state& state);
+bool is_sub_path (t_path prefix, t_path path);
+t_path get_parent (t_path path);
+std::string get_name (t_path path);
+t_path make_path (const std::string& raw_path);
+t_path make_path (const char* first, const char* last);
+std::string path_to_string (t_path path);
+std::string path_to_string (t_path base, t_path path);
 
-void read_events (t_algo_state& state);
-void run_tests ();
+t_digest make_digest (const char* first, const char* last);
+t_digest mix_digest (t_digest x);
+t_digest entry_digest (t_path path, const t_hash& hash);
+t_digest relative_digest (t_digest digest, t_path base);
 
-void remove_from_index (t_algo_state& state, const t_hash& key, const t_path& value);
-void print_index (t_algo_state& state);
-void print_tree (const t_tree& tree);
-t_event_it remove_event (t_algo_state& state, t_event_it it);
-t_event_it remove_event (t_algo_state& state, t_event_it start, t_event_it end);
+struct t_subtree;
+t_hash make_subtree_key (const t_subtree& subtree, t_path base);
 
 
 /*******************************************************************************
- * struct t_algo_state
+ * struct t_subtree
  ******************************************************************************/
 
-class t_algo_state {
+/*!
+  Summary of the (sub-path, hash) entries of a folder. The digest is the sum of the
+  entry_digest() of every entry which means that entries can be added in any order
+  and that two subtrees can be merged with a single addition.
+*/
+struct t_subtree {
+  t_digest digest;
+  std::size_t size;
 
-  // Equivalent of boost::noncopyable.
-  t_algo_state(const t_algo_state& src) {}
-  bool operator= (const t_algo_state& src) {}
+  t_subtree () : digest(0), size(0) {}
 
-public :
-  t_algo_state () : hash_index(), events() {}
-  ~t_algo_state() {
-    remove_event(*this, events.begin(), events.end());
+  void add (t_path path, const t_hash& hash) {
+    digest += entry_digest(path, hash);
+    ++size;
   }
 
-  t_event_list events;
-
-  // Used to detect copy file events.
-  t_hash_index hash_index;
+  void add (const t_subtree& other) {
+    digest += other.digest;
+    size += other.size;
+  }
 
-  // Used to detect copy folder events.
-  t_tree_index tree_index;
+  void remove (const t_subtree& other) {
+    digest -= other.digest;
+    size -= other.size;
+  }
 
+  //! True if both subtrees have the same entries relative to their base folders.
+  bool is_same (t_path base, const t_subtree& other, t_path other_base) const {
+    return size == other.size && 
+      relative_digest(digest, base) == relative_digest(other.digest, other_base);
+  }
 };
 
 
 /*******************************************************************************
- * Entry point
+ * class t_tree_index
  ******************************************************************************/
 
-int main (int argc, char** argv) {
-  if (argc > 1) {
-    run_tests();
-  }
-  else {
-    t_algo_state state;
-    read_events (state);
-    simplify_state (state);
-    print_state (state);
-  }
-  return 0;
-}
+/*!
+  Keeps the subtree of every live folder that was created within the stream so that
+  a folder created with the same content can be reported as a copy. 
 
+  Every event updates the subtree of the live folders above it right away but the
+  folders are only re-keyed in the index when a lookup is made. The index itself is
+  a t_hash_index keyed on the relative digest and the size of the subtrees.
 
-/*******************************************************************************
- * File simplifications
- ******************************************************************************/
+  Only the folders that aren't in their initial state have a record. Records live in
+  a flat vector with a free list and a path finds its record through its trie id.
+*/
+class t_tree_index {
 
-//! Reduces an DEL and a ADD event to a MOVE event is the hash is the same.
-bool simplify_to_move_event(t_algo_state& state, p_event ev, t_event_it prev_ev_it) {
-  p_event prev_ev = *prev_ev_it;
+  // Equivalent of boost::noncopyable.
+  t_tree_index(const t_tree_index& src) {}
+  t_tree_index& operator= (const t_tree_index& src) {return *this;}
 
-  if (prev_ev->file_type == e_file && ev->event_type == e_new) {
-    const t_event_new* new_ev = static_cast<t_event_new*> (ev);
+public :
+  t_tree_index () : slots(), folders(), free_folders(), dirty(), index() {}
 
-    if (prev_ev->event_type == e_delete) {
-      const t_event_delete* prev_del_ev = static_cast<t_event_delete*>(prev_ev);
+  void insert (t_file_type type, t_path path, const t_hash& hash);
+  void erase (t_file_type type, t_path path, const t_hash& hash);
+  bool find (const t_subtree& subtree, t_path base, t_path& path);
 
-      if (prev_del_ev->hash == new_ev->hash) {
-	p_event move_ev = 
-	  new t_event_move(e_file, ev->timestamp, prev_del_ev->path, new_ev->path);
-	state.events.insert(move_ev);
+  std::size_t size () const {return index.size();}
+  void print () const {index.print();}
+  void mark_paths (std::vector<char>& marks) const;
 
-	// std::cout << "MOV - "; move_ev->print();
+  void save (t_checkpoint_writer& out) const;
+  void load (t_checkpoint_reader& in);
 
-	remove_event(state, prev_ev_it);
-	prev_ev_it = state.events.end();
-	prev_ev = NULL;
+private :
 
-	return true;
-      }
-    }
-  }
+  static const unsigned NIL = ~0U;
 
-  return false;
-}
+  struct t_folder {
+    // NULL_PATH if the record is free.
+    t_path path;
 
+    t_subtree subtree;
+    t_hash key;
+    bool is_live;
+    bool is_dirty;
+    bool is_indexed;
 
-/*!
-  Takes a DEL and an ADD event and reduces them to a MODIFY event if only the hash 
-  has changed.
-*/
-bool simplify_to_modify_event(t_algo_state& state, p_event ev, t_event_it prev_ev_it) {
-  p_event prev_ev = *prev_ev_it;
+    t_folder () : 
+      path(NULL_PATH), subtree(), key(), is_live(false), is_dirty(false), is_indexed(false) 
+    {}
+  };
 
-  if (prev_ev->file_type == e_file && ev->event_type == e_new) {
-    const t_event_new* new_ev = static_cast<t_event_new*> (ev);
+  t_folder* find_folder (t_path path);
+  t_folder& make_folder (t_path path);
+  void release_folder (t_path path);
 
-    if (prev_ev->event_type == e_delete) {
-      const t_event_delete* prev_del_ev = static_cast<t_event_delete*>(prev_ev);
+  void update_parents (t_path path, const t_subtree& entry, bool is_added);
+  void mark_dirty (t_folder& folder);
+  void refresh (t_path base);
 
-      if  (prev_del_ev->path == new_ev->path) {
-	p_event modify_ev = new t_event_modify(e_file, 
-					       ev->timestamp, 
-					       new_ev->path, 
-					       prev_del_ev->hash, 
-					       new_ev->hash);
-	state.events.insert(modify_ev);
+  // Record of every path id (NIL if the folder is in its initial state).
+  std::vector<unsigned> slots;
 
-	// std::cout << "MOD - "; modify_ev->print();
+  std::vector<t_folder> folders;
+  std::vector<unsigned> free_folders;
 
-	remove_event(state, prev_ev_it);
-	prev_ev_it = state.events.end();
-	prev_ev = NULL;
+  // Folders that changed since the last lookup.
+  std::vector<t_path> dirty;
 
-	return true;
-      }
-    }
-  }
+  t_hash_index index;
 
-  return false;
-}
+};
 
 
-//! Replaces an ADD event by a COPY event if the file's hash is in the index.
-bool simplify_to_copy_event(t_algo_state& state, p_event ev) {
-  if (ev->event_type == e_new) {
-    const t_event_new* new_ev = static_cast<t_event_new*> (ev);
+/*******************************************************************************
+ * class t_pending_index
+ ******************************************************************************/
 
-    std::pair<t_index_it, t_index_it> match_range = 
-      state.hash_index.equal_range(new_ev->hash);
+/*!
+  DEL events that could still be paired with a later ADD event when operations are
+  interleaved (see the -i option). File DEL events are found by their hash, folder DEL
+  events by their subtree and both can be found by their parent so that a DEL folder
+  event can collapse its children. The descendants that were deleted on their own
+  before the folder are hidden: they stay pending but can't be found anymore. A folder
+  DEL event can then also be found by its subtree along with theirs (its whole
+  subtree, see whole_subtree()).
+
+  Everything is keyed by path so there's at most one pending DEL event per path. The
+  events are only referenced so they must be erased before leaving the event list.
+  Like the tree index, only the paths with a pending event or pending children have
+  a record.
+
+  The events are also queued in the order they were inserted so that the oldest one
+  can be found without going through the event list. Erased events are only dropped
+  from the queues once they reach the front.
+*/
+class t_pending_index {
 
-    if (match_range.first != match_range.second) {
-      t_index_it index_it = match_range.first;
+  // Equivalent of boost::noncopyable.
+  t_pending_index(const t_pending_index& src) {}
+  t_pending_index& operator= (const t_pending_index& src) {return *this;}
 
-      p_event copy_ev = 
-	new t_event_copy(e_file, ev->timestamp, index_it->second, new_ev->path);
-      state.events.insert(copy_ev);
-      // std::cout << "COP - (" << index_it->first << ") "; copy_ev->print();	  
+public :
+  t_pending_index () : 
+    slots(), records(), free_records(), files(), folders(), whole_folders(),
+    queue(), whole_queue()
+  {}
 
-      return true;
-    }   
-  }
+  void insert (p_event ev);
+  void insert_whole (p_event ev, const t_subtree& subtree);
+  void erase (p_event ev);
+  void erase (t_path path);
+  void erase_whole (p_event ev);
+  void hide (p_event ev);
+  bool is_pending (p_event ev) const;
+  bool is_whole (p_event ev) const;
+
+  p_event find_file (const t_hash& hash, long min_timestamp);
+  p_event find_folder (const t_subtree& subtree, t_path base, long min_timestamp, 
+		       bool& is_whole);
+  p_event first_child (t_path parent) const;
+  p_event next_sibling (p_event ev) const;
+  p_event oldest (long min_timestamp) {return oldest(queue, min_timestamp);}
+  p_event oldest_whole (long min_timestamp) {return oldest(whole_queue, min_timestamp);}
+  void mark_paths (std::vector<char>& marks) const;
+
+  // The events are saved as their position in the list.
+  void save (t_checkpoint_writer& out, const t_event_list& list) const;
+  void load (t_checkpoint_reader& in, const t_event_list& list);
+
+private :
+
+  static const unsigned NIL = ~0U;
+
+  struct t_record {
+    t_path path;
+
+    // Pending event of the path (NULL if none).
+    p_event event;
+
+    // Pending events that share a parent are linked together.
+    t_path prev;
+    t_path next;
+    t_path children;
+  };
+
+  const t_record* find_record (t_path path) const;
+  t_record& get_record (t_path path) {return records[slots[path]];}
+  t_record& make_record (t_path path);
+  void release_record (t_path path);
+
+  // The timestamp tells a queued event apart from a later one that reuses it.
+  struct t_entry {
+    p_event event;
+    long timestamp;
+  };
+  typedef std::deque<t_entry> t_queue;
 
-  return false;
-}
+  static t_entry make_entry (p_event ev);
+  p_event oldest (t_queue& queue, long min_timestamp);
 
+  // Record of every path id (NIL if none).
+  std::vector<unsigned> slots;
 
-/*!
-  Adds the given event to the event list and tries to simplify it to an higher order event
-  if possible. Note that it only attempts to reduce file events. Folder event
-  simplifications are handled by the function simplify_state().
+  std::vector<t_record> records;
+  std::vector<unsigned> free_records;
 
-  This function assumes that the events are given in their proper timetamp order.
-*/
-void add_to_state (t_algo_state& state, p_event ev) {
-  // We process folder events later to avoid mix ups with file events.
-  if (ev->file_type == e_folder) {
-    state.events.insert(ev);
-    return;
-  }
+  t_hash_index files;
+  t_hash_index folders;
 
-  bool is_added = false;
+  // Folders that have hidden descendants keyed on their whole subtree.
+  t_hash_index whole_folders;
 
-  // Try to simplify to an higher level event.
+  t_queue queue;
+  t_queue whole_queue;
 
-  if (!state.events.empty()) {
-    t_event_it prev_ev_it = dec(state.events.end());
-    p_event prev_ev = *prev_ev_it;
+};
 
-    if (!is_added) is_added = simplify_to_modify_event(state, ev, prev_ev_it);
-    if (!is_added) is_added = simplify_to_move_event(state, ev, prev_ev_it);
 
-  }
+/*******************************************************************************
+ * struct t_event
+ ******************************************************************************/
 
-  if (!is_added) is_added = simplify_to_copy_event(state, ev);
+/*!
+  Every kind of event is stored in the same struct. Which fields are used depends on
+  the event_type:
 
-  // Unable to simplify so just add the event as is.
-  if (!is_added) {
-    // std::cout << "ADD - "; ev->print();
-    state.events.insert(ev);
-  }
+    - new, delete: path and hash (subtree for deleted folders).
+    - modify: path, old_hash and hash (the new hash).
+    - move: src_path is the old path and path the new one.
+    - copy: src_path is the original and path the copy.
+*/
+struct t_event { 
+
+  t_file_type file_type;
+  t_event_type event_type;
+  long timestamp;
 
+  t_path path;
+  t_path src_path;
 
-  // Update the hash index.
-  if (ev->file_type == e_file) {
+  t_hash hash;
+  t_hash old_hash;
 
-    // No matter what happened above, if a new event comes in for a file
-    //   Then something changed so we need to update the index.
-    if (ev->event_type == e_new) {
-      const t_event_new* new_ev = static_cast<t_event_new*> (ev);
+  t_subtree subtree;
 
-      // std::cout << "I++ - (" << new_ev->hash << ", " << path_to_string(new_ev->path) << ")" << std::endl;
+  const char* get_type_name() const {return file_type == e_file ? "file" : "folder";}
 
-      state.hash_index.insert(std::make_pair(new_ev->hash, new_ev->path));
-    }
+  bool is_rename() const { return !path_trie().is_same_name(src_path, path);}
+  bool is_move() const { return get_parent(src_path) != get_parent(path);}
 
-    else if (ev->event_type == e_delete) {
-      const t_event_delete* del_ev = static_cast<t_event_delete*> (ev);
+};
 
-      // std::cout << "I-- - (" << del_ev->hash << ", " << path_to_string(del_ev->path) << ")" << std::endl;
 
-      remove_from_index(state, del_ev->hash, del_ev->path);
-    }
+/*******************************************************************************
+ * t_event Utilities
+ ******************************************************************************/
+
+struct t_event_ts_comp : public std::binary_function<p_event, p_event, bool> {
+  bool operator() (const p_event lhs, const p_event rhs) const {
+    return lhs->timestamp < rhs->timestamp;
   }
+};
+
+
+// Index of an event in the list.
+typedef std::size_t t_event_pos;
+static const t_event_pos NULL_POS = ~t_event_pos(0);
 
-}
+
+void print_event (const t_event& ev);
 
 
 /*******************************************************************************
- * Folder simplifications
+ * class t_event_pool
  ******************************************************************************/
 
 /*!
-  Simplifies a redundant DEL event into a single DEL event. A DEL event is redundant if
-  it is followed by a DEL event on a folder that is a prefix of the current DEL event.
+  Hands out events from large chunks and recycles the released ones. An event only
+  holds path ids and fixed size hashes so a released event is simply handed out again
+  (make_event() resets its fields) and nothing is allocated per event once the pool
+  is warm. Every event is freed in one go when the pool is reset.
 */
-bool simplify_folder_delete (t_algo_state& state, t_event_it prev_it, t_event_it cur_it) {
-  p_event prev_ev = *prev_it;
-  p_event cur_ev = *cur_it;
+class t_event_pool {
 
-  if (prev_ev->event_type != e_delete || cur_ev->event_type != e_delete)
+  // Equivalent of boost::noncopyable.
+  t_event_pool(const t_event_pool& src) {}
+  t_event_pool& operator= (const t_event_pool& src) {return *this;}
+
+public :
+  t_event_pool () : chunks(), chunk_used(EVENT_CHUNK_SIZE), free_events() {}
+  ~t_event_pool () {
+    reset();
+  }
+
+  p_event alloc ();
+  void release (p_event ev);
+  void reset ();
+
+private :
+
+  std::vector<p_event> chunks;
+  std::size_t chunk_used;
+
+  std::vector<p_event> free_events;
+
+};
+
+
+/*******************************************************************************
+ * Prototypes
+ ******************************************************************************/
+
+void add_to_state (t_algo_state& state, p_event ev);
+void index_event (t_hash_index& hash_index, p_event ev);
+void simplify_folder_events (t_algo_state& state);
+void simplify_state (t_algo_state& state);
+void flush_state (t_algo_state& state);
+void print_state (t_algo_state& state);
+
+class t_reorder_buffer;
+class t_compactor;
+class t_event_parser;
+void collect_paths (const t_algo_state& state, 
+		    const t_reorder_buffer& reorder, 
+		    const t_compactor& compactor, 
+		    const t_event_parser& parser);
+
+// Receives the events that are done being simplified.
+typedef void (*t_event_sink) (const t_event& ev, void* data);
+void pop_done_events (t_algo_state& state, t_event_sink sink, void* data);
+void write_event (const t_event& ev, void* data);
+void compact_event (const t_event& ev, void* data);
+
+struct t_checkpoint;
+
+bool read_events (t_algo_state& state, const char* file_name, bool is_streaming, 
+		  t_reorder_buffer& reorder, const t_checkpoint* checkpoint = NULL);
+void run_tests ();
+
+p_event make_event (t_algo_state& state, t_event_type ev, t_file_type f, long ts);
+p_event make_new_event (t_algo_state& state, t_file_type f, long ts, t_path p, 
+			const t_hash& h = NULL_HASH);
+p_event make_delete_event (t_algo_state& state, t_file_type f, long ts, t_path p, 
+			   const t_hash& h = NULL_HASH);
+p_event make_modify_event (t_algo_state& state, t_file_type f, long ts, t_path p, 
+			   const t_hash& old_h, const t_hash& new_h);
+p_event make_move_event (t_algo_state& state, t_file_type f, long ts, 
+			 t_path old_p, t_path new_p);
+p_event make_copy_event (t_algo_state& state, t_file_type f, long ts, 
+			 t_path src_p, t_path dest_p);
+
+void print_index (t_algo_state& state);
+t_event_pos insert_event (t_algo_state& state, p_event ev);
+t_event_pos find_event (t_algo_state& state, p_event ev);
+void remove_event (t_algo_state& state, t_event_pos pos);
+void remove_event (t_algo_state& state, t_event_pos start, t_event_pos end);
+
+
+/*******************************************************************************
+ * struct t_stats
+ ******************************************************************************/
+
+#ifdef FILEVENTS_STATS
+
+enum t_counter {
+  e_events_read,
+  e_events_written,
+  e_file_moves,
+  e_file_modifies,
+  e_file_copies,
+  e_interleaved_moves,
+  e_folder_deletes,
+  e_folder_moves,
+  e_interleaved_folder_moves,
+  e_folder_copies,
+  e_subtree_compares,
+  e_subtree_entries,
+  e_max_events,
+  e_counter_count
+};
+
+enum t_stage {
+  e_stage_read,
+  e_stage_add,
+  e_stage_flush,
+  e_stage_simplify,
+  e_stage_print,
+  e_stage_count
+};
+
+// Latencies are counted in power of 2 buckets of nanoseconds.
+static const std::size_t LATENCY_BUCKETS = 40;
+
+/*!
+  Counters and latency histograms of a state. Each state has its own so nothing is
+  shared between the threads of the -j option. They're merged when dumped (see
+  dump_stats()).
+
+  All of this is only compiled in if FILEVENTS_STATS is defined. Otherwise the STATS_
+  macros expand to nothing.
+*/
+struct t_stats {
+  t_stats () {std::memset(this, 0, sizeof(*this));}
+
+  void merge (const t_stats& other);
+
+  uint64_t counters[e_counter_count];
+  uint64_t latencies[e_stage_count][LATENCY_BUCKETS];
+};
+
+
+//! Adds the time between its creation and its destruction to a latency histogram.
+class t_stats_timer {
+
+  // Equivalent of boost::noncopyable.
+  t_stats_timer(const t_stats_timer& src) {}
+  t_stats_timer& operator= (const t_stats_timer& src) {return *this;}
+
+public :
+  t_stats_timer (t_stats& stats, t_stage stage) : 
+    histogram(stats.latencies[stage]), start(now()) 
+  {}
+
+  ~t_stats_timer () {
+    uint64_t elapsed = now() - start;
+    std::size_t bucket = 0;
+    while ((elapsed >>= 1) != 0 && bucket < LATENCY_BUCKETS - 1) ++bucket;
+    ++histogram[bucket];
+  }
+
+private :
+
+  static uint64_t now () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  uint64_t* histogram;
+  uint64_t start;
+
+};
+
+#define STATS_INC(state, counter) (++(state).stats.counters[counter])
+#define STATS_ADD(state, counter, value) ((state).stats.counters[counter] += (value))
+#define STATS_MAX(state, counter, value) \
+  ((state).stats.counters[counter] = std::max<uint64_t>((state).stats.counters[counter], (value)))
+#define STATS_TIMER(state, stage) t_stats_timer stats_timer ((state).stats, stage)
+
+// Where the stats are dumped (std err if NULL).
+const char* stats_file_name = NULL;
+
+// Set by SIGUSR1 to have the stats dumped by read_events().
+volatile sig_atomic_t is_stats_requested = 0;
+
+void request_stats (int signal);
+void dump_stats (const std::vector<const t_algo_state*>& states);
+
+#else
+
+#define STATS_INC(state, counter)
+#define STATS_ADD(state, counter, value)
+#define STATS_MAX(state, counter, value)
+#define STATS_TIMER(state, stage)
+
+#endif
+
+
+/*******************************************************************************
+ * struct t_algo_state
+ ******************************************************************************/
+
+class t_algo_state {
+
+  // Equivalent of boost::noncopyable.
+  t_algo_state(const t_algo_state& src) {}
+  bool operator= (const t_algo_state& src) {}
+
+public :
+  t_algo_state () : 
+    event_pool(), events(), add_pos(NULL_POS), add_subtree(), 
+    is_indexed(true), hash_index(), tree_index(), match_window(0), pending()
+#ifdef FILEVENTS_STATS
+    , stats()
+#endif
+  {}
+
+  // Owns every event in the list.
+  t_event_pool event_pool;
+
+  t_event_list events;
+
+  // ADD folder event that starts a possible folder move or copy (NULL_POS if none).
+  t_event_pos add_pos;
+
+  // ADD events seen so far under the folder of add_pos.
+  t_subtree add_subtree;
+
+  // When false, the copy sources were already resolved by the caller using its own
+  //   index (see read_sharded_events()).
+  bool is_indexed;
+
+  // Used to detect copy file events.
+  t_hash_index hash_index;
+
+  // Used to detect copy folder events. Unlike the hash index, each state keeps its own.
+  t_tree_index tree_index;
+
+  // Number of timestamps during which a DEL event can be paired with any ADD event.
+  //   Only the previous event is considered when 0.
+  long match_window;
+
+  // DEL events that can still be paired (only used if match_window isn't 0).
+  t_pending_index pending;
+
+#ifdef FILEVENTS_STATS
+  t_stats stats;
+#endif
+
+};
+
+
+/*******************************************************************************
+ * Rules
+ ******************************************************************************/
+
+bool simplify_to_modify_event (t_algo_state& state, p_event ev, t_event_pos prev_pos);
+bool simplify_to_move_event (t_algo_state& state, p_event ev, t_event_pos prev_pos);
+bool simplify_to_pending_move (t_algo_state& state, p_event ev);
+bool simplify_to_copy_event (t_algo_state& state, p_event ev);
+bool simplify_folder_delete (t_algo_state& state, t_event_pos prev_pos, t_event_pos cur_pos);
+bool simplify_to_folder_move (t_algo_state& state, t_event_pos prev_pos, t_event_pos end_pos);
+t_subtree whole_subtree (t_algo_state& state, t_event_pos del_pos);
+bool match_hidden_events (t_algo_state& state, t_event_pos del_pos, 
+			  const t_subtree& add_subtree, t_path base, t_event_pos& first_pos);
+t_event_pos remove_hidden_events (t_algo_state& state, t_event_pos del_pos, t_event_pos first_pos);
+bool simplify_to_pending_folder_move (t_algo_state& state, 
+				      t_event_pos cur_pos, 
+				      t_event_pos end_pos);
+bool simplify_to_folder_copy (t_algo_state& state, t_event_pos cur_pos, t_event_pos end_pos);
+
+
+/*!
+  Each simplification is a rule type and the rules of a build are strung together at 
+  compile time in a t_rules list (t_rule_list) so every call is resolved statically 
+  and the rules that are left out cost nothing. A rule only defines the hooks it 
+  needs, the others come from t_rule and do nothing:
+
+    - file: called by add_to_state() with a file event. Returns true if the event
+      was merged into an higher level event.
+    - folder_delete: called by simplify_folder_events() with the DEL event at cur_pos
+      and the event before it. Returns true if the event at prev_pos was collapsed.
+    - folder_add: called by close_folder_add() with the folder ADD event at add_pos
+      and the events of the folder up to end_pos. Returns true if they were replaced.
+
+  The flags tell which parts of t_algo_state the rule reads so that they're only
+  kept up to date when a rule of the list needs them.
+*/
+struct t_rule {
+  enum {
+    uses_hash_index = 0,
+    uses_tree_index = 0,
+    uses_folder_adds = 0
+  };
+
+  static bool file (t_algo_state& state, p_event ev) {return false;}
+
+  static bool folder_delete (t_algo_state& state, t_event_pos prev_pos, t_event_pos cur_pos) {
     return false;
-  if (cur_ev->file_type != e_folder)
+  }
+
+  static bool folder_add (t_algo_state& state, t_event_pos add_pos, t_event_pos end_pos) {
     return false;
+  }
+};
+
+
+struct t_modify_rule : public t_rule {
+  static bool file (t_algo_state& state, p_event ev) {
+    return !state.events.empty() && 
+      simplify_to_modify_event(state, ev, state.events.size() - 1);
+  }
+};
+
+
+struct t_move_rule : public t_rule {
+  static bool file (t_algo_state& state, p_event ev) {
+    return !state.events.empty() && 
+      simplify_to_move_event(state, ev, state.events.size() - 1);
+  }
+};
+
+
+//! Only does something if the state has a match_window.
+struct t_pending_move_rule : public t_rule {
+  static bool file (t_algo_state& state, p_event ev) {
+    if (state.match_window <= 0)
+      return false;
+
+    // The files of a folder being added are left to the folder move or copy.
+    bool is_in_folder = state.add_pos != NULL_POS && 
+      is_sub_path(state.events[state.add_pos]->path, ev->path);
+
+    return !is_in_folder && simplify_to_pending_move(state, ev);
+  }
+};
+
+
+struct t_copy_rule : public t_rule {
+  enum {uses_hash_index = 1};
+
+  static bool file (t_algo_state& state, p_event ev) {
+    return simplify_to_copy_event(state, ev);
+  }
+};
+
+
+struct t_folder_delete_rule : public t_rule {
+  static bool folder_delete (t_algo_state& state, t_event_pos prev_pos, t_event_pos cur_pos) {
+    return simplify_folder_delete(state, prev_pos, cur_pos);
+  }
+};
+
+
+struct t_folder_move_rule : public t_rule {
+  enum {uses_folder_adds = 1};
+
+  static bool folder_add (t_algo_state& state, t_event_pos add_pos, t_event_pos end_pos) {
+    return add_pos > 0 && simplify_to_folder_move(state, add_pos - 1, end_pos);
+  }
+};
+
+
+//! Only does something if the state has a match_window.
+struct t_pending_folder_move_rule : public t_rule {
+  enum {uses_folder_adds = 1};
+
+  static bool folder_add (t_algo_state& state, t_event_pos add_pos, t_event_pos end_pos) {
+    return state.match_window > 0 && 
+      simplify_to_pending_folder_move(state, add_pos, end_pos);
+  }
+};
+
+
+struct t_folder_copy_rule : public t_rule {
+  enum {uses_tree_index = 1, uses_folder_adds = 1};
+
+  static bool folder_add (t_algo_state& state, t_event_pos add_pos, t_event_pos end_pos) {
+    return simplify_to_folder_copy(state, add_pos, end_pos);
+  }
+};
+
+
+struct t_no_rules : public t_rule {};
+
+
+//! List of rules which is itself a rule. The rules are tried in order.
+template <typename t_head, typename t_tail = t_no_rules>
+struct t_rules {
+  enum {
+    uses_hash_index = t_head::uses_hash_index || t_tail::uses_hash_index,
+    uses_tree_index = t_head::uses_tree_index || t_tail::uses_tree_index,
+    uses_folder_adds = t_head::uses_folder_adds || t_tail::uses_folder_adds
+  };
+
+  static bool file (t_algo_state& state, p_event ev) {
+    return t_head::file(state, ev) || t_tail::file(state, ev);
+  }
+
+  static bool folder_delete (t_algo_state& state, t_event_pos prev_pos, t_event_pos cur_pos) {
+    return t_head::folder_delete(state, prev_pos, cur_pos) || 
+      t_tail::folder_delete(state, prev_pos, cur_pos);
+  }
+
+  static bool folder_add (t_algo_state& state, t_event_pos add_pos, t_event_pos end_pos) {
+    return t_head::folder_add(state, add_pos, end_pos) || 
+      t_tail::folder_add(state, add_pos, end_pos);
+  }
+};
+
+
+//! Tells whether a rule is part of a list of rules (the tests depend on it).
+template <typename t_list, typename t_wanted>
+struct t_has_rule {
+  enum {value = 0};
+};
+
+template <typename t_wanted>
+struct t_has_rule<t_wanted, t_wanted> {
+  enum {value = 1};
+};
+
+template <typename t_head, typename t_tail, typename t_wanted>
+struct t_has_rule<t_rules<t_head, t_tail>, t_wanted> {
+  enum {
+    value = t_has_rule<t_head, t_wanted>::value || t_has_rule<t_tail, t_wanted>::value
+  };
+};
+
+
+typedef 
+t_rules<t_modify_rule, 
+t_rules<t_move_rule, 
+t_rules<t_pending_move_rule, 
+t_rules<t_copy_rule, 
+t_rules<t_folder_delete_rule, 
+t_rules<t_folder_move_rule, 
+t_rules<t_pending_folder_move_rule, 
+t_rules<t_folder_copy_rule> > > > > > > > t_all_rules;
+
+//! Only pairs the DEL and ADD events of files.
+typedef 
+t_rules<t_modify_rule, 
+t_rules<t_move_rule, 
+t_rules<t_pending_move_rule> > > t_file_move_rules;
+
+/*!
+  Rules of the build which can be picked with -DFILEVENTS_RULES=<list>. The output of
+  the tests is meant for t_all_rules but their checks only look at what the rules of
+  the list should have done.
+*/
+#ifndef FILEVENTS_RULES
+#define FILEVENTS_RULES t_all_rules
+#endif
+
+typedef FILEVENTS_RULES t_rule_list;
+
+
+/*******************************************************************************
+ * struct t_token
+ ******************************************************************************/
+
+//! Piece of the input buffer. Only valid until the next line is read.
+struct t_token {
+  const char* first;
+  const char* last;
+
+  t_token () : first(NULL), last(NULL) {}
+
+  std::size_t size () const {return last - first;}
+  bool empty () const {return first == last;}
+  std::string str () const {return std::string(first, last);}
+  bool is (const char* word) const {
+    return size() == strlen(word) && std::equal(first, last, word);
+  }
+};
+
+bool next_token (t_token& line, t_token& token);
+long token_to_long (const t_token& token);
+
+
+//! Fields of an input line. The hash is only valid until the next line is read.
+struct t_raw_event {
+  t_event_type event_type;
+  t_file_type file_type;
+  long timestamp;
+  t_path path;
+  t_token hash;
+};
+
+
+/*******************************************************************************
+ * class t_event_reader
+ ******************************************************************************/
+
+/*!
+  Splits the input into lines without copying them. Regular files are memory mapped
+  while everything else (pipes, terminals...) is read in large blocks.
+*/
+class t_event_reader {
+
+  // Equivalent of boost::noncopyable.
+  t_event_reader(const t_event_reader& src) {}
+  t_event_reader& operator= (const t_event_reader& src) {return *this;}
+
+public :
+  t_event_reader () : 
+    fd(-1), map(NULL), map_size(0), buffer(), base(0), cur(NULL), end(NULL), is_eof(false) 
+  {}
+  ~t_event_reader ();
+
+  bool open (const char* file_name);
+  bool next_line (t_token& line);
+  bool next_block (t_token& block);
+
+  std::size_t offset () const;
+  bool skip (std::size_t new_offset);
+
+private :
+
+  bool fill ();
+
+  int fd;
+
+  char* map;
+  std::size_t map_size;
+
+  std::vector<char> buffer;
+
+  // Offset in the input of the start of the buffer.
+  std::size_t base;
+
+  const char* cur;
+  const char* end;
+  bool is_eof;
+
+};
+
+
+/*******************************************************************************
+ * class t_event_parser
+ ******************************************************************************/
+
+/*!
+  Splits a block of lines into events. Every separator of the block (white spaces
+  and slashes) is found in a single pass, 16 bytes at a time when SSE2 is available
+  (see find_separators()), and the fields and the path components are then cut out
+  of the block without looking at the characters again.
+
+  Consecutive paths usually share most of their folders so the components that a
+  path has in common with the previous one are taken from it instead of being
+  interned again. Matching a component is then a single name comparison.
+
+  The events (and their hashes) are only valid until the next block is parsed. Lines
+  with an unknown event are skipped and counted.
+*/
+class t_event_parser {
+
+  // Equivalent of boost::noncopyable.
+  t_event_parser(const t_event_parser& src) {}
+  t_event_parser& operator= (const t_event_parser& src) {return *this;}
+
+public :
+  t_event_parser () : 
+    events(), ends(), pos(0), block(), marks(), last_path(), is_last_rooted(false),
+    skipped_count(0)
+  {}
+
+  void parse (const char* first, const char* last);
+
+  //! Takes the next event of the block.
+  bool next (t_raw_event& raw) {
+    if (pos == events.size())
+      return false;
+    raw = events[pos++];
+    return true;
+  }
+
+  //! Number of bytes of the block that come after the last event taken.
+  std::size_t remaining () const {
+    return block.last - (pos > 0 ? ends[pos - 1] : block.first);
+  }
+
+  std::size_t get_skipped_count () const {return skipped_count;}
+  void mark_paths (std::vector<char>& marks) const;
+
+private :
+
+  void add_event (const t_token* tokens, std::size_t nb_tokens, 
+		  std::size_t path_mark, std::size_t path_mark_end, const char* end);
+  t_path make_path (const t_token& token, std::size_t mark, std::size_t mark_end);
+
+  std::vector<t_raw_event> events;
+
+  // Start of the line that follows each event.
+  std::vector<const char*> ends;
+
+  std::size_t pos;
+  t_token block;
+
+  // Offsets of the separators of the block (see find_separators()).
+  std::vector<unsigned> marks;
+
+  // Components of the last path and whether it started at the root.
+  std::vector<t_path> last_path;
+  bool is_last_rooted;
+
+  std::size_t skipped_count;
+
+};
+
+/*******************************************************************************
+ * class t_event_writer
+ ******************************************************************************/
+
+/*!
+  Formats the events into a large buffer which is handed over to stdout in one go
+  when it fills up or when flush() is called. Paths are rendered straight from the
+  path trie.
+
+  The formats are:
+
+    - text: one english sentence per event.
+    - json: one object per line with the event, type, timestamp, path, src_path,
+      hash and old_hash fields (only those used by the event are present).
+    - binary: event type (1 byte), file type (1 byte), timestamp (8 bytes) followed
+      by the same fields as json in the same order. Each field is a 4 bytes length
+      followed by its bytes. Numbers are little endian.
+
+  Moves that don't change anything are left out in every format.
+*/
+class t_event_writer {
+
+  // Equivalent of boost::noncopyable.
+  t_event_writer(const t_event_writer& src) {}
+  t_event_writer& operator= (const t_event_writer& src) {return *this;}
+
+public :
+  t_event_writer () : format(e_text), buffer(WRITE_BLOCK_SIZE), used(0), nodes() {}
+  ~t_event_writer () {
+    flush();
+  }
+
+  void set_format (t_output_format new_format) {format = new_format;}
+
+  void write (const t_event& ev);
+  void flush ();
+
+private :
+
+  void write_text (const t_event& ev);
+  void write_json (const t_event& ev);
+  void write_binary (const t_event& ev);
+
+  void append (const char* first, std::size_t size);
+  void append (const char* str) {append(str, std::strlen(str));}
+  void append (const std::string& str) {append(str.data(), str.size());}
+  void append_escaped (const char* first, std::size_t size);
+  void append_long (long value);
+  void append_bytes (uint64_t value, unsigned size);
+
+  void append_name (t_path path);
+  void append_path (t_path path);
+  void append_hash (const t_hash& hash);
+  void append_field (const char* key, const t_hash& hash);
+  void append_field (const char* key, t_path path);
+
+  t_output_format format;
+
+  std::vector<char> buffer;
+  std::size_t used;
+
+  // Nodes of the path being rendered.
+  std::vector<t_path> nodes;
+
+};
+
+t_event_writer event_writer;
+
+
+/*******************************************************************************
+ * class t_compactor
+ ******************************************************************************/
+
+/*!
+  Optional last stage that trades the history for the net effect. The events are
+  cut into windows of the given number of timestamps and, within a window, the
+  ADD, DEL, MODIFY and MOVE events of a file are chained together and replaced by
+  the events that take the file from where it was before the window to where it is
+  at the end of it. For example, a file that is moved twice and modified becomes a
+  single move followed by a single modify while a file that's created and deleted
+  within the window disappears entirely.
+
+  The events that come out can be applied in order to a replica. To keep it that
+  way, a chain is closed (its events are sent right away) when:
+
+    - another chain takes the path that it left.
+    - a COPY or a folder event touches its paths (the folder events and the COPY 
+      events are sent as is).
+    - the window ends.
+
+  The timestamp of the events of a chain is the one of its last event. A window of
+  0 sends every event straight to the sink.
+*/
+class t_compactor {
+
+  // Equivalent of boost::noncopyable.
+  t_compactor(const t_compactor& src) {}
+  t_compactor& operator= (const t_compactor& src) {return *this;}
+
+public :
+  t_compactor (t_event_sink sink, void* data) : 
+    sink(sink), sink_data(data), window(0), window_end(0), chains(), paths(), sources(),
+    folders()
+  {}
+
+  void set_window (long new_window) {window = new_window;}
+
+  void write (const t_event& ev);
+  void flush ();
+  void mark_paths (std::vector<char>& marks) const;
+
+private :
+
+  //! Net effect of the events of a file within the window.
+  struct t_chain {
+    // Where the file was before the window (NULL_PATH if it was created in it).
+    t_path src_path;
+    t_hash src_hash;
+
+    t_path path;
+    t_hash hash;
+    bool is_live;
+
+    long timestamp;
+    bool is_open;
+  };
+
+  typedef std::map<t_path, std::size_t> t_chain_map;
+  typedef std::map<t_path, std::vector<std::size_t> > t_folder_map;
+
+  std::size_t find_chain (t_path path) const;
+  std::size_t open_chain (t_path src_path, const t_hash& src_hash, t_path path, 
+			  const t_hash& hash, bool is_live);
+  void take_path (t_path path, std::size_t chain);
+  void index_chain (t_path path, std::size_t chain);
+  void close_chain (std::size_t chain);
+  void close_chains (t_path path);
+  void send (t_event_type type, long timestamp, t_path src_path, t_path path, 
+	     const t_hash& old_hash, const t_hash& hash);
+
+  t_event_sink sink;
+  void* sink_data;
+
+  long window;
+  long window_end;
+
+  std::vector<t_chain> chains;
+
+  // Chain of each path (only valid if the chain is open and still on that path).
+  t_chain_map paths;
+
+  // Chain that came from each path.
+  t_chain_map sources;
+
+  // Chains that started or ended up on each path or under it (some might have left).
+  t_folder_map folders;
+
+};
+
+t_compactor compactor (write_event, NULL);
+
+
+/*******************************************************************************
+ * class t_reorder_buffer
+ ******************************************************************************/
+
+/*!
+  Puts the events back in timestamp order before they're simplified. Events are held
+  in a heap until they're older than the newest timestamp by more than the time
+  window or until the heap holds more than the count window. Events with the same
+  timestamp keep their input order. When both windows are 0, events go straight
+  through.
+
+  An event older than the last event released can no longer be put in its place so
+  it's released right away and counted as late.
+*/
+class t_reorder_buffer {
+
+  // Equivalent of boost::noncopyable.
+  t_reorder_buffer(const t_reorder_buffer& src) {}
+  t_reorder_buffer& operator= (const t_reorder_buffer& src) {return *this;}
+
+public :
+  t_reorder_buffer (long window, std::size_t count) :
+    heap(), late_events(), window(window), count(count), 
+    max_timestamp(0), last_timestamp(0), is_released(false), 
+    sequence(0), late_count(0)
+  {}
+
+  void push (p_event ev);
+  p_event pop (bool is_draining = false);
+
+  std::size_t size () const {return heap.size();}
+  std::size_t get_late_count () const {return late_count;}
+  void mark_paths (std::vector<char>& marks) const;
+
+  // The windows aren't saved since they come from the command line.
+  void save (t_checkpoint_writer& out) const;
+  void load (t_checkpoint_reader& in, t_algo_state& state);
+
+private :
+
+  struct t_entry {
+    long timestamp;
+    unsigned long sequence;
+    p_event ev;
+  };
+
+  // Oldest entry at the top of the heap.
+  struct t_entry_comp {
+    bool operator() (const t_entry& lhs, const t_entry& rhs) const {
+      if (lhs.timestamp != rhs.timestamp)
+	return lhs.timestamp > rhs.timestamp;
+      return lhs.sequence > rhs.sequence;
+    }
+  };
+
+  std::priority_queue<t_entry, std::vector<t_entry>, t_entry_comp> heap;
+  std::deque<p_event> late_events;
+
+  long window;
+  std::size_t count;
+
+  long max_timestamp;
+  long last_timestamp;
+  bool is_released;
+
+  unsigned long sequence;
+  std::size_t late_count;
+
+};
+
+
+/*******************************************************************************
+ * class t_checkpoint_writer
+ ******************************************************************************/
+
+/*!
+  Writes a checkpoint file. Everything is written in the native layout of the machine
+  and padded to 8 bytes so that a reader can map the file and copy the flat vectors of
+  the indexes straight out of it. Vectors are prefixed by the size of their elements
+  and their length and the file ends with a checksum of everything before it.
+
+  The file is first written under a temporary name and renamed once it's on disk so
+  that a crash never leaves a partial checkpoint behind.
+*/
+class t_checkpoint_writer {
+
+  // Equivalent of boost::noncopyable.
+  t_checkpoint_writer(const t_checkpoint_writer& src) {}
+  t_checkpoint_writer& operator= (const t_checkpoint_writer& src) {return *this;}
+
+public :
+  t_checkpoint_writer () : file(NULL), file_name(), tmp_name(), checksum(0), is_ok(false) {}
+  ~t_checkpoint_writer ();
+
+  bool open (const char* new_file_name);
+  bool close ();
+
+  void write (const void* data, std::size_t size);
+  void write_value (uint64_t value) {write(&value, sizeof(value));}
+
+  template <typename T>
+  void write_vector (const std::vector<T>& vec) {
+    write_value(sizeof(T));
+    write_value(vec.size());
+    if (!vec.empty())
+      write(&vec[0], vec.size() * sizeof(T));
+  }
+
+private :
+
+  FILE* file;
+  std::string file_name;
+  std::string tmp_name;
+
+  t_digest checksum;
+  bool is_ok;
+
+};
+
+
+/*******************************************************************************
+ * class t_checkpoint_reader
+ ******************************************************************************/
+
+/*!
+  Maps a checkpoint file written by t_checkpoint_writer and reads it back in the same
+  order. The checksum and the header are verified when the file is opened. Any read
+  past the end or of a vector with the wrong element size makes the reader fail
+  (see ok()) and returns zeros.
+*/
+class t_checkpoint_reader {
+
+  // Equivalent of boost::noncopyable.
+  t_checkpoint_reader(const t_checkpoint_reader& src) {}
+  t_checkpoint_reader& operator= (const t_checkpoint_reader& src) {return *this;}
+
+public :
+  t_checkpoint_reader () : map(NULL), map_size(0), cur(NULL), end(NULL), is_ok(false) {}
+  ~t_checkpoint_reader ();
+
+  bool open (const char* file_name);
+  bool ok () const {return is_ok;}
+  bool is_done () const {return cur == end;}
+  void fail () {is_ok = false;}
+
+  const char* read (std::size_t size);
+  uint64_t read_value ();
+  void read_hash (t_hash& hash);
+
+  template <typename T>
+  void read_vector (std::vector<T>& vec) {
+    uint64_t elem_size = read_value();
+    uint64_t count = read_value();
+
+    if (elem_size != sizeof(T) || count > static_cast<std::size_t>(end - cur) / sizeof(T)) {
+      is_ok = false;
+      vec.clear();
+      return;
+    }
+
+    const T* first = reinterpret_cast<const T*>(read(count * sizeof(T)));
+    if (first)
+      vec.assign(first, first + count);
+    else
+      vec.clear();
+  }
+
+private :
+
+  char* map;
+  std::size_t map_size;
+
+  const char* cur;
+  const char* end;
+  bool is_ok;
+
+};
+
+
+/*******************************************************************************
+ * struct t_checkpoint
+ ******************************************************************************/
+
+/*!
+  Tells read_events() where to restore the state from and where to save it. A
+  checkpoint holds the path trie, the indexes, the events that can still be
+  simplified, the reorder buffer and the position in the input where the reading
+  resumes. The state is saved every period events (if not 0) and once the input
+  is done, in which case the events left are kept in the checkpoint instead of
+  being printed.
+*/
+struct t_checkpoint {
+  t_checkpoint () : restore_file(NULL), save_file(NULL), period(0) {}
+
+  const char* restore_file;
+  const char* save_file;
+  long period;
+};
+
+bool save_checkpoint (const char* file_name, const t_algo_state& state, 
+		      const t_reorder_buffer& reorder, std::size_t offset, long nb_read);
+bool load_checkpoint (const char* file_name, t_algo_state& state, 
+		      t_reorder_buffer& reorder, std::size_t& offset, long& nb_read);
+
+void save_event (t_checkpoint_writer& out, const t_event& ev);
+p_event load_event (t_checkpoint_reader& in, t_algo_state& state);
+
+
+bool read_event_count (t_event_reader& reader, long& nb_events);
+bool read_event (t_event_reader& reader, t_event_parser& parser, t_raw_event& raw);
+std::size_t find_separators (const char* first, const char* last, std::vector<unsigned>& marks);
+p_event make_input_event (t_algo_state& state, const t_raw_event& raw);
+
+
+/*******************************************************************************
+ * struct t_shard
+ ******************************************************************************/
+
+//! Independent slice of the events that is simplified by its own thread.
+struct t_shard {
+  t_shard () : state(), input(), thread() {
+    state.is_indexed = false;
+  }
+
+  t_algo_state state;
+  std::vector<p_event> input;
+  pthread_t thread;
+};
+
+typedef std::vector<t_shard*> t_shard_list;
+
+bool read_sharded_events (t_shard_list& shards, const char* file_name, 
+			  t_reorder_buffer& reorder);
+void simplify_shards (t_shard_list& shards);
+void print_shards (t_shard_list& shards);
+
+
+/*******************************************************************************
+ * class t_workload
+ ******************************************************************************/
+
+#ifdef FILEVENTS_BENCHMARK
+
+//! Shape of a generated workload.
+struct t_workload_config {
+  t_workload_config () : nb_events(200000), depth(6), fan_out(16), users(1), seed(1) {}
+
+  long nb_events;
+  unsigned depth;
+  unsigned fan_out;
+  unsigned users;
+  unsigned long seed;
+};
+
+
+/*!
+  Generates a log by running random operations on a model of the file system. Each
+  user works in its own top level folder and runs one operation at a time but the
+  events of the users are interleaved. The operations are:
+
+    - file churn: create (30%), delete (10%) and modify (12%) a file.
+    - create a folder (8%).
+    - rename (10%), move (10%) and copy (8%) a file.
+    - move or rename a folder along with everything in it (5%). Most folders are
+      deep so most moves are too.
+    - copy (4%) and delete (3%) a folder.
+
+  Folders are created up to the given depth (the root of a user is at depth 1) and
+  a folder that has fan_out entries isn't picked for new ones. Names are never reused.
+*/
+class t_workload {
+
+  // Equivalent of boost::noncopyable.
+  t_workload(const t_workload& src) {}
+  t_workload& operator= (const t_workload& src) {return *this;}
+
+public :
+  t_workload (const t_workload_config& config);
+
+  void generate (std::string& out);
+
+private :
+
+  struct t_entry {
+    std::string hash;
+    unsigned children;
+  };
+
+  typedef std::map<std::string, t_entry> t_tree;
+  typedef t_tree::iterator t_tree_it;
+
+  struct t_user {
+    std::string root;
+
+    // Paths that were created by the user. Those that are gone are dropped when picked.
+    std::vector<std::string> folders;
+    std::vector<std::string> files;
+
+    // Events of the current operation (without their timestamp).
+    std::deque<std::string> lines;
+  };
+
+  uint64_t next_random ();
+  std::size_t random_below (std::size_t bound) {return next_random() % bound;}
+  std::string new_hash ();
+  std::string new_name (const std::string& parent, bool is_folder);
+
+  void start_operation (t_user& user);
+  bool pick (std::vector<std::string>& paths, std::string& path);
+  std::string pick_parent (t_user& user);
+
+  void add (t_user& user, const std::string& path, const std::string& hash);
+  void remove (t_user& user, const std::string& path);
+  void snapshot_tree (const std::string& path, t_tree& snapshot);
+  void remove_tree (t_user& user, const std::string& path, const t_tree& snapshot);
+  void add_tree (t_user& user, const std::string& path, const t_tree& snapshot);
+
+  t_workload_config config;
+  uint64_t random_state;
+  unsigned long name_count;
+
+  t_tree tree;
+  std::vector<t_user> users;
+
+};
+
+int run_benchmark (int argc, char** argv);
+
+#endif
+
+
+/*******************************************************************************
+ * Entry point
+ ******************************************************************************/
+
+#ifndef FILEVENTS_LIBRARY
+
+/*!
+  Any non-option argument runs the tests. Otherwise the events are read from std in
+  or from the file given with the -f option.
+  The -s option prints the events as soon as they can no longer be simplified
+  instead of waiting for the end of the input.
+  The -j option splits the events by top level folder and simplifies each part on
+  its own thread.
+  The -o option selects the output format (see t_event_writer).
+  The -w and -c options hold the events back to put them in order (see 
+  t_reorder_buffer).
+  The -i option lets DEL and ADD events be paired even if other operations were
+  going on at the same time.
+  The -r option restores the state from a checkpoint and resumes the reading where
+  it left off. The -k option saves the state to a checkpoint every -p events and at
+  the end of the input instead of printing the events left (see t_checkpoint).
+  The -d option replaces the events of each window of the given number of 
+  timestamps by their net effect (see t_compactor).
+
+  The filevents_bench build runs run_benchmark() instead.
+*/
+int main (int argc, char** argv) {
+#ifdef FILEVENTS_BENCHMARK
+  return run_benchmark(argc, argv);
+#endif
+
+  bool is_streaming = false;
+  const char* file_name = NULL;
+  int nb_threads = 1;
+  const char* format = "text";
+  long window = 0;
+  long count = 0;
+  long match_window = 0;
+  long compact_window = 0;
+  t_checkpoint checkpoint;
+  const char* stats_file = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "sf:j:o:w:c:i:d:r:k:p:m:")) != -1) {
+    switch (opt) {
+    case 's': is_streaming = true; break;
+    case 'f': file_name = optarg; break;
+    case 'j': nb_threads = atoi(optarg); break;
+    case 'o': format = optarg; break;
+    case 'w': window = atol(optarg); break;
+    case 'c': count = atol(optarg); break;
+    case 'i': match_window = atol(optarg); break;
+    case 'd': compact_window = atol(optarg); break;
+    case 'r': checkpoint.restore_file = optarg; break;
+    case 'k': checkpoint.save_file = optarg; break;
+    case 'p': checkpoint.period = atol(optarg); break;
+    case 'm': stats_file = optarg; break;
+    default:
+      std::cerr << "Usage: " << argv[0] 
+		<< " [-s] [-f file] [-j threads] [-o text|json|binary]"
+		<< " [-w timestamps] [-c events] [-i timestamps] [-d timestamps]"
+		<< " [-r checkpoint] [-k checkpoint] [-p events] [-m stats] [test]" << std::endl;
+      exit(1);
+    }
+  }
+
+  if (!std::strcmp(format, "json")) event_writer.set_format(e_json);
+  else if (!std::strcmp(format, "binary")) event_writer.set_format(e_binary);
+  else if (std::strcmp(format, "text")) {
+    std::cerr << "Unknown output format: " << format << std::endl;
+    exit(1);
+  }
+
+  if (nb_threads < 1 || (nb_threads > 1 && is_streaming)) {
+    std::cerr << "The -j option needs a positive count and can't be used with -s." << std::endl;
+    exit(1);
+  }
+
+  if (window < 0 || count < 0 || match_window < 0 || compact_window < 0 || 
+      checkpoint.period < 0) 
+  {
+    std::cerr << "The -w, -c, -i, -d and -p options can't be negative." << std::endl;
+    exit(1);
+  }
+  compactor.set_window(compact_window);
+
+  bool is_checkpointed = checkpoint.restore_file || checkpoint.save_file;
+  if ((is_checkpointed && nb_threads > 1) || (checkpoint.period > 0 && !checkpoint.save_file)) {
+    std::cerr << "The -r and -k options can't be used with -j and -p needs -k." << std::endl;
+    exit(1);
+  }
+
+#ifdef FILEVENTS_STATS
+  stats_file_name = stats_file;
+  signal(SIGUSR1, request_stats);
+#else
+  if (stats_file) {
+    std::cerr << "The -m option needs a build with FILEVENTS_STATS defined." << std::endl;
+    exit(1);
+  }
+#endif
+
+  t_reorder_buffer reorder (window, count);
+
+  if (optind < argc) {
+    run_tests();
+  }
+  else if (nb_threads > 1) {
+    t_shard_list shards;
+    for (int i = 0; i < nb_threads; ++i) {
+      shards.push_back(new t_shard());
+      shards.back()->state.match_window = match_window;
+    }
+
+    if (!read_sharded_events (shards, file_name, reorder)) {
+      std::cerr << "Unable to read the events!" << std::endl;
+      exit(1);
+    }
+    simplify_shards (shards);
+    print_shards (shards);
+
+#ifdef FILEVENTS_STATS
+    std::vector<const t_algo_state*> states;
+    for (int i = 0; i < nb_threads; ++i) {
+      states.push_back(&shards[i]->state);
+    }
+    dump_stats(states);
+#endif
+
+    for (int i = 0; i < nb_threads; ++i) {
+      delete shards[i];
+    }
+  }
+  else {
+    t_algo_state state;
+    state.match_window = match_window;
+    if (!read_events (state, file_name, is_streaming, reorder, &checkpoint)) {
+      std::cerr << "Unable to read the events!" << std::endl;
+      exit(1);
+    }
+
+    // Whatever is left is in the checkpoint.
+    if (!checkpoint.save_file) {
+      simplify_state (state);
+      print_state (state);
+    }
+
+#ifdef FILEVENTS_STATS
+    dump_stats(std::vector<const t_algo_state*>(1, &state));
+#endif
+  }
+
+  if (reorder.get_late_count() > 0) {
+    std::cerr << reorder.get_late_count() 
+	      << " events arrived too late to be put back in order." << std::endl;
+  }
+  return 0;
+}
+
+#endif
+
+
+/*******************************************************************************
+ * File simplifications
+ ******************************************************************************/
+
+//! Reduces an DEL and a ADD event to a MOVE event is the hash is the same.
+bool simplify_to_move_event(t_algo_state& state, p_event ev, t_event_pos prev_pos) {
+  p_event prev_ev = state.events[prev_pos];
+
+  if (prev_ev->file_type == e_file && ev->event_type == e_new) {
+
+    if (prev_ev->event_type == e_delete) {
+
+      if (prev_ev->hash == ev->hash) {
+	p_event move_ev = 
+	  make_move_event(state, e_file, ev->timestamp, prev_ev->path, ev->path);
+
+	// std::cout << "MOV - "; print_event(*move_ev);
+
+	remove_event(state, prev_pos);
+	insert_event(state, move_ev);
+	STATS_INC(state, e_file_moves);
+	return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+
+/*!
+  Takes a DEL and an ADD event and reduces them to a MODIFY event if only the hash 
+  has changed.
+*/
+bool simplify_to_modify_event(t_algo_state& state, p_event ev, t_event_pos prev_pos) {
+  p_event prev_ev = state.events[prev_pos];
+
+  if (prev_ev->file_type == e_file && ev->event_type == e_new) {
+
+    if (prev_ev->event_type == e_delete) {
+
+      if  (prev_ev->path == ev->path) {
+	p_event modify_ev = make_modify_event(state,
+					      e_file, 
+					      ev->timestamp, 
+					      ev->path, 
+					      prev_ev->hash, 
+					      ev->hash);
+
+	// std::cout << "MOD - "; print_event(*modify_ev);
+
+	remove_event(state, prev_pos);
+	insert_event(state, modify_ev);
+	STATS_INC(state, e_file_modifies);
+	return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+
+/*!
+  Looks up the source of a possible copy for the file event and updates the hash index.
+  The source, if any, is stored in the src_path of the event.
+*/
+void index_event (t_hash_index& hash_index, p_event ev) {
+  if (ev->file_type != e_file)
+    return;
+
+  // No matter what happens to the event, if a new event comes in for a file
+  //   Then something changed so we need to update the index.
+  if (ev->event_type == e_new) {
+    hash_index.find(ev->hash, ev->src_path);
+
+    // std::cout << "I++ - (" << ev->hash << ", " << path_to_string(ev->path) << ")" << std::endl;
+
+    hash_index.insert(ev->hash, ev->path);
+  }
+
+  else if (ev->event_type == e_delete) {
+    // std::cout << "I-- - (" << ev->hash << ", " << path_to_string(ev->path) << ")" << std::endl;
+
+    hash_index.erase(ev->hash, ev->path);
+  }
+}
+
+
+/*!
+  Reduces an ADD event and a pending DEL event with the same hash to a MOVE event even
+  if other events came in between.
+*/
+bool simplify_to_pending_move (t_algo_state& state, p_event ev) {
+  if (ev->event_type != e_new)
+    return false;
+
+  p_event del_ev = state.pending.find_file(ev->hash, ev->timestamp - state.match_window);
+  if (!del_ev)
+    return false;
+
+  p_event move_ev = 
+    make_move_event(state, e_file, ev->timestamp, del_ev->path, ev->path);
+
+  // std::cout << "MOV - "; print_event(*move_ev);
+
+  remove_event(state, find_event(state, del_ev));
+  insert_event(state, move_ev);
+  STATS_INC(state, e_interleaved_moves);
+  return true;
+}
+
+
+//! Replaces an ADD event by a COPY event if a file with the same hash existed.
+bool simplify_to_copy_event(t_algo_state& state, p_event ev) {
+  if (ev->event_type == e_new) {
+
+    if (ev->src_path != NULL_PATH) {
+      p_event copy_ev = 
+	make_copy_event(state, e_file, ev->timestamp, ev->src_path, ev->path);
+      copy_ev->hash = ev->hash;
+      insert_event(state, copy_ev);
+      // std::cout << "COP - (" << ev->hash << ") "; print_event(*copy_ev);
+
+      STATS_INC(state, e_file_copies);
+      return true;
+    }   
+  }
+
+  return false;
+}
+
+
+/*!
+  Adds the given event to the event list and tries to simplify it to an higher order event
+  if possible. File events are merged with the previous event while folder events are
+  handed over to simplify_folder_events().
+
+  This function assumes that the events are given in their proper timetamp order.
+  The event must come from the state's event pool.
+*/
+void add_to_state (t_algo_state& state, p_event ev) {
+  STATS_TIMER(state, e_stage_add);
+
+  if (state.is_indexed && t_rule_list::uses_hash_index) {
+    index_event(state.hash_index, ev);
+  }
+
+  // The DEL event can't be moved after the path is re-created.
+  if (state.match_window > 0 && ev->event_type == e_new) {
+    state.pending.erase(ev->path);
+  }
+
+  // Try to simplify to an higher level event.
+  //   We process folder events later to avoid mix ups with file events.
+  bool is_added = ev->file_type == e_file && t_rule_list::file(state, ev);
+
+  // Unable to simplify so just add the event as is.
+  if (!is_added) {
+    // std::cout << "ADD - "; print_event(*ev);
+    insert_event(state, ev);
+  }
+
+  simplify_folder_events(state);
+
+  // Nothing is added to a folder that is being deleted so the children that were
+  //   deleted before are on their own and won't be collapsed with the folder.
+  if (state.match_window > 0 && ev->event_type == e_new) {
+    t_path parent = get_parent(ev->path);
+    while (p_event child_ev = state.pending.first_child(parent)) {
+      state.pending.erase(child_ev);
+    }
+  }
+
+  // Only done now so that a folder copy that ends with this event is looked up 
+  //   before the event is applied to the folders.
+  if (t_rule_list::uses_tree_index) {
+    if (ev->event_type == e_new) 
+      state.tree_index.insert(ev->file_type, ev->path, ev->hash);
+    else if (ev->event_type == e_delete)
+      state.tree_index.erase(ev->file_type, ev->path, ev->hash);
+  }
+
+  // The event was replaced by an higher level event so we no longer need it.
+  if (is_added) {
+    state.event_pool.release(ev);
+  }
+
+  STATS_MAX(state, e_max_events, state.events.size());
+}
+
+
+/*******************************************************************************
+ * Folder simplifications
+ ******************************************************************************/
+
+/*!
+  Simplifies a redundant DEL event into a single DEL event. A DEL event is redundant if
+  it is followed by a DEL event on a folder that is a prefix of the current DEL event.
+*/
+bool simplify_folder_delete (t_algo_state& state, t_event_pos prev_pos, t_event_pos cur_pos) {
+  p_event prev_ev = state.events[prev_pos];
+  p_event cur_ev = state.events[cur_pos];
+
+  if (prev_ev->event_type != e_delete || cur_ev->event_type != e_delete)
+    return false;
+  if (cur_ev->file_type != e_folder)
+    return false;
+
+  // If prev_ev redundant?
+  if (cur_ev->path == get_parent(prev_ev->path)) {
+
+    // Digests don't depend on the base folder so the entries can be taken as is.
+    //   Collapsing a child is O(1) no matter how many entries it holds which keeps
+    //   the DEL of a whole tree linear in the number of events.
+    cur_ev->subtree.add(prev_ev->path, prev_ev->hash);
+    cur_ev->subtree.add(prev_ev->subtree);
+    
+    remove_event(state, prev_pos);
+    STATS_INC(state, e_folder_deletes);
+    return true;			       
+  }
+
+  return false;
+}
+
+
+/*!
+  Subtree of the folder DEL event at the position along with the one of the hidden
+  descendants that were deleted before it within the match window (see 
+  t_pending_index).
+*/
+t_subtree whole_subtree (t_algo_state& state, t_event_pos del_pos) {
+  const p_event del_ev = state.events[del_pos];
+  long min_timestamp = del_ev->timestamp - state.match_window;
+
+  t_subtree subtree = del_ev->subtree;
+  for (t_event_pos pos = del_pos; pos > 0; --pos) {
+    const p_event ev = state.events[pos - 1];
+    if (ev->timestamp < min_timestamp)
+      break;
+
+    if (is_sub_path(del_ev->path, ev->path) && state.pending.is_pending(ev)) {
+      subtree.add(ev->path, ev->hash);
+      subtree.add(ev->subtree);
+    }
+  }
+  return subtree;
+}
+
+
+/*!
+  Looks for the hidden descendants that make up the subtree of the ADD events under
+  base along with the folder DEL event at del_pos. They're added from the closest to
+  the DEL event backward so the ones that were deleted well before are left on their
+  own. The position of the oldest of them is stored in first_pos.
+*/
+bool match_hidden_events (t_algo_state& state, t_event_pos del_pos, 
+			  const t_subtree& add_subtree, t_path base, t_event_pos& first_pos) 
+{
+  const p_event del_ev = state.events[del_pos];
+  long min_timestamp = del_ev->timestamp - state.match_window;
+
+  t_subtree subtree = del_ev->subtree;
+  for (t_event_pos pos = del_pos; pos > 0; --pos) {
+    const p_event ev = state.events[pos - 1];
+    if (ev->timestamp < min_timestamp)
+      break;
+    if (!is_sub_path(del_ev->path, ev->path) || !state.pending.is_pending(ev))
+      continue;
+
+    subtree.add(ev->path, ev->hash);
+    subtree.add(ev->subtree);
+    if (add_subtree.is_same(base, subtree, del_ev->path)) {
+      first_pos = pos - 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/*!
+  Removes the hidden descendants found by match_hidden_events() and returns the new
+  position of the DEL event.
+*/
+t_event_pos remove_hidden_events (t_algo_state& state, t_event_pos del_pos, t_event_pos first_pos) {
+  const p_event del_ev = state.events[del_pos];
+
+  for (t_event_pos pos = del_pos; pos > first_pos; --pos) {
+    const p_event ev = state.events[pos - 1];
+    if (is_sub_path(del_ev->path, ev->path) && state.pending.is_pending(ev)) {
+      remove_event(state, pos - 1);
+      --del_pos;
+    }
+  }
+  return del_pos;
+}
+
+
+/*!
+  Simplifies a folder DEL event and the range of ADD event that follows it up to end_pos
+  to a single MOVE event if the affected files are the same. The ADD events are
+  summarized in state.add_subtree as they arrive (see simplify_folder_events()) so
+  only the two digests need to be compared.
+*/
+bool simplify_to_folder_move (t_algo_state& state, t_event_pos prev_pos, t_event_pos end_pos) {
+  t_event_pos cur_pos = prev_pos + 1;
+
+  const p_event prev_ev = state.events[prev_pos];
+  const p_event base_new_ev = state.events[cur_pos];
+
+  if (prev_ev->event_type != e_delete || base_new_ev->event_type != e_new)
+    return false;
+
+  if (prev_ev->file_type != e_folder || base_new_ev->file_type != e_folder)
+    return false;
+
+  // Something that isn't part of the folder was inserted between the ADD events.
+  const t_subtree& add_subtree = state.add_subtree;
+  if (end_pos - cur_pos - 1 != add_subtree.size)
+    return false;
+
+  // Are the subtree the same? The children that were deleted on their own before the
+  //   folder might also be part of it (see simplify_folder_events()).
+  STATS_INC(state, e_subtree_compares);
+  STATS_ADD(state, e_subtree_entries, add_subtree.size);
+  t_event_pos hidden_pos = prev_pos;
+  if (!add_subtree.is_same(base_new_ev->path, prev_ev->subtree, prev_ev->path)) {
+    if (state.match_window <= 0 || 
+	!match_hidden_events(state, prev_pos, add_subtree, base_new_ev->path, hidden_pos))
+      return false;
+  }
+
+  // Ok, we have a move/rename event.
+  p_event move_ev = make_move_event(state, 
+				    e_folder, 
+				    base_new_ev->timestamp, 
+				    prev_ev->path,
+				    base_new_ev->path);
+
+  // std::cout << "COP - "; print_event(*move_ev);
+
+  if (hidden_pos != prev_pos) {
+    t_event_pos new_prev_pos = remove_hidden_events(state, prev_pos, hidden_pos);
+    end_pos -= prev_pos - new_prev_pos;
+    prev_pos = new_prev_pos;
+  }
+  remove_event(state, prev_pos, end_pos);
+  insert_event(state, move_ev);
+  STATS_INC(state, e_folder_moves);
+  return true;
+}
+
+
+/*!
+  Same as simplify_to_folder_move() but with a pending DEL folder event that doesn't
+  have to come right before the ADD events.
+*/
+bool simplify_to_pending_folder_move (t_algo_state& state, 
+				      t_event_pos cur_pos, 
+				      t_event_pos end_pos) 
+{
+  const p_event base_new_ev = state.events[cur_pos];
+
+  const t_subtree& add_subtree = state.add_subtree;
+  if (end_pos - cur_pos - 1 != add_subtree.size)
+    return false;
+
+  STATS_INC(state, e_subtree_compares);
+  STATS_ADD(state, e_subtree_entries, add_subtree.size);
+  long min_timestamp = base_new_ev->timestamp - state.match_window;
+  bool is_whole;
+  p_event del_ev;
+  t_event_pos del_pos = NULL_POS;
+  t_event_pos hidden_pos = NULL_POS;
+  while ((del_ev = state.pending.find_folder(add_subtree, 
+					     base_new_ev->path, 
+					     min_timestamp,
+					     is_whole))) 
+  {
+    del_pos = find_event(state, del_ev);
+    hidden_pos = del_pos;
+    if (!is_whole || 
+	match_hidden_events(state, del_pos, add_subtree, base_new_ev->path, hidden_pos))
+      break;
+
+    // Some of the hidden descendants were dropped since.
+    state.pending.erase_whole(del_ev);
+  }
+  if (!del_ev)
+    return false;
+
+  p_event move_ev = make_move_event(state, 
+				    e_folder, 
+				    base_new_ev->timestamp, 
+				    del_ev->path,
+				    base_new_ev->path);
+
+  // std::cout << "MOV - "; print_event(*move_ev);
+
+  // The DEL events come before the ADD events so their positions aren't affected.
+  remove_event(state, cur_pos, end_pos);
+  if (hidden_pos != del_pos)
+    del_pos = remove_hidden_events(state, del_pos, hidden_pos);
+  remove_event(state, del_pos);
+  insert_event(state, move_ev);
+  STATS_INC(state, e_interleaved_folder_moves);
+  return true;
+}
+
+
+/*!
+  Simplifies a folder ADD event and the range of ADD and COPY events that follows it up
+  to end_pos to a single COPY event if a live folder has the same content.
+*/
+bool simplify_to_folder_copy (t_algo_state& state, t_event_pos cur_pos, t_event_pos end_pos) {
+  const p_event base_new_ev = state.events[cur_pos];
+
+  const t_subtree& add_subtree = state.add_subtree;
+  if (end_pos - cur_pos - 1 != add_subtree.size)
+    return false;
+
+  STATS_INC(state, e_subtree_compares);
+  STATS_ADD(state, e_subtree_entries, add_subtree.size);
+  t_path src_path;
+  if (!state.tree_index.find(add_subtree, base_new_ev->path, src_path))
+    return false;
+
+  p_event copy_ev = make_copy_event(state, 
+				    e_folder, 
+				    base_new_ev->timestamp, 
+				    src_path,
+				    base_new_ev->path);
+
+  // The copy was made without the files deleted from the source so these deletes 
+  //   can't be turned into a later move anymore.
+  if (state.match_window > 0) {
+    long min_timestamp = base_new_ev->timestamp - state.match_window;
+
+    for (t_event_pos pos = cur_pos; pos > 0; --pos) {
+      const p_event ev = state.events[pos - 1];
+      if (ev->timestamp < min_timestamp)
+	break;
+      if (is_sub_path(src_path, ev->path))
+	state.pending.erase(ev);
+    }
+  }
+
+  // std::cout << "COP - "; print_event(*copy_ev);
+
+  remove_event(state, cur_pos, end_pos);
+  insert_event(state, copy_ev);
+  STATS_INC(state, e_folder_copies);
+  return true;
+}
+
+
+/*!
+  Closes the folder ADD started by state.add_pos (if any). The events that make up the
+  folder are those between the ADD event and end_pos. It's a move if the folder was 
+  deleted right before, otherwise it might be a copy.
+*/
+void close_folder_add (t_algo_state& state, t_event_pos end_pos) {
+  if (state.add_pos == NULL_POS)
+    return;
+
+  t_event_pos add_pos = state.add_pos;
+  state.add_pos = NULL_POS;
+
+  t_rule_list::folder_add(state, add_pos, end_pos);
+}
+
+
+/*!
+  Folder counterpart of add_to_state() which is called once the last event of the list
+  is in place. It collapses DEL events into the DEL folder event that follows them and
+  keeps track of the events that could turn out to be a folder move or copy.
+
+  A folder move or copy can only be decided once we've seen all the events for the
+  folder so the ADD folder event is left in state.add_pos until an event that isn't
+  part of the folder shows up (or until simplify_state() is called). The files of a
+  copied folder are usually COPY events by then so those are part of the folder too.
+*/
+void simplify_folder_events (t_algo_state& state) {
+  t_event_pos cur_pos = state.events.size() - 1;
+
+  if (state.add_pos != NULL_POS) {
+    const p_event base_new_ev = state.events[state.add_pos];
+    const p_event cur_ev = state.events[cur_pos];
+
+    // Still part of the added folder?
+    bool is_content = cur_ev->event_type == e_new || 
+      (cur_ev->event_type == e_copy && cur_ev->file_type == e_file);
+
+    if (is_content && is_sub_path(base_new_ev->path, cur_ev->path)) {
+      state.add_subtree.add(cur_ev->path, cur_ev->hash);
+      return;
+    }
+
+    close_folder_add(state, cur_pos);
+
+    // The move or copy event might have ended up after us if we share its timestamp.
+    cur_pos = state.events.size() - 1;
+    while (state.events[cur_pos] != cur_ev) --cur_pos;
+  }
+
+  while (cur_pos > 0 && t_rule_list::folder_delete(state, cur_pos - 1, cur_pos)) {
+    --cur_pos;
+  }
+
+  const p_event cur_ev = state.events[cur_pos];
+  if (t_rule_list::uses_folder_adds && 
+      cur_ev->event_type == e_new && cur_ev->file_type == e_folder) 
+  {
+    state.add_pos = cur_pos;
+    state.add_subtree = t_subtree();
+  }
+
+  if (state.match_window > 0 && cur_ev->event_type == e_delete) {
+
+    // Pick up the children that were deleted along with other DEL events. A child 
+    //   deleted before an event of another kind might come from an earlier operation
+    //   so it's left on its own (see t_pending_index::find_folder()).
+    if (cur_ev->file_type == e_folder) {
+      long min_timestamp = cur_ev->timestamp - state.match_window;
+
+      t_event_pos run_pos = cur_pos;
+      while (run_pos > 0 && state.events[run_pos - 1]->event_type == e_delete) {
+	--run_pos;
+      }
+      long run_timestamp = state.events[run_pos]->timestamp;
+
+      p_event child_ev = state.pending.first_child(cur_ev->path);
+      while (child_ev) {
+	p_event next_ev = state.pending.next_sibling(child_ev);
+
+	if (child_ev->timestamp < min_timestamp) {
+	  state.pending.erase(child_ev);
+	}
+	else if (child_ev->timestamp >= run_timestamp) {
+	  t_event_pos child_pos = find_event(state, child_ev);
+	  if (child_pos >= run_pos) {
+	    cur_ev->subtree.add(child_ev->path, child_ev->hash);
+	    cur_ev->subtree.add(child_ev->subtree);
+	    remove_event(state, child_pos);
+	  }
+	  else {
+	    state.pending.hide(child_ev);
+	  }
+	}
+	else {
+	  state.pending.hide(child_ev);
+	}
+
+	child_ev = next_ev;
+      }
+    }
+
+    state.pending.insert(cur_ev);
+
+    if (cur_ev->file_type == e_folder) {
+      cur_pos = find_event(state, cur_ev);
+      t_subtree subtree = whole_subtree(state, cur_pos);
+      if (subtree.size != cur_ev->subtree.size)
+	state.pending.insert_whole(cur_ev, subtree);
+    }
+  }
+}
+
+
+/*!
+  Wraps up the simplification once there are no more events to process.
+
+  Note that a COPY folder event is only detected if the entire source folder was seen
+  being created. Otherwise we'd risk identifying random bits and pieces as an entire
+  folder tree and base our copy decisions on that which is wrong (see t_tree_index).
+*/
+void simplify_state (t_algo_state& state) {
+  STATS_TIMER(state, e_stage_simplify);
+
+  // std::cout << "SIM - Simplifying state." << std::endl;
+
+  close_folder_add(state, state.events.size());
+}
+
+
+/*!
+  Hands over to the sink and removes every event at the front of the list that can no
+  longer be simplified. What's left is either an open folder ADD or a chain of DEL events
+  that could still be collapsed into a later DEL folder event. The last event is
+  always kept since the next file event might be merged with it.
+*/
+void pop_done_events (t_algo_state& state, t_event_sink sink, void* data) {
+  if (state.events.empty())
+    return;
+
+  t_event_pos pending_pos = state.events.size() - 1;
+  p_event move_ev = NULL;
+
+  if (state.add_pos != NULL_POS) {
+    pending_pos = state.add_pos;
+
+    // Could still be the source of a folder move.
+    const p_event prev_ev = pending_pos > 0 ? state.events[pending_pos - 1] : NULL;
+    if (prev_ev && prev_ev->event_type == e_delete && prev_ev->file_type == e_folder) {
+      --pending_pos;
+      move_ev = prev_ev;
+    }
+  }
+
+  // A DEL can only be collapsed later if every DEL after it is within its parent.
+  else if (state.events[pending_pos]->event_type == e_delete && pending_pos > 0) {
+    const p_event prev_ev = state.events[pending_pos - 1];
+    const p_event cur_ev = state.events[pending_pos];
+
+    if (prev_ev->event_type == e_delete && 
+	is_sub_path(get_parent(prev_ev->path), cur_ev->path))
+    {
+      return;
+    }
+  }
+
+  // DEL events that can still be paired hold back everything after them. A folder DEL
+  //   event with hidden descendants also holds back the events of its window since
+  //   they can still be part of it (see match_hidden_events()), for as long as it can
+  //   be paired or is right before the ADD events being collapsed.
+  if (state.match_window > 0) {
+    long min_timestamp = state.events.back()->timestamp - state.match_window;
+    bool is_held = move_ev != NULL;
+    long hold_timestamp = is_held ? move_ev->timestamp - state.match_window : 0;
+
+    const p_event oldest_ev = state.pending.oldest(min_timestamp);
+    if (oldest_ev) {
+      hold_timestamp = is_held ? std::min(hold_timestamp, oldest_ev->timestamp) : 
+	oldest_ev->timestamp;
+      is_held = true;
+    }
+
+    const p_event whole_ev = state.pending.oldest_whole(min_timestamp);
+    if (whole_ev) {
+      long timestamp = whole_ev->timestamp - state.match_window;
+      hold_timestamp = is_held ? std::min(hold_timestamp, timestamp) : timestamp;
+      is_held = true;
+    }
+
+    if (is_held) {
+      t_event probe;
+      probe.timestamp = hold_timestamp;
+      t_event_pos hold_pos = std::lower_bound(state.events.begin(), state.events.end(), 
+					      &probe, t_event_ts_comp()) - state.events.begin();
+      pending_pos = std::min(pending_pos, hold_pos);
+    }
+  }
+
+  for (t_event_pos pos = 0; pos < pending_pos; ++pos) {
+    sink(*state.events.front(), data);
+    state.pending.erase(state.events.front());
+    state.event_pool.release(state.events.front());
+    state.events.pop_front();
+  }
+  STATS_ADD(state, e_events_written, pending_pos);
+
+  if (state.add_pos != NULL_POS)
+    state.add_pos -= pending_pos;
+}
+
+
+//! Prints every event that can no longer be simplified (see pop_done_events()).
+void flush_state (t_algo_state& state) {
+  STATS_TIMER(state, e_stage_flush);
+
+  pop_done_events(state, compact_event, &compactor);
+  event_writer.flush();
+}
+
+
+/*******************************************************************************
+ * I/O
+ ******************************************************************************/
+
+void print_state (t_algo_state& state) {
+  STATS_TIMER(state, e_stage_print);
+
+  for (t_event_it it = state.events.begin(); it != state.events.end(); ++it) {
+    compactor.write(**it);
+  }
+  compactor.flush();
+  event_writer.flush();
+  STATS_ADD(state, e_events_written, state.events.size());
+}
+
+
+void print_event (const t_event& ev) {
+  event_writer.write(ev);
+  event_writer.flush();
+}
+
+
+//! Sink of pop_done_events() that writes to the event writer.
+void write_event (const t_event& ev, void* data) {
+  event_writer.write(ev);
+}
+
+
+//! Sink of pop_done_events() that goes through the given t_compactor.
+void compact_event (const t_event& ev, void* data) {
+  static_cast<t_compactor*>(data)->write(ev);
+}
+
+
+/*!
+  Reads the events as specified by the challenge's spec from the given file or from
+  std in if file_name is NULL. When streaming, the events that are done being
+  simplified are printed as we go.
+
+  The fields are parsed straight out of the reader's buffer. Only the path and the
+  hash are copied since they need to outlive it. The events then go through the
+  reorder buffer before being simplified.
+
+  When a checkpoint is given, the state is first restored from it and the reading
+  resumes where the checkpoint left off (see t_checkpoint). The reorder buffer isn't
+  drained at the end if the state is saved since more input might come.
+*/
+bool read_events (t_algo_state& state, const char* file_name, bool is_streaming,
+		  t_reorder_buffer& reorder, const t_checkpoint* checkpoint) 
+{
+  t_event_reader reader;
+  if (!reader.open(file_name))
+    return false;
+
+  long nb_events;
+  if (!read_event_count(reader, nb_events))
+    return false;
+
+  long first = 0;
+  if (checkpoint && checkpoint->restore_file) {
+    std::size_t offset;
+    if (!load_checkpoint(checkpoint->restore_file, state, reorder, offset, first))
+      return false;
+    if (!reader.skip(offset))
+      return false;
+  }
+
+  const char* save_file = checkpoint ? checkpoint->save_file : NULL;
+
+  t_event_parser parser;
+  t_raw_event raw;
+  long i = first;
+  for (; i <= nb_events; ++i) {
+    bool is_done;
+    {
+      STATS_TIMER(state, e_stage_read);
+
+      is_done = i == nb_events || !read_event(reader, parser, raw);
+      if (!is_done) {
+	reorder.push(make_input_event(state, raw));
+	STATS_INC(state, e_events_read);
+      }
+    }
+
+    bool is_draining = is_done && !save_file;
+    while (p_event ev = reorder.pop(is_draining)) {
+
+      // print_event(*ev);
+
+      add_to_state(state, ev);
+
+      if (is_streaming)
+	flush_state(state);
+    }
+
+    if (is_streaming)
+      collect_paths(state, reorder, compactor, parser);
+
+    if (is_done)
+      break;
+
+#ifdef FILEVENTS_STATS
+    if (is_stats_requested) {
+      is_stats_requested = 0;
+      dump_stats(std::vector<const t_algo_state*>(1, &state));
+    }
+#endif
+
+    if (save_file && checkpoint->period > 0 && (i + 1) % checkpoint->period == 0) {
+      // The checkpoint doesn't hold the compaction window so it's cut short.
+      compactor.flush();
+      event_writer.flush();
+
+      std::size_t offset = reader.offset() - parser.remaining();
+      if (!save_checkpoint(save_file, state, reorder, offset, i + 1))
+	return false;
+    }
+  }
+
+  if (parser.get_skipped_count() > 0) {
+    std::cerr << parser.get_skipped_count() 
+	      << " lines with an unknown event were skipped." << std::endl;
+  }
+
+  if (save_file) {
+    compactor.flush();
+    event_writer.flush();
+    return save_checkpoint(save_file, state, reorder, reader.offset() - parser.remaining(), i);
+  }
+  return true;
+}
+
+
+//! Reads the number of events that is found on the first line of the input.
+bool read_event_count (t_event_reader& reader, long& nb_events) {
+  t_token line;
+  t_token token;
+
+  // Skip any leading blank lines.
+  do {
+    if (!reader.next_line(line))
+      return false;
+  } while (!next_token(line, token));
+
+  nb_events = token_to_long(token);
+  return true;
+}
+
+
+//! Parses the next event of the input a block at a time (see t_event_parser).
+bool read_event (t_event_reader& reader, t_event_parser& parser, t_raw_event& raw) {
+  while (!parser.next(raw)) {
+    t_token block;
+    if (!reader.next_block(block))
+      return false;
+    parser.parse(block.first, block.last);
+  }
+  return true;
+}
+
+
+//! Creates the event from the state's pool. This is where the hash gets decoded.
+p_event make_input_event (t_algo_state& state, const t_raw_event& raw) {
+  t_hash hash = make_hash(raw.hash.first, raw.hash.last);
+  if (raw.event_type == e_new)
+    return make_new_event (state, raw.file_type, raw.timestamp, raw.path, hash);
+  return make_delete_event (state, raw.file_type, raw.timestamp, raw.path, hash);
+}
+
+
+/*******************************************************************************
+ * Compaction
+ ******************************************************************************/
+
+void t_compactor::write (const t_event& ev) {
+  if (window <= 0) {
+    sink(ev, sink_data);
+    return;
+  }
+
+  if (chains.empty() || ev.timestamp >= window_end) {
+    flush();
+
+    long window_start = ev.timestamp - ev.timestamp % window;
+    if (window_start > ev.timestamp) 
+      window_start -= window;
+    window_end = window_start + window;
+  }
+
+  if (ev.file_type != e_file || ev.event_type == e_copy) {
+    close_chains(ev.path);
+    if (ev.event_type == e_move || ev.event_type == e_copy)
+      close_chains(ev.src_path);
+
+    sink(ev, sink_data);
+    return;
+  }
+
+  std::size_t chain = find_chain(ev.event_type == e_move ? ev.src_path : ev.path);
+
+  switch (ev.event_type) {
+
+  case e_new:
+    if (chain != NULL_POS && !chains[chain].is_live) {
+      chains[chain].is_live = true;
+      chains[chain].hash = ev.hash;
+    }
+    else {
+      take_path(ev.path, NULL_POS);
+      chain = open_chain(NULL_PATH, NULL_HASH, ev.path, ev.hash, true);
+    }
+    break;
+
+  case e_delete:
+    if (chain == NULL_POS) {
+      chain = open_chain(ev.path, ev.hash, ev.path, ev.hash, false);
+    }
+    else {
+      t_chain& cur = chains[chain];
+
+      // Only a move so far so the content is the one the file had before the window.
+      if (cur.hash == NULL_HASH && cur.src_hash == NULL_HASH)
+	cur.src_hash = ev.hash;
+      cur.hash = ev.hash;
+      cur.is_live = false;
+    }
+    break;
+
+  case e_modify:
+    if (chain == NULL_POS) {
+      chain = open_chain(ev.path, ev.old_hash, ev.path, ev.hash, true);
+    }
+    else {
+      t_chain& cur = chains[chain];
+      if (cur.hash == NULL_HASH && cur.src_hash == NULL_HASH)
+	cur.src_hash = ev.old_hash;
+      cur.hash = ev.hash;
+    }
+    break;
+
+  case e_move:
+    if (chain == NULL_POS)
+      chain = open_chain(ev.src_path, NULL_HASH, ev.src_path, NULL_HASH, true);
+
+    take_path(ev.path, chain);
+    chains[chain].path = ev.path;
+    paths[ev.path] = chain;
+    index_chain(ev.path, chain);
+    break;
+
+  default:
+    assert(false && "Unknown event");
+  }
+
+  chains[chain].timestamp = ev.timestamp;
+}
+
+
+//! Sends the events of every chain that is still open and starts a new window.
+void t_compactor::flush () {
+  for (std::size_t i = 0; i < chains.size(); ++i) {
+    if (chains[i].is_open)
+      close_chain(i);
+  }
+
+  chains.clear();
+  paths.clear();
+  sources.clear();
+  folders.clear();
+}
+
+
+//! Marks the paths of the chains of the window (see t_path_trie::collect()).
+void t_compactor::mark_paths (std::vector<char>& marks) const {
+  for (std::size_t i = 0; i < chains.size(); ++i) {
+    path_trie().mark(chains[i].src_path, marks);
+    path_trie().mark(chains[i].path, marks);
+  }
+
+  for (t_chain_map::const_iterator it = paths.begin(); it != paths.end(); ++it) {
+    path_trie().mark(it->first, marks);
+  }
+  for (t_chain_map::const_iterator it = sources.begin(); it != sources.end(); ++it) {
+    path_trie().mark(it->first, marks);
+  }
+  for (t_folder_map::const_iterator it = folders.begin(); it != folders.end(); ++it) {
+    path_trie().mark(it->first, marks);
+  }
+}
+
+
+//! Open chain that's currently on the path (live or not) or NULL_POS.
+std::size_t t_compactor::find_chain (t_path path) const {
+  t_chain_map::const_iterator it = paths.find(path);
+  if (it == paths.end())
+    return NULL_POS;
+
+  const t_chain& chain = chains[it->second];
+  return chain.is_open && chain.path == path ? it->second : NULL_POS;
+}
+
+
+std::size_t t_compactor::open_chain (t_path src_path, const t_hash& src_hash, 
+				     t_path path, const t_hash& hash, bool is_live) 
+{
+  t_chain chain;
+  chain.src_path = src_path;
+  chain.src_hash = src_hash;
+  chain.path = path;
+  chain.hash = hash;
+  chain.is_live = is_live;
+  chain.timestamp = 0;
+  chain.is_open = true;
+
+  std::size_t pos = chains.size();
+  chains.push_back(chain);
+
+  paths[path] = pos;
+  index_chain(path, pos);
+  if (src_path != NULL_PATH) {
+    sources[src_path] = pos;
+    if (src_path != path)
+      index_chain(src_path, pos);
+  }
+  return pos;
+}
+
+
+//! Closes the chain that left the path before the given chain takes it.
+void t_compactor::take_path (t_path path, std::size_t chain) {
+  t_chain_map::iterator it = sources.find(path);
+  if (it == sources.end() || it->second == chain)
+    return;
+
+  std::size_t other = it->second;
+  if (chains[other].is_open)
+    close_chain(other);
+}
+
+
+//! Adds the chain to the path and to every folder above it.
+void t_compactor::index_chain (t_path path, std::size_t chain) {
+  for (; path != NULL_PATH; path = get_parent(path)) {
+    folders[path].push_back(chain);
+  }
+}
+
+
+//! Sends the events that take the file from its source to where it is now.
+void t_compactor::close_chain (std::size_t pos) {
+  t_chain& chain = chains[pos];
+  chain.is_open = false;
+
+  if (chain.src_path == NULL_PATH) {
+    if (chain.is_live)
+      send(e_new, chain.timestamp, NULL_PATH, chain.path, NULL_HASH, chain.hash);
+    return;
+  }
+
+  if (!chain.is_live) {
+    send(e_delete, chain.timestamp, NULL_PATH, chain.src_path, NULL_HASH, chain.src_hash);
+    return;
+  }
+
+  if (chain.path != chain.src_path)
+    send(e_move, chain.timestamp, chain.src_path, chain.path, NULL_HASH, NULL_HASH);
+
+  if (chain.src_hash != NULL_HASH && !(chain.hash == chain.src_hash))
+    send(e_modify, chain.timestamp, NULL_PATH, chain.path, chain.src_hash, chain.hash);
+}
+
+
+/*!
+  Closes every chain that starts or ends at the path or under it, in the order they
+  were opened. Only the chains indexed under the path are looked at and none of them 
+  is left open afterward so the path is dropped from the index.
+*/
+void t_compactor::close_chains (t_path path) {
+  t_folder_map::iterator it = folders.find(path);
+  if (it == folders.end())
+    return;
+
+  std::vector<std::size_t> candidates;
+  candidates.swap(it->second);
+  folders.erase(it);
+
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+  for (std::size_t j = 0; j < candidates.size(); ++j) {
+    std::size_t i = candidates[j];
+    const t_chain& chain = chains[i];
+    if (!chain.is_open)
+      continue;
+
+    bool is_touched = 
+      chain.path == path || is_sub_path(path, chain.path) ||
+      (chain.src_path != NULL_PATH && 
+       (chain.src_path == path || is_sub_path(path, chain.src_path)));
+
+    if (is_touched)
+      close_chain(i);
+  }
+}
+
+
+void t_compactor::send (t_event_type type, long timestamp, t_path src_path, t_path path, 
+			const t_hash& old_hash, const t_hash& hash) 
+{
+  t_event ev;
+  ev.event_type = type;
+  ev.file_type = e_file;
+  ev.timestamp = timestamp;
+  ev.src_path = src_path;
+  ev.path = path;
+  ev.old_hash = old_hash;
+  ev.hash = hash;
+  sink(ev, sink_data);
+}
+
+
+/*******************************************************************************
+ * Input utilities
+ ******************************************************************************/
+
+t_event_reader::~t_event_reader () {
+  if (map != NULL)
+    munmap(map, map_size);
+  if (fd > 0)
+    close(fd);
+}
+
+
+//! Offset in the input of the next line.
+std::size_t t_event_reader::offset () const {
+  if (map != NULL)
+    return cur - map;
+  return base + (cur - &buffer[0]);
+}
+
+
+/*!
+  Moves ahead to the given offset in the input. Inputs that can't be mapped are read
+  up to it.
+*/
+bool t_event_reader::skip (std::size_t new_offset) {
+  if (new_offset < offset())
+    return false;
+
+  if (map != NULL) {
+    if (new_offset > map_size)
+      return false;
+    cur = map + new_offset;
+    return true;
+  }
+
+  while (base + (end - &buffer[0]) < new_offset) {
+    cur = end;
+    if (!fill())
+      return false;
+  }
+
+  cur = &buffer[0] + (new_offset - base);
+  return true;
+}
+
+
+//! Opens the file (or std in if NULL) and maps it in memory if we can.
+bool t_event_reader::open (const char* file_name) {
+  fd = file_name == NULL ? 0 : ::open(file_name, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (addr != MAP_FAILED) {
+      madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+      map = static_cast<char*>(addr);
+      map_size = st.st_size;
+      cur = map;
+      end = map + map_size;
+      is_eof = true;
+      return true;
+    }
+  }
+
+  // Can't be mapped so fall back on reading blocks.
+  buffer.resize(READ_BLOCK_SIZE);
+  cur = end = &buffer[0];
+  return true;
+}
+
+
+/*!
+  Moves the partial line at the end of the buffer to the front and reads the next
+  block after it. The buffer is grown if a single line doesn't fit in it.
+*/
+bool t_event_reader::fill () {
+  if (is_eof)
+    return false;
+
+  std::size_t partial = end - cur;
+  base += cur - &buffer[0];
+  std::memmove(&buffer[0], cur, partial);
+
+  if (partial == buffer.size())
+    buffer.resize(buffer.size() * 2);
+
+  ssize_t count;
+  do {
+    count = read(fd, &buffer[partial], buffer.size() - partial);
+  } while (count < 0 && errno == EINTR);
+
+  if (count <= 0) {
+    is_eof = true;
+    count = 0;
+  }
+
+  cur = &buffer[0];
+  end = cur + partial + count;
+  return count > 0;
+}
+
+
+//! Returns the next line of the input without its end of line character.
+bool t_event_reader::next_line (t_token& line) {
+  while (true) {
+    const char* eol = std::find(cur, end, '\n');
+
+    if (eol != end) {
+      line.first = cur;
+      line.last = eol;
+      cur = eol + 1;
+      return true;
+    }
+
+    // Last line doesn't have to end with an eol.
+    if (!fill()) {
+      if (cur == end)
+	return false;
+      line.first = cur;
+      line.last = end;
+      cur = end;
+      return true;
+    }
+  }
+}
+
+
+/*!
+  Returns the whole lines at the front of the input, up to about READ_BLOCK_SIZE
+  bytes unless a single line is longer than that.
+*/
+bool t_event_reader::next_block (t_token& block) {
+  while (true) {
+    const char* limit = 
+      static_cast<std::size_t>(end - cur) > READ_BLOCK_SIZE ? cur + READ_BLOCK_SIZE : end;
+
+    const char* eol = limit;
+    while (eol != cur && eol[-1] != '\n') --eol;
+
+    if (eol == cur) {
+      eol = std::find(limit, end, '\n');
+      eol = eol == end ? cur : eol + 1;
+    }
+
+    if (eol != cur) {
+      block.first = cur;
+      block.last = eol;
+      cur = eol;
+      return true;
+    }
+
+    // Last line doesn't have to end with an eol.
+    if (!fill()) {
+      if (cur == end)
+	return false;
+      block.first = cur;
+      block.last = end;
+      cur = end;
+      return true;
+    }
+  }
+}
+
+
+/*!
+  Offsets of every byte of the range that separates two fields (see isspace()) or 
+  two path components. The offsets are written at the front of marks which is grown
+  as needed and the number of offsets is returned.
+*/
+std::size_t find_separators (const char* first, const char* last, std::vector<unsigned>& marks) {
+  if (marks.size() < static_cast<std::size_t>(last - first) + 1)
+    marks.resize(last - first + 1);
+
+  unsigned* out = &marks[0];
+  const char* it = first;
+
+#ifdef __SSE2__
+  const __m128i slash = _mm_set1_epi8(SEP[0]);
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i before_tab = _mm_set1_epi8('\t' - 1);
+  const __m128i after_cr = _mm_set1_epi8('\r' + 1);
+
+  for (; last - it >= 16; it += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+
+    // The bytes above 127 are negative so they're never between \t and \r.
+    __m128i is_separator = _mm_or_si128(
+	_mm_or_si128(_mm_cmpeq_epi8(bytes, slash), _mm_cmpeq_epi8(bytes, space)),
+	_mm_and_si128(_mm_cmpgt_epi8(bytes, before_tab), _mm_cmplt_epi8(bytes, after_cr)));
+
+    unsigned mask = _mm_movemask_epi8(is_separator);
+    unsigned offset = it - first;
+    while (mask != 0) {
+      *out++ = offset + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; it != last; ++it) {
+    if (*it == SEP[0] || isspace(static_cast<unsigned char>(*it)))
+      *out++ = it - first;
+  }
+
+  return out - &marks[0];
+}
+
+
+/*!
+  Parses every line of the block. Blank lines and unknown events are skipped. Lines
+  are split on the separators: a white space ends a field and ends the line if it's
+  an eol while slashes are only used to split the path.
+*/
+void t_event_parser::parse (const char* first, const char* last) {
+  events.clear();
+  ends.clear();
+  pos = 0;
+  block.first = first;
+  block.last = last;
+
+  std::size_t nb_marks = find_separators(first, last, marks);
+
+  t_token tokens[4];
+  std::size_t nb_tokens = 0;
+  std::size_t path_mark = 0;
+  std::size_t path_mark_end = 0;
+
+  const char* token_first = first;
+  std::size_t token_mark = 0;
+
+  for (std::size_t i = 0; i <= nb_marks; ++i) {
+    const char* it = i < nb_marks ? first + marks[i] : last;
+    if (it != last && *it == SEP[0])
+      continue;
+
+    if (it != token_first && nb_tokens < 4) {
+      tokens[nb_tokens].first = token_first;
+      tokens[nb_tokens].last = it;
+
+      // Slashes of the path.
+      if (nb_tokens == 2) {
+	path_mark = token_mark;
+	path_mark_end = i;
+      }
+      ++nb_tokens;
+    }
+
+    bool is_eol = it == last || *it == '\n';
+    if (is_eol && nb_tokens > 0) {
+      add_event(tokens, nb_tokens, path_mark, path_mark_end, it == last ? last : it + 1);
+      nb_tokens = 0;
+    }
+
+    if (it == last)
+      break;
+
+    token_first = it + 1;
+    token_mark = i + 1;
+  }
+}
+
+
+void t_event_parser::add_event (const t_token* tokens, std::size_t nb_tokens,
+				std::size_t path_mark, std::size_t path_mark_end, 
+				const char* end) 
+{
+  t_raw_event raw;
+
+  if (tokens[0].is("ADD"))
+    raw.event_type = e_new;
+  else if (tokens[0].is("DEL"))
+    raw.event_type = e_delete;
+  else {
+    ++skipped_count;
+    return;
+  }
+
+  // Missing fields are left empty.
+  t_token empty;
+  raw.timestamp = token_to_long(nb_tokens > 1 ? tokens[1] : empty);
+  raw.path = nb_tokens > 2 ? make_path(tokens[2], path_mark, path_mark_end) : NULL_PATH;
+  raw.hash = nb_tokens > 3 ? tokens[3] : empty;
+  raw.file_type = raw.hash.is(NULL_HASH_TEXT) ? e_folder : e_file;
+
+  events.push_back(raw);
+  ends.push_back(end);
+}
+
+
+/*!
+  Same as ::make_path() but the slashes of the token are the marks in the given range
+  and the components that it shares with the previous path are taken from it.
+*/
+t_path t_event_parser::make_path (const t_token& token, std::size_t mark, std::size_t mark_end) {
+  bool is_rooted = !token.empty() && *token.first == SEP[0];
+  t_path path = is_rooted ? ROOT_PATH : NULL_PATH;
+
+  bool is_shared = is_rooted == is_last_rooted;
+  is_last_rooted = is_rooted;
+
+  std::size_t depth = 0;
+  const char* it = token.first;
+
+  for (std::size_t i = mark; i <= mark_end; ++i) {
+    const char* next = i < mark_end ? block.first + marks[i] : token.last;
+
+    // Empty components are ignored.
+    if (next != it) {
+      if (is_shared && depth < last_path.size() && path_trie().is_named(last_path[depth], it, next)) {
+	path = last_path[depth];
+      }
+      else {
+	is_shared = false;
+	path = path_trie().intern(path, it, next);
+	if (depth < last_path.size())
+	  last_path[depth] = path;
+	else
+	  last_path.push_back(path);
+      }
+      ++depth;
+    }
+
+    it = next + 1;
+  }
+
+  last_path.resize(depth);
+  return path;
+}
+
+
+//! Marks the paths of the events not taken yet and of the last path (see make_path()).
+void t_event_parser::mark_paths (std::vector<char>& marks) const {
+  for (std::size_t i = pos; i < events.size(); ++i) {
+    path_trie().mark(events[i].path, marks);
+  }
+
+  for (std::size_t i = 0; i < last_path.size(); ++i) {
+    path_trie().mark(last_path[i], marks);
+  }
+}
+
+
+//! Pops the next whitespace delimited token from the front of the line.
+bool next_token (t_token& line, t_token& token) {
+  const char* it = line.first;
+  while (it != line.last && isspace(static_cast<unsigned char>(*it))) ++it;
+
+  token.first = it;
+  while (it != line.last && !isspace(static_cast<unsigned char>(*it))) ++it;
+  token.last = it;
+
+  line.first = it;
+  return !token.empty();
+}
+
+
+long token_to_long (const t_token& token) {
+  const char* it = token.first;
+
+  bool is_negative = it != token.last && *it == '-';
+  if (is_negative) ++it;
+
+  long value = 0;
+  for (; it != token.last && isdigit(static_cast<unsigned char>(*it)); ++it) {
+    value = value * 10 + (*it - '0');
+  }
+  return is_negative ? -value : value;
+}
+
+
+/*******************************************************************************
+ * Reorder buffer
+ ******************************************************************************/
+
+void t_reorder_buffer::push (p_event ev) {
+  if (is_released && ev->timestamp < last_timestamp) {
+    ++late_count;
+    late_events.push_back(ev);
+    return;
+  }
+
+  t_entry entry = {ev->timestamp, sequence++, ev};
+  heap.push(entry);
+
+  if (heap.size() == 1 || ev->timestamp > max_timestamp)
+    max_timestamp = ev->timestamp;
+}
+
+
+/*!
+  Returns the next event that is out of the window or NULL if there's none. Every
+  event is returned when draining.
+*/
+p_event t_reorder_buffer::pop (bool is_draining) {
+  if (!late_events.empty()) {
+    p_event ev = late_events.front();
+    late_events.pop_front();
+    return ev;
+  }
+
+  if (heap.empty())
+    return NULL;
+
+  const t_entry& top = heap.top();
+
+  bool is_ready = is_draining || (window == 0 && count == 0);
+  if (!is_ready && window > 0)
+    is_ready = top.timestamp <= max_timestamp - window;
+  if (!is_ready && count > 0)
+    is_ready = heap.size() > count;
+
+  if (!is_ready)
+    return NULL;
+
+  p_event ev = top.ev;
+  last_timestamp = top.timestamp;
+  is_released = true;
+  heap.pop();
+  return ev;
+}
+
+
+void t_reorder_buffer::mark_paths (std::vector<char>& marks) const {
+  std::priority_queue<t_entry, std::vector<t_entry>, t_entry_comp> copy (heap);
+
+  for (; !copy.empty(); copy.pop()) {
+    path_trie().mark(copy.top().ev->path, marks);
+    path_trie().mark(copy.top().ev->src_path, marks);
+  }
+
+  for (std::size_t i = 0; i < late_events.size(); ++i) {
+    path_trie().mark(late_events[i]->path, marks);
+    path_trie().mark(late_events[i]->src_path, marks);
+  }
+}
+
+
+//! Events are saved from the oldest to the newest along with their sequence.
+void t_reorder_buffer::save (t_checkpoint_writer& out) const {
+  std::priority_queue<t_entry, std::vector<t_entry>, t_entry_comp> copy (heap);
+
+  out.write_value(copy.size());
+  for (; !copy.empty(); copy.pop()) {
+    out.write_value(copy.top().sequence);
+    save_event(out, *copy.top().ev);
+  }
+
+  out.write_value(late_events.size());
+  for (std::size_t i = 0; i < late_events.size(); ++i) {
+    save_event(out, *late_events[i]);
+  }
+
+  out.write_value(max_timestamp);
+  out.write_value(last_timestamp);
+  out.write_value(is_released);
+  out.write_value(sequence);
+  out.write_value(late_count);
+}
+
+
+void t_reorder_buffer::load (t_checkpoint_reader& in, t_algo_state& state) {
+  for (uint64_t count = in.read_value(); count > 0 && in.ok(); --count) {
+    unsigned long entry_sequence = in.read_value();
+    p_event ev = load_event(in, state);
+
+    t_entry entry = {ev->timestamp, entry_sequence, ev};
+    heap.push(entry);
+  }
+
+  for (uint64_t count = in.read_value(); count > 0 && in.ok(); --count) {
+    late_events.push_back(load_event(in, state));
+  }
+
+  max_timestamp = in.read_value();
+  last_timestamp = in.read_value();
+  is_released = in.read_value();
+  sequence = in.read_value();
+  late_count = in.read_value();
+}
+
+
+/*******************************************************************************
+ * Output utilities
+ ******************************************************************************/
+
+void t_event_writer::write (const t_event& ev) {
+  // Nothing happened.
+  if (ev.event_type == e_move && !ev.is_rename() && !ev.is_move())
+    return;
+
+  switch (format) {
+  case e_text: write_text(ev); break;
+  case e_json: write_json(ev); break;
+  case e_binary: write_binary(ev); break;
+  }
+}
+
+
+//! Hands the buffer over to stdout.
+void t_event_writer::flush () {
+  if (used == 0)
+    return;
+
+  fwrite(&buffer[0], 1, used, stdout);
+  used = 0;
+}
+
+
+void t_event_writer::write_text (const t_event& ev) {
+  switch (ev.event_type) {
+
+  case e_new:
+    append("Created the "); append(ev.get_type_name());
+    append(" \""); append_name(ev.path);
+    append("\" in the folder \""); append_path(get_parent(ev.path));
+    if (ev.file_type == e_file) {
+      append("\" with the hash value \""); append_hash(ev.hash);
+    }
+    append("\".\n");
+    break;
+
+  case e_delete:
+    append("Deleted the "); append(ev.get_type_name());
+    append(" \""); append_name(ev.path);
+    append("\" in the folder \""); append_path(get_parent(ev.path));
+    append("\".\n");
+    break;
+
+  case e_modify:
+    append("Modified the "); append(ev.get_type_name());
+    append(" \""); append_name(ev.path);
+    append("\" in the folder \""); append_path(get_parent(ev.path));
+    append("\". The new hash value is \""); append_hash(ev.hash);
+    append("\".\n");
+    break;
+
+  case e_move:
+    append(ev.is_move() ? "Moved the " : "Renamed the "); append(ev.get_type_name());
+    append(" \""); append_name(ev.src_path);
+    append("\" in the folder \""); append_path(get_parent(ev.src_path));
+
+    if (ev.is_move()) {
+      append("\" to the folder \""); append_path(get_parent(ev.path));
+      if (ev.is_rename()) {
+	append("\" with the name \""); append_name(ev.path);
+      }
+    }
+    else {
+      append("\" to \""); append_name(ev.path);
+    }
+    append("\".\n");
+    break;
+
+  case e_copy:
+    append("Copied the "); append(ev.get_type_name());
+    append(" \""); append_name(ev.src_path);
+    append("\" from the folder \""); append_path(get_parent(ev.src_path));
+    append("\" to the folder \""); append_path(get_parent(ev.path));
+    append("\" with the name \""); append_name(ev.path);
+    append("\".\n");
+    break;
+  }
+}
+
+
+void t_event_writer::write_json (const t_event& ev) {
+  static const char* event_names[] = {"new", "delete", "modify", "move", "copy"};
+
+  append("{\"event\":\""); append(event_names[ev.event_type]);
+  append("\",\"type\":\""); append(ev.get_type_name());
+  append("\",\"timestamp\":"); append_long(ev.timestamp);
+
+  append_field("path", ev.path);
+  if (ev.event_type == e_move || ev.event_type == e_copy)
+    append_field("src_path", ev.src_path);
+  if (ev.event_type == e_new || ev.event_type == e_delete || ev.event_type == e_modify)
+    append_field("hash", ev.hash);
+  if (ev.event_type == e_modify)
+    append_field("old_hash", ev.old_hash);
+
+  append("}\n");
+}
+
+
+void t_event_writer::write_binary (const t_event& ev) {
+  append_bytes(ev.event_type, 1);
+  append_bytes(ev.file_type, 1);
+  append_bytes(static_cast<uint64_t>(ev.timestamp), 8);
+
+  append_field(NULL, ev.path);
+  if (ev.event_type == e_move || ev.event_type == e_copy)
+    append_field(NULL, ev.src_path);
+  if (ev.event_type == e_new || ev.event_type == e_delete || ev.event_type == e_modify)
+    append_field(NULL, ev.hash);
+  if (ev.event_type == e_modify)
+    append_field(NULL, ev.old_hash);
+}
+
+
+void t_event_writer::append (const char* first, std::size_t size) {
+  if (used + size > buffer.size()) {
+    flush();
+
+    // Doesn't fit in the buffer anyway.
+    if (size > buffer.size()) {
+      fwrite(first, 1, size, stdout);
+      return;
+    }
+  }
+
+  std::memcpy(&buffer[used], first, size);
+  used += size;
+}
+
+
+//! Escapes the quotes, backslashes and control characters for json.
+void t_event_writer::append_escaped (const char* first, std::size_t size) {
+  const char* last = first + size;
+
+  while (first != last) {
+    const char* it = first;
+    while (it != last && *it != '"' && *it != '\\' && 
+	   static_cast<unsigned char>(*it) >= 0x20) 
+    {
+      ++it;
+    }
+    append(first, it - first);
+    if (it == last)
+      break;
+
+    char escaped[8];
+    snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(*it));
+    append(escaped);
+    first = it + 1;
+  }
+}
+
+
+void t_event_writer::append_long (long value) {
+  char digits[24];
+  char* it = digits + sizeof(digits);
+
+  unsigned long abs_value = value < 0 ? 
+    -static_cast<unsigned long>(value) : static_cast<unsigned long>(value);
+  do {
+    *--it = '0' + abs_value % 10;
+    abs_value /= 10;
+  } while (abs_value != 0);
+  if (value < 0) *--it = '-';
+
+  append(it, digits + sizeof(digits) - it);
+}
+
+
+//! Little endian.
+void t_event_writer::append_bytes (uint64_t value, unsigned size) {
+  char bytes[8];
+  for (unsigned i = 0; i < size; ++i) {
+    bytes[i] = static_cast<char>((value >> (i * 8)) & 0xFF);
+  }
+  append(bytes, size);
+}
+
+
+void t_event_writer::append_name (t_path path) {
+  append(path_trie().name_data(path), path_trie().name_size(path));
+}
+
+
+//! Same as path_to_string().
+void t_event_writer::append_path (t_path path) {
+  nodes.clear();
+  for (; path != NULL_PATH; path = path_trie().parent(path)) {
+    nodes.push_back(path);
+  }
+
+  bool needs_sep = false;
+  for (std::vector<t_path>::reverse_iterator it = nodes.rbegin(); it != nodes.rend(); ++it) {
+    if (needs_sep)
+      append(SEP);
+
+    std::size_t size = path_trie().name_size(*it);
+    const char* name = path_trie().name_data(*it);
+    if (format == e_json)
+      append_escaped(name, size);
+    else
+      append(name, size);
+
+    needs_sep = name[size - 1] != SEP[0];
+  }
+}
+
+
+void t_event_writer::append_hash (const t_hash& hash) {
+  char buffer[HASH_SIZE * 2];
+  std::size_t size;
+  const char* text = format_hash(hash, buffer, size);
+  append(text, size);
+}
+
+
+//! Key is ignored for the binary format.
+void t_event_writer::append_field (const char* key, const t_hash& hash) {
+  char buffer[HASH_SIZE * 2];
+  std::size_t size;
+  const char* text = format_hash(hash, buffer, size);
+
+  if (format == e_binary) {
+    append_bytes(size, 4);
+    append(text, size);
+    return;
+  }
+
+  append(",\""); append(key); append("\":\"");
+  append_escaped(text, size);
+  append("\"");
+}
+
+
+void t_event_writer::append_field (const char* key, t_path path) {
+  if (format == e_binary) {
+    std::size_t size = 0;
+    for (t_path it = path; it != NULL_PATH; it = path_trie().parent(it)) {
+      std::size_t name_size = path_trie().name_size(it);
+      size += name_size;
+
+      // Separator between this node and its child.
+      if (it != path && path_trie().name_data(it)[name_size - 1] != SEP[0]) 
+	++size;
+    }
+
+    append_bytes(size, 4);
+    append_path(path);
+    return;
+  }
+
+  append(",\""); append(key); append("\":\"");
+  append_path(path);
+  append("\"");
+}
+
+
+/*******************************************************************************
+ * Checkpoint
+ ******************************************************************************/
+
+/*!
+  Saves everything needed to resume the simplification at the given offset of the
+  input. The output is flushed first so that nothing printed before the checkpoint
+  can be lost if we crash right after it.
+*/
+bool save_checkpoint (const char* file_name, const t_algo_state& state, 
+		      const t_reorder_buffer& reorder, std::size_t offset, long nb_read)
+{
+  event_writer.flush();
+  fflush(stdout);
+
+  t_checkpoint_writer out;
+  if (!out.open(file_name))
+    return false;
+
+  out.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  out.write_value(CHECKPOINT_VERSION);
+  out.write_value(offset);
+  out.write_value(nb_read);
+
+  path_trie().save(out);
+  state.hash_index.save(out);
+  state.tree_index.save(out);
+
+  out.write_value(state.events.size());
+  for (t_event_cit it = state.events.begin(); it != state.events.end(); ++it) {
+    save_event(out, **it);
+  }
+
+  out.write_value(state.add_pos);
+  out.write_value(state.add_subtree.digest);
+  out.write_value(state.add_subtree.size);
+
+  state.pending.save(out, state.events);
+  reorder.save(out);
+
+  return out.close();
+}
+
+
+/*!
+  Restores a state saved by save_checkpoint() into an empty state. The path trie is
+  replaced as well so this must be done before any path is made.
+*/
+bool load_checkpoint (const char* file_name, t_algo_state& state, 
+		      t_reorder_buffer& reorder, std::size_t& offset, long& nb_read)
+{
+  assert(state.events.empty());
+
+  t_checkpoint_reader in;
+  if (!in.open(file_name)) {
+    std::cerr << "Unable to open the checkpoint: " << file_name << std::endl;
+    return false;
+  }
+  if (!in.ok()) {
+    std::cerr << "The checkpoint is corrupted: " << file_name << std::endl;
+    return false;
+  }
+
+  const char* magic = in.read(sizeof(CHECKPOINT_MAGIC));
+  if (!magic || std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) ||
+      in.read_value() != CHECKPOINT_VERSION) 
+  {
+    std::cerr << "Not a checkpoint or from another version: " << file_name << std::endl;
+    return false;
+  }
+
+  offset = in.read_value();
+  nb_read = in.read_value();
+
+  path_trie().load(in);
+  state.hash_index.load(in);
+  state.tree_index.load(in);
+
+  for (uint64_t count = in.read_value(); count > 0 && in.ok(); --count) {
+    state.events.push_back(load_event(in, state));
+  }
+
+  state.add_pos = in.read_value();
+  state.add_subtree.digest = in.read_value();
+  state.add_subtree.size = in.read_value();
+  if (state.add_pos != NULL_POS && state.add_pos >= state.events.size())
+    in.fail();
+
+  state.pending.load(in, state.events);
+  reorder.load(in, state);
+
+  if (!in.ok() || !in.is_done()) {
+    std::cerr << "The checkpoint is corrupted: " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+
+void save_event (t_checkpoint_writer& out, const t_event& ev) {
+  out.write_value(ev.event_type);
+  out.write_value(ev.file_type);
+  out.write_value(ev.timestamp);
+  out.write_value(ev.path);
+  out.write_value(ev.src_path);
+  out.write(&ev.hash, sizeof(t_hash));
+  out.write(&ev.old_hash, sizeof(t_hash));
+  out.write_value(ev.subtree.digest);
+  out.write_value(ev.subtree.size);
+}
+
+
+p_event load_event (t_checkpoint_reader& in, t_algo_state& state) {
+  uint64_t event_type = in.read_value();
+  uint64_t file_type = in.read_value();
+  long timestamp = in.read_value();
+
+  if (event_type > e_copy || file_type > e_folder) {
+    in.fail();
+    event_type = e_new;
+    file_type = e_file;
+  }
+
+  p_event ev = make_event(state, static_cast<t_event_type>(event_type), 
+			  static_cast<t_file_type>(file_type), timestamp);
+  ev->path = in.read_value();
+  ev->src_path = in.read_value();
+  in.read_hash(ev->hash);
+  in.read_hash(ev->old_hash);
+  ev->subtree.digest = in.read_value();
+  ev->subtree.size = in.read_value();
+
+  if (ev->path >= path_trie().size() || ev->src_path >= path_trie().size())
+    in.fail();
+  return ev;
+}
+
+
+t_checkpoint_writer::~t_checkpoint_writer () {
+  if (file != NULL) {
+    fclose(file);
+    unlink(tmp_name.c_str());
+  }
+}
+
+
+bool t_checkpoint_writer::open (const char* new_file_name) {
+  file_name = new_file_name;
+  tmp_name = file_name + ".tmp";
+
+  file = fopen(tmp_name.c_str(), "wb");
+  is_ok = file != NULL;
+  return is_ok;
+}
+
+
+//! Appends the checksum and moves the file in place once it's safely on disk.
+bool t_checkpoint_writer::close () {
+  write_value(checksum);
+
+  is_ok = is_ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  is_ok = fclose(file) == 0 && is_ok;
+  file = NULL;
+
+  if (is_ok)
+    is_ok = rename(tmp_name.c_str(), file_name.c_str()) == 0;
+  if (!is_ok) {
+    std::cerr << "Unable to write the checkpoint: " << file_name << std::endl;
+    unlink(tmp_name.c_str());
+  }
+  return is_ok;
+}
+
+
+//! Writes the data followed by enough zeros to keep the next write aligned on 8 bytes.
+void t_checkpoint_writer::write (const void* data, std::size_t size) {
+  static const char padding[8] = {0};
+
+  const char* bytes = static_cast<const char*>(data);
+  std::size_t pad_size = (8 - size % 8) % 8;
+
+  is_ok = is_ok && fwrite(bytes, 1, size, file) == size;
+  is_ok = is_ok && fwrite(padding, 1, pad_size, file) == pad_size;
+
+  // Same as the reader: FNV-1a over 8 bytes words.
+  for (std::size_t i = 0; i < size + pad_size; i += 8) {
+    uint64_t word = 0;
+    std::memcpy(&word, bytes + i, std::min<std::size_t>(8, size - i));
+    checksum = (checksum ^ word) * 1099511628211ULL;
+  }
+}
+
+
+t_checkpoint_reader::~t_checkpoint_reader () {
+  if (map != NULL)
+    munmap(map, map_size);
+}
+
+
+//! Maps the file and checks that its content matches its checksum (see ok()).
+bool t_checkpoint_reader::open (const char* file_name) {
+  int fd = ::open(file_name, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size >= 16 && st.st_size % 8 == 0) {
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      map = static_cast<char*>(addr);
+      map_size = st.st_size;
+    }
+  }
+  ::close(fd);
+
+  if (map == NULL)
+    return false;
+
+  cur = map;
+  end = map + map_size - 8;
+
+  t_digest checksum = 0;
+  for (const char* it = cur; it != end; it += 8) {
+    checksum = (checksum ^ *reinterpret_cast<const uint64_t*>(it)) * 1099511628211ULL;
+  }
+
+  is_ok = checksum == *reinterpret_cast<const uint64_t*>(end);
+  return true;
+}
+
+
+//! Returns the data or NULL if there's not enough left.
+const char* t_checkpoint_reader::read (std::size_t size) {
+  std::size_t padded_size = size + (8 - size % 8) % 8;
+  if (!is_ok || size > static_cast<std::size_t>(end - cur) || 
+      padded_size > static_cast<std::size_t>(end - cur)) 
+  {
+    is_ok = false;
+    return NULL;
+  }
+
+  const char* data = cur;
+  cur += padded_size;
+  return data;
+}
+
+
+uint64_t t_checkpoint_reader::read_value () {
+  const char* data = read(sizeof(uint64_t));
+  return data ? *reinterpret_cast<const uint64_t*>(data) : 0;
+}
+
+
+//! The length of the hash must fit in its bytes and a long hash must be in the trie.
+void t_checkpoint_reader::read_hash (t_hash& hash) {
+  const char* data = read(sizeof(t_hash));
+  if (data)
+    std::memcpy(&hash, data, sizeof(t_hash));
+  else
+    hash = NULL_HASH;
+
+  bool is_valid = hash.is_long() ? 
+    hash.length() == sizeof(unsigned) && hash.long_id() < path_trie().long_hash_count() :
+    hash.length() <= HASH_SIZE;
+  if (!is_valid) {
+    is_ok = false;
+    hash = NULL_HASH;
+  }
+}
+
+
+/*******************************************************************************
+ * Sharding
+ ******************************************************************************/
+
+/*!
+  Events are split by their top level folder so every event of a top level folder ends
+  up in the same shard. Moves between two top level folders can't be detected and show
+  up as a delete followed by a create (or a copy). On the other hand, the events of the
+  other top level folders no longer come between the events of a folder so a DEL and an
+  ADD that were separated by them can still be paired (much like with -i). The result
+  is then not the same as in the single threaded case when the folders interleave.
+*/
+t_shard& pick_shard (t_shard_list& shards, t_path path) {
+  t_path top = path_trie().ancestor(path, path_trie().depth(ROOT_PATH) + 1);
+  return *shards[(top * 2654435761U) % shards.size()];
+}
+
+
+/*!
+  Reads every event and hands it over to its shard. Copy detection has to look at
+  every file so it's resolved here, in input order, using a single index. This keeps
+  the result deterministic and leaves the shards with nothing to share.
+*/
+bool read_sharded_events (t_shard_list& shards, const char* file_name, 
+			  t_reorder_buffer& reorder) 
+{
+  t_event_reader reader;
+  if (!reader.open(file_name))
+    return false;
+
+  long nb_events;
+  if (!read_event_count(reader, nb_events))
+    return false;
+
+  t_hash_index hash_index;
+
+  t_event_parser parser;
+  t_raw_event raw;
+  for (long i = 0; i <= nb_events; ++i) {
+    bool is_draining = i == nb_events || !read_event(reader, parser, raw);
+    if (!is_draining) {
+      t_algo_state& state = pick_shard(shards, raw.path).state;
+      reorder.push(make_input_event(state, raw));
+      STATS_INC(state, e_events_read);
+    }
+
+    while (p_event ev = reorder.pop(is_draining)) {
+      if (t_rule_list::uses_hash_index)
+	index_event(hash_index, ev);
+      pick_shard(shards, ev->path).input.push_back(ev);
+    }
+
+    if (is_draining)
+      break;
+  }
+
+  if (parser.get_skipped_count() > 0) {
+    std::cerr << parser.get_skipped_count() 
+	      << " lines with an unknown event were skipped." << std::endl;
+  }
+  return true;
+}
+
+
+void* run_shard (void* arg) {
+  t_shard* shard = static_cast<t_shard*>(arg);
+
+  for (std::size_t i = 0; i < shard->input.size(); ++i) {
+    add_to_state(shard->state, shard->input[i]);
+  }
+  shard->input.clear();
+
+  simplify_state(shard->state);
+  return NULL;
+}
+
+
+//! Simplifies every shard on its own thread. The path trie is read-only at this point.
+void simplify_shards (t_shard_list& shards) {
+  for (std::size_t i = 0; i < shards.size(); ++i) {
+    int err = pthread_create(&shards[i]->thread, NULL, run_shard, shards[i]);
+    if (err != 0) {
+      std::cerr << "Unable to create the shard threads!" << std::endl;
+      exit(1);
+    }
+  }
+
+  for (std::size_t i = 0; i < shards.size(); ++i) {
+    pthread_join(shards[i]->thread, NULL);
+  }
+}
+
+
+//! Orders the heads of the shards by timestamp (lowest on top) then by shard.
+struct t_shard_head_comp {
+  bool operator() (const std::pair<long, std::size_t>& lhs, 
+		   const std::pair<long, std::size_t>& rhs) const 
+  {
+    return lhs > rhs;
+  }
+};
+
+
+//! Merges the events of every shard back in timestamp order.
+void print_shards (t_shard_list& shards) {
+  typedef std::pair<long, std::size_t> t_head;
+  std::priority_queue<t_head, std::vector<t_head>, t_shard_head_comp> heads;
+
+  std::vector<std::size_t> positions (shards.size(), 0);
+
+  for (std::size_t i = 0; i < shards.size(); ++i) {
+    const t_event_list& events = shards[i]->state.events;
+    if (!events.empty())
+      heads.push(std::make_pair(events.front()->timestamp, i));
+  }
+
+  while (!heads.empty()) {
+    std::size_t shard = heads.top().second;
+    heads.pop();
+
+    const t_event_list& events = shards[shard]->state.events;
+    compactor.write(*events[positions[shard]]);
+
+    if (++positions[shard] < events.size())
+      heads.push(std::make_pair(events[positions[shard]]->timestamp, shard));
+  }
+
+  compactor.flush();
+  event_writer.flush();
+
+  for (std::size_t i = 0; i < shards.size(); ++i) {
+    STATS_ADD(shards[i]->state, e_events_written, shards[i]->state.events.size());
+  }
+}
+
+
+/*******************************************************************************
+ * Stats
+ ******************************************************************************/
+
+#ifdef FILEVENTS_STATS
+
+static const char* COUNTER_NAMES[e_counter_count] = {
+  "events_read",
+  "events_written",
+  "file_moves",
+  "file_modifies",
+  "file_copies",
+  "interleaved_moves",
+  "folder_deletes",
+  "folder_moves",
+  "interleaved_folder_moves",
+  "folder_copies",
+  "subtree_compares",
+  "subtree_entries",
+  "max_events"
+};
+
+static const char* STAGE_NAMES[e_stage_count] = {
+  "read",
+  "add",
+  "flush",
+  "simplify",
+  "print"
+};
+
+
+void t_stats::merge (const t_stats& other) {
+  for (std::size_t i = 0; i < e_counter_count; ++i) {
+    if (i == e_max_events)
+      counters[i] = std::max(counters[i], other.counters[i]);
+    else
+      counters[i] += other.counters[i];
+  }
+
+  for (std::size_t i = 0; i < e_stage_count; ++i) {
+    for (std::size_t j = 0; j < LATENCY_BUCKETS; ++j) {
+      latencies[i][j] += other.latencies[i][j];
+    }
+  }
+}
+
+
+void request_stats (int) {
+  is_stats_requested = 1;
+}
+
+
+/*!
+  Merges the stats of the given states and writes them as a single JSON object to
+  stats_file_name (or std err). The latencies of each stage are listed as 
+  [upper bound in ns, count] pairs, skipping the empty buckets.
+*/
+void dump_stats (const std::vector<const t_algo_state*>& states) {
+  t_stats stats;
+  unsigned long hash_index_size = 0;
+  unsigned long tree_index_size = 0;
+  unsigned long event_count = 0;
+
+  for (std::size_t i = 0; i < states.size(); ++i) {
+    stats.merge(states[i]->stats);
+    hash_index_size += states[i]->hash_index.size();
+    tree_index_size += states[i]->tree_index.size();
+    event_count += states[i]->events.size();
+  }
+
+  FILE* out = stats_file_name ? fopen(stats_file_name, "w") : stderr;
+  if (!out) {
+    std::cerr << "Unable to write the stats to " << stats_file_name << std::endl;
+    return;
+  }
+
+  fprintf(out, "{\n  \"counters\": {");
+  for (std::size_t i = 0; i < e_counter_count; ++i) {
+    fprintf(out, "%s\n    \"%s\": %lu", i ? "," : "", COUNTER_NAMES[i],
+	    static_cast<unsigned long>(stats.counters[i]));
+  }
+
+  fprintf(out, "\n  },\n  \"sizes\": {\n    \"paths\": %lu,\n    \"hash_index\": %lu,"
+	  "\n    \"tree_index\": %lu,\n    \"events\": %lu\n  },\n  \"latency_ns\": {",
+	  static_cast<unsigned long>(path_trie().size()), hash_index_size, tree_index_size,
+	  event_count);
+
+  for (std::size_t i = 0; i < e_stage_count; ++i) {
+    fprintf(out, "%s\n    \"%s\": [", i ? "," : "", STAGE_NAMES[i]);
+
+    bool is_first = true;
+    for (std::size_t j = 0; j < LATENCY_BUCKETS; ++j) {
+      if (!stats.latencies[i][j])
+	continue;
+      fprintf(out, "%s[%lu, %lu]", is_first ? "" : ", ", 2UL << j,
+	      static_cast<unsigned long>(stats.latencies[i][j]));
+      is_first = false;
+    }
+    fprintf(out, "]");
+  }
+  fprintf(out, "\n  }\n}\n");
+
+  if (out != stderr)
+    fclose(out);
+}
+
+#endif
+
+
+/*******************************************************************************
+ * Tests
+ ******************************************************************************/
+
+//! Sink of pop_done_events() that only counts the events.
+void count_event (const t_event& ev, void* data) {
+  ++*static_cast<long*>(data);
+}
+
+
+void run_tests() {
+
+  // File tests.
+
+  {
+    std::cout << std::endl << " === TEST FILE ===" << std::endl;
+
+    t_algo_state s;
+    long ts = 0;
+
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/a")));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/a/b.t"), "1111"));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/a/c.t"), "2222"));
+    
+    // Rename
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/a/c.t"), "2222"));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/a/d.t"), "2222"));
+    
+    // Modify
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/a/b.t"), "1111"));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/a/b.t"), "1112"));
+
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/a/e")));
+
+    // Copy of /a/b.t
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/a/e/f.t"), "1112"));    
+
+    // Move and Rename
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/a/b.t"), "1112"));    
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/a/e/g.t"), "1112"));    
+
+
+    simplify_state(s);
+    std::cout << std::endl;
+    print_state(s);
+  }
+
+  // Hashes too long for a t_hash are kept whole and still pair a rename.
+
+  {
+    std::cout << std::endl << " === TEST LONG HASH ===" << std::endl;
+
+    const std::string base64 = "n4bQgYhMfWWaL+qgxVrQFaO/TxsrC4Is0V1sFbDwCgg=";
+    const std::string hex = std::string(127, 'a') + "b";
+
+    assert(base64.size() == 44 && hex.size() == 128);
+    assert(t_hash(base64) != t_hash(base64.substr(0, 43) + "-"));
+    assert(t_hash(hex) != t_hash(std::string(128, 'a')));
+    assert(hash_to_string(t_hash(base64)) == base64);
+    assert(hash_to_string(t_hash(hex)) == hex);
+
+    t_algo_state s;
+    long ts = 0;
+
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/l/a.t"), base64));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/l/b.t"), hex));
+
+    // Rename
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/l/a.t"), base64));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/l/c.t"), base64));
+
+    simplify_state(s);
+    std::cout << std::endl;
+    print_state(s);
+  }
+
+  // Folder tests
+
+  {
+    std::cout << std::endl << std::endl << " === TEST FOLDER ===" << std::endl;
+
+    t_algo_state s;
+    long ts = 0;
+
+    // Delete folder tree.
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/a/b/c.t"), "1111"));
+    add_to_state(s, make_delete_event(s, e_folder, ++ts, make_path("/a/b")));
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/a/d.t"), "2222"));
+    add_to_state(s, make_delete_event(s, e_folder, ++ts, make_path("/a")));
+
+    // Move & rename folder /f to /g/h.
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/f/b/c.t"), "3333"));
+    add_to_state(s, make_delete_event(s, e_folder, ++ts, make_path("/f/b")));
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/f/d.t"), "4444"));
+    add_to_state(s, make_delete_event(s, e_folder, ++ts, make_path("/f")));
+
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/g/h")));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/g/h/d.t"), "4444"));
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/g/h/b")));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/g/h/b/c.t"), "3333"));
+
+    // Copy folder /g/h to /i.
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/i")));
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/i/b")));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/i/b/c.t"), "3333"));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/i/d.t"), "4444"));
+
+    // Not a copy since /i/d.t was modified.
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/j")));
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/j/b")));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/j/b/c.t"), "3333"));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/j/d.t"), "5555"));
+
+    simplify_state(s);
+    std::cout << std::endl;
+    print_state(s);
+  }
+
+
+  // Deep folder trees.
+  {
+    std::cout << std::endl << std::endl << " === TEST DEEP FOLDER ===" << std::endl;
+
+    t_algo_state s;
+    long ts = 0;
+    const int depth = 32;
+
+    // Delete /k and everything below it, deepest first.
+    for (int i = depth; i >= 0; --i) {
+      std::string path = "/k";
+      for (int j = 0; j < i; ++j) path += "/l";
+      add_to_state(s, make_delete_event(s, e_file, ++ts, make_path(path + "/m.t"), "6666"));
+      add_to_state(s, make_delete_event(s, e_folder, ++ts, make_path(path)));
+    }
+
+    // Add it back as /n which is a single move since the DEL events were collapsed.
+    std::string path = "/n";
+    for (int i = 0; i <= depth; ++i) {
+      add_to_state(s, make_new_event(s, e_folder, ++ts, make_path(path)));
+      add_to_state(s, make_new_event(s, e_file, ++ts, make_path(path + "/m.t"), "6666"));
+      path += "/l";
+    }
+
+    simplify_state(s);
+    std::cout << std::endl;
+    print_state(s);
+  }
+
+
+  // Provided examples.
+  {
+    std::cout << std::endl << " === TEST DROPBOX ===" << std::endl;
+
+    t_algo_state s;
+    long ts = 0;
+
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/test")));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/test/1.txt"), "f2fa762f"));
+
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/test/1.txt"), "f2fa762f"));
+    add_to_state(s, make_delete_event(s, e_folder, ++ts, make_path("/test")));
+
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/test2")));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/test2/1.txt"), "f2fa762f"));
+
+    simplify_state(s);
+    std::cout << std::endl;
+    print_state(s);    
+  }
+
+
+  // Reads the provided example from a file.
+  {
+    std::cout << std::endl << " === TEST READER ===" << std::endl << std::endl;
+
+    char file_name[] = "/tmp/filevents_XXXXXX";
+    int fd = mkstemp(file_name);
+    assert(fd >= 0);
+
+    const std::string input = 
+      "6\n"
+      "ADD 1 /test -\n"
+      "ADD 2 /test/1.txt f2fa762f\n"
+      "\n"
+      "DEL 3 /test/1.txt f2fa762f\n"
+      "DEL 4 /test -\n"
+      "ADD 5 /test2 -\n"
+      "ADD 6 /test2/1.txt f2fa762f";
+    write(fd, input.data(), input.size());
+    close(fd);
+
+    t_algo_state s;
+    t_reorder_buffer reorder (0, 0);
+    bool is_read = read_events(s, file_name, false, reorder);
+    unlink(file_name);
+    assert(is_read);
+
+    simplify_state(s);
+    print_state(s);
+  }
+
+
+  // The state is saved half way through a move and restored once the log grew.
+  {
+    std::cout << std::endl << " === TEST CHECKPOINT ===" << std::endl << std::endl;
+
+    char file_name[] = "/tmp/filevents_XXXXXX";
+    int fd = mkstemp(file_name);
+    assert(fd >= 0);
+
+    char checkpoint_name[] = "/tmp/filevents_XXXXXX";
+    int checkpoint_fd = mkstemp(checkpoint_name);
+    assert(checkpoint_fd >= 0);
+    close(checkpoint_fd);
+
+    const std::string head = 
+      "5\n"
+      "ADD 1 /ck/1.txt 1111\n"
+      "ADD 2 /ck/2.txt 2222\n"
+      "DEL 3 /ck/1.txt 1111\n";
+    const std::string tail = 
+      "ADD 4 /ck/3.txt 1111\n"
+      "ADD 5 /ck/4.txt 2222\n";
+    write(fd, head.data(), head.size());
+
+    t_checkpoint checkpoint;
+    checkpoint.save_file = checkpoint_name;
+    {
+      t_algo_state s;
+      t_reorder_buffer reorder (0, 0);
+      bool is_read = read_events(s, file_name, true, reorder, &checkpoint);
+      assert(is_read);
+    }
+
+    write(fd, tail.data(), tail.size());
+    close(fd);
+
+    checkpoint.restore_file = checkpoint_name;
+    checkpoint.save_file = NULL;
+    {
+      t_algo_state s;
+      t_reorder_buffer reorder (0, 0);
+      bool is_read = read_events(s, file_name, true, reorder, &checkpoint);
+      assert(is_read);
+      assert(!t_rule_list::uses_hash_index || s.hash_index.size() == 3);
+
+      simplify_state(s);
+      print_state(s);
+    }
+
+    unlink(file_name);
+    unlink(checkpoint_name);
+  }
+
+
+  // Interleaved operations in two top level folders are simplified by their shard.
+  {
+    std::cout << std::endl << " === TEST SHARDS ===" << std::endl << std::endl;
+
+    char file_name[] = "/tmp/filevents_XXXXXX";
+    int fd = mkstemp(file_name);
+    assert(fd >= 0);
+
+    const std::string input = 
+      "8\n"
+      "ADD 1 /u1/a.t 1111\n"
+      "ADD 2 /u2/a.t 2222\n"
+      "DEL 3 /u1/a.t 1111\n"
+      "DEL 4 /u2/a.t 2222\n"
+      "ADD 5 /u1/b.t 1111\n"
+      "ADD 6 /u2/c.t 1111\n"
+      "ADD 7 /u2/a.t 3333\n"
+      "ADD 8 /u1/c.t 2222\n";
+    write(fd, input.data(), input.size());
+    close(fd);
+
+    t_shard_list shards;
+    for (int i = 0; i < 4; ++i) {
+      shards.push_back(new t_shard());
+    }
+    assert(&pick_shard(shards, make_path("/u1")) != &pick_shard(shards, make_path("/u2")));
+
+    t_reorder_buffer reorder (0, 0);
+    bool is_read = read_sharded_events(shards, file_name, reorder);
+    unlink(file_name);
+    assert(is_read);
+
+    simplify_shards(shards);
+
+    // The DEL and ADD events of /u1 are paired even though /u2 came between them.
+    const t_event_list& u1_events = pick_shard(shards, make_path("/u1")).state.events;
+    assert(u1_events.size() == 3 && u1_events[1]->event_type == e_move);
+
+    print_shards(shards);
+
+    for (int i = 0; i < 4; ++i) {
+      delete shards[i];
+    }
+  }
+
+
+  // Events that are slightly out of order are put back in order.
+  {
+    std::cout << std::endl << " === TEST REORDER ===" << std::endl << std::endl;
+
+    t_algo_state s;
+    t_reorder_buffer reorder (0, 2);
+
+    // Rename of /r/1.txt, move of /r/2.txt and a modify of /r/3.txt whose DEL event
+    //   arrives too late to be merged.
+    std::vector<p_event> input;
+    input.push_back(make_new_event(s, e_folder, 1, make_path("/r")));
+    input.push_back(make_new_event(s, e_file, 3, make_path("/r/1.txt"), "1111"));
+    input.push_back(make_new_event(s, e_file, 2, make_path("/r/3.txt"), "3333"));
+    input.push_back(make_new_event(s, e_file, 4, make_path("/r/2.txt"), "2222"));
+    input.push_back(make_new_event(s, e_file, 6, make_path("/r/4.txt"), "1111"));
+    input.push_back(make_delete_event(s, e_file, 5, make_path("/r/1.txt"), "1111"));
+    input.push_back(make_new_event(s, e_file, 8, make_path("/2.txt"), "2222"));
+    input.push_back(make_delete_event(s, e_file, 7, make_path("/r/2.txt"), "2222"));
+    input.push_back(make_delete_event(s, e_file, 4, make_path("/r/3.txt"), "3333"));
+    input.push_back(make_new_event(s, e_file, 9, make_path("/r/3.txt"), "3334"));
+
+    for (std::size_t i = 0; i <= input.size(); ++i) {
+      bool is_draining = i == input.size();
+      if (!is_draining) 
+	reorder.push(input[i]);
+
+      while (p_event ev = reorder.pop(is_draining)) {
+	add_to_state(s, ev);
+      }
+    }
+    assert(reorder.get_late_count() == 1);
+
+    simplify_state(s);
+    print_state(s);
+  }
+
+
+  // Interleaved operations of two users.
+  {
+    std::cout << std::endl << " === TEST INTERLEAVED ===" << std::endl << std::endl;
+
+    t_algo_state s;
+    s.match_window = 10;
+    long ts = 0;
+
+    // Rename of /u/1.txt and move of folder /v to /w/v, interleaved.
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/u/1.txt"), "1111"));
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/v/2.txt"), "2222"));
+    add_to_state(s, make_delete_event(s, e_folder, ++ts, make_path("/v")));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/u/3.txt"), "1111"));
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/w/v")));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/w/v/2.txt"), "2222"));
+
+    // Too far apart to be a move.
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/u/4.txt"), "4444"));
+    ts += 20;
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/w/6.txt"), "6666"));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/u/5.txt"), "4444"));
+
+    // Delete of /a/x followed by the rename of /a to /d. The DEL of /a/x came before
+    //   another operation so it isn't part of the folder.
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/a")));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/a/x"), "7777"));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/a/y"), "8888"));
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/a/x"), "7777"));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/c"), "9999"));
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/a/y"), "8888"));
+    add_to_state(s, make_delete_event(s, e_folder, ++ts, make_path("/a")));
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/d")));
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/d/y"), "8888"));
+
+    simplify_state(s);
+    print_state(s);
+  }
+
+
+  // Streaming: events are printed as soon as they are final.
+  {
+    std::cout << std::endl << " === TEST STREAM ===" << std::endl << std::endl;
+
+    t_algo_state s;
+    long ts = 0;
+
+    // Delete folder tree. Nothing can be printed until /a is gone.
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/a/b/c.t"), "1111"));
+    flush_state(s);
+    add_to_state(s, make_delete_event(s, e_folder, ++ts, make_path("/a/b")));
+    flush_state(s);
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/a/d.t"), "2222"));
+    flush_state(s);
+    add_to_state(s, make_delete_event(s, e_folder, ++ts, make_path("/a")));
+    flush_state(s);
+    assert(s.events.size() == 1);
+
+    // Move folder /f to /g.
+    add_to_state(s, make_delete_event(s, e_file, ++ts, make_path("/f/d.t"), "4444"));
+    flush_state(s);
+    add_to_state(s, make_delete_event(s, e_folder, ++ts, make_path("/f")));
+    flush_state(s);
+    add_to_state(s, make_new_event(s, e_folder, ++ts, make_path("/g")));
+    flush_state(s);
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/g/d.t"), "4444"));
+    flush_state(s);
+    assert(!(t_has_rule<t_rule_list, t_folder_delete_rule>::value &&
+	     t_has_rule<t_rule_list, t_folder_move_rule>::value) || 
+	   s.events.size() == 3);
+
+    // Lots of renames should only ever keep the last event around.
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/h/0.t"), "5555"));
+    flush_state(s);
+    for (int i = 1; i < 100; ++i) {
+      std::stringstream old_name, new_name;
+      old_name << "/h/" << (i-1) << ".t";
+      new_name << "/h/" << i << ".t";
+
+      add_to_state(s, make_delete_event(s, e_file, ++ts, make_path(old_name.str()), "5555"));
+      flush_state(s);
+      add_to_state(s, make_new_event(s, e_file, ++ts, make_path(new_name.str()), "5555"));
+      flush_state(s);
+      assert(s.events.size() <= 2);
+    }
+
+    simplify_state(s);
+    print_state(s);
+  }
+
+
+  // A long stream of distinct paths only keeps the paths still in use in the trie.
+  {
+    std::cout << std::endl << " === TEST PATH COLLECTION ===" << std::endl << std::endl;
+
+    t_algo_state s;
+    t_reorder_buffer reorder (0, 0);
+    t_event_parser parser;
+    long nb_done = 0;
+    t_compactor c (count_event, &nb_done);
+    long ts = 0;
+
+    // Lots of renames into new folders.
+    add_to_state(s, make_new_event(s, e_file, ++ts, make_path("/gc/0/0.t"), "6666"));
+    for (int i = 1; i < 4 * int(TRIE_COLLECT_SIZE); ++i) {
+      std::stringstream old_name, new_name;
+      old_name << "/gc/" << (i-1) << "/" << (i-1) << ".t";
+      new_name << "/gc/" << i << "/" << i << ".t";
+
+      add_to_state(s, make_delete_event(s, e_file, ++ts, make_path(old_name.str()), "6666"));
+      add_to_state(s, make_new_event(s, e_file, ++ts, make_path(new_name.str()), "6666"));
+      pop_done_events(s, count_event, &nb_done);
+      collect_paths(s, reorder, c, parser);
+    }
+    assert(path_trie().size() <= 2 * TRIE_COLLECT_SIZE);
+
+    // The paths that are still used must survive the collections.
+    simplify_state(s);
+    print_state(s);
+    std::cout << nb_done << " events done" << std::endl;
+  }
+
+
+  // Blocks of lines are split like single lines were.
+  {
+    std::cout << std::endl << " === TEST PARSER ===" << std::endl << std::endl;
+
+    const std::string input =
+      "ADD 1 /p -\n"
+      "\n"
+      "ADD\t2  //p//q.txt  1111\r\n"
+      "MOV 2 /a.t 11\n"
+      "DEL 3 /p/q.txt 1111\n"
+      "ADD 4 p/r\xe9\xa0.txt 1111\n"
+      "ADD 5 /p/r/s/t/u/v/w/x/y/z/0123456789abcdef.txt 2222";
+
+    const char* paths[] = {
+      "/p", "/p/q.txt", "/p/q.txt", "p/r\xe9\xa0.txt", "/p/r/s/t/u/v/w/x/y/z/0123456789abcdef.txt"
+    };
+
+    t_event_parser parser;
+    parser.parse(input.data(), input.data() + input.size());
+
+    t_raw_event raw;
+    for (std::size_t i = 0; i < 5; ++i) {
+      bool is_parsed = parser.next(raw);
+      assert(is_parsed && raw.path == make_path(paths[i]));
+
+      std::cout << (raw.event_type == e_new ? "ADD " : "DEL ") << raw.timestamp << " "
+		<< path_to_string(raw.path) << " " << raw.hash.str() << std::endl;
+    }
+    assert(!parser.next(raw) && parser.remaining() == 0);
+    assert(parser.get_skipped_count() == 1);
+  }
+
+
+  // Net effect of the events of a window.
+  {
+    std::cout << std::endl << " === TEST COMPACT ===" << std::endl << std::endl;
+
+    t_algo_state s;
+    t_compactor c (write_event, NULL);
+    c.set_window(100);
+    long ts = 0;
+
+    // Moved twice and modified: a single move and a single modify.
+    c.write(*make_move_event(s, e_file, ++ts, make_path("/a.t"), make_path("/b.t")));
+    c.write(*make_modify_event(s, e_file, ++ts, make_path("/b.t"), "1111", "1112"));
+    c.write(*make_move_event(s, e_file, ++ts, make_path("/b.t"), make_path("/c.t")));
+
+    // Created, modified and deleted: nothing.
+    c.write(*make_new_event(s, e_file, ++ts, make_path("/d.t"), "2222"));
+    c.write(*make_modify_event(s, e_file, ++ts, make_path("/d.t"), "2222", "2223"));
+    c.write(*make_delete_event(s, e_file, ++ts, make_path("/d.t"), "2223"));
+
+    // Swap through a temporary path: /e.t has to move before /f.t takes its place.
+    c.write(*make_move_event(s, e_file, ++ts, make_path("/e.t"), make_path("/tmp.t")));
+    c.write(*make_move_event(s, e_file, ++ts, make_path("/f.t"), make_path("/e.t")));
+    c.write(*make_move_event(s, e_file, ++ts, make_path("/tmp.t"), make_path("/f.t")));
+
+    // The folder move closes the chain of /g/h.t before it's sent.
+    c.write(*make_modify_event(s, e_file, ++ts, make_path("/g/h.t"), "3333", "3334"));
+    c.write(*make_move_event(s, e_folder, ++ts, make_path("/g"), make_path("/i")));
+    c.write(*make_modify_event(s, e_file, ++ts, make_path("/i/h.t"), "3334", "3335"));
+
+    // Deleted and created again in the next window: both are kept.
+    c.write(*make_delete_event(s, e_file, ++ts, make_path("/j.t"), "4444"));
+    ts = 100;
+    c.write(*make_new_event(s, e_file, ++ts, make_path("/j.t"), "4444"));
+
+    c.flush();
+    event_writer.flush();
+  }
+
+
+  // Library interface.
+  {
+    std::cout << std::endl << " === TEST LIBRARY ===" << std::endl << std::endl;
+
+    static const char* type_names[] = {"ADD", "DEL", "MOD", "MOV", "COP"};
+
+    t_filevents simplifier;
+
+    // Move of folder /x to /y pushed as a batch.
+    t_filevent_input batch[] = {
+      t_filevent_input(e_filevent_delete, 1, "/x/1.txt", "1111"),
+      t_filevent_input(e_filevent_delete, 2, "/x", NULL),
+      t_filevent_input(e_filevent_add, 3, "/y", "-"),
+      t_filevent_input(e_filevent_add, 4, "/y/1.txt", "1111")
+    };
+    simplifier.push(batch, 4);
+
+    // Modify of /y/1.txt which closes the folder move.
+    simplifier.push(t_filevent_input(e_filevent_delete, 5, "/y/1.txt", "1111"));
+    simplifier.push(t_filevent_input(e_filevent_add, 6, "/y/1.txt", "1112"));
+    const bool has_folder_move = 
+      t_has_rule<t_rule_list, t_folder_delete_rule>::value &&
+      t_has_rule<t_rule_list, t_folder_move_rule>::value &&
+      t_has_rule<t_rule_list, t_modify_rule>::value;
+    assert(!has_folder_move || (simplifier.ready() == 1 && simplifier.pending() == 1));
+
+    // Copy of folder /y pushed as log lines.
+    const std::string log = "ADD 7 /z -\nADD 8 /z/1.txt 1112\n";
+    simplifier.push_log(log.data(), log.data() + log.size());
+
+    simplifier.finish();
+    assert(simplifier.pending() == 0);
+    assert(!(has_folder_move && t_has_rule<t_rule_list, t_folder_copy_rule>::value) || 
+	   simplifier.ready() == 3);
+
+    t_filevent ev;
+    while (simplifier.pop(ev)) {
+      std::cout << type_names[ev.type] << " " << ev.timestamp << " " 
+		<< (ev.is_folder ? "folder " : "file ") << ev.src_path << " " << ev.path 
+		<< " " << ev.old_hash << " " << ev.hash << std::endl;
+    }
+  }
+
+}
+
+
+/*******************************************************************************
+ * Benchmark
+ ******************************************************************************/
+
+#ifdef FILEVENTS_BENCHMARK
+
+// Number of calls to operator new since the start.
+static unsigned long alloc_count = 0;
+
+#if __cplusplus < 201103L
+#define BENCH_THROW throw (std::bad_alloc)
+#define BENCH_NOTHROW throw ()
+#else
+#define BENCH_THROW
+#define BENCH_NOTHROW noexcept
+#endif
+
+void* operator new (std::size_t size) BENCH_THROW {
+  ++alloc_count;
+  void* ptr = std::malloc(size ? size : 1);
+  if (ptr == NULL)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new[] (std::size_t size) BENCH_THROW {
+  return operator new(size);
+}
+
+void operator delete (void* ptr) BENCH_NOTHROW {
+  std::free(ptr);
+}
+
+void operator delete[] (void* ptr) BENCH_NOTHROW {
+  std::free(ptr);
+}
+
+
+t_workload::t_workload (const t_workload_config& config) :
+  config(config), random_state(config.seed), name_count(0), tree(), users(config.users)
+{
+  for (std::size_t i = 0; i < users.size(); ++i) {
+    std::stringstream ss;
+    ss << "/user" << i;
+    users[i].root = ss.str();
+    add(users[i], users[i].root, NULL_HASH_TEXT);
+  }
+}
+
+
+/*!
+  Writes the count of events followed by the events. The next event is taken from a
+  random user which starts a new operation whenever its last one is done.
+*/
+void t_workload::generate (std::string& out) {
+  std::stringstream ss;
+  ss << config.nb_events << "\n";
+  out = ss.str();
+
+  for (long ts = 1; ts <= config.nb_events; ++ts) {
+    t_user& user = users[random_below(users.size())];
+    while (user.lines.empty())
+      start_operation(user);
+
+    const std::string& line = user.lines.front();
+    char timestamp[24];
+    snprintf(timestamp, sizeof(timestamp), " %ld", ts);
+
+    out.append(line, 0, 3);
+    out.append(timestamp);
+    out.append(line, 3, std::string::npos);
+    out.append("\n");
+    user.lines.pop_front();
+  }
+}
+
+
+//! splitmix64.
+uint64_t t_workload::next_random () {
+  random_state += 0x9e3779b97f4a7c15ULL;
+  return mix_digest(random_state);
+}
+
+
+std::string t_workload::new_hash () {
+  char hash[16];
+  snprintf(hash, sizeof(hash), "%08lx", static_cast<unsigned long>(next_random() & 0xFFFFFFFF));
+  return hash;
+}
+
+
+std::string t_workload::new_name (const std::string& parent, bool is_folder) {
+  std::stringstream ss;
+  ss << parent << SEP << (is_folder ? "d" : "f") << name_count++ << (is_folder ? "" : ".txt");
+  return ss.str();
+}
+
+
+void t_workload::start_operation (t_user& user) {
+  unsigned odds = random_below(100);
+
+  // Create a file or a folder.
+  if (odds < 30) {
+    add(user, new_name(pick_parent(user), false), new_hash());
+    return;
+  }
+  if (odds < 38) {
+    add(user, new_name(pick_parent(user), true), NULL_HASH_TEXT);
+    return;
+  }
+
+  // Delete, modify, rename, move or copy a file.
+  if (odds < 88) {
+    std::string path;
+    if (!pick(user.files, path)) {
+      add(user, new_name(pick_parent(user), false), new_hash());
+      return;
+    }
+
+    std::string hash = tree[path].hash;
+    std::string parent = path.substr(0, path.rfind(SEP));
+
+    if (odds < 48) {
+      remove(user, path);
+    }
+    else if (odds < 60) {
+      tree[path].hash = new_hash();
+      user.lines.push_back("DEL " + path + " " + hash);
+      user.lines.push_back("ADD " + path + " " + tree[path].hash);
+    }
+    else if (odds < 70) {
+      remove(user, path);
+      add(user, new_name(parent, false), hash);
+    }
+    else if (odds < 80) {
+      remove(user, path);
+      add(user, new_name(pick_parent(user), false), hash);
+    }
+    else {
+      add(user, new_name(pick_parent(user), false), hash);
+    }
+    return;
+  }
+
+  // Move, rename, copy or delete a folder other than the root of the user.
+  std::string folder;
+  for (int attempt = 0; attempt < 4 && (folder.empty() || folder == user.root); ++attempt) {
+    pick(user.folders, folder);
+  }
+  if (folder.empty() || folder == user.root) {
+    add(user, new_name(pick_parent(user), false), new_hash());
+    return;
+  }
+
+  std::string parent = folder.substr(0, folder.rfind(SEP));
+  std::string new_parent = random_below(2) ? pick_parent(user) : parent;
+
+  // Can't go inside itself.
+  if (new_parent.compare(0, folder.size() + 1, folder + SEP) == 0 || new_parent == folder)
+    new_parent = parent;
+
+  t_tree snapshot;
+  snapshot_tree(folder, snapshot);
+
+  if (odds < 93) {
+    remove_tree(user, folder, snapshot);
+    add_tree(user, new_name(new_parent, true), snapshot);
+  }
+  else if (odds < 97) {
+    add_tree(user, new_name(new_parent, true), snapshot);
+  }
+  else {
+    remove_tree(user, folder, snapshot);
+  }
+}
+
+
+//! Picks a random path that's still there, dropping the stale ones along the way.
+bool t_workload::pick (std::vector<std::string>& paths, std::string& path) {
+  while (!paths.empty()) {
+    std::size_t i = random_below(paths.size());
+    if (tree.count(paths[i])) {
+      path = paths[i];
+      return true;
+    }
+
+    paths[i] = paths.back();
+    paths.pop_back();
+  }
+  return false;
+}
+
+
+//! A few random folders are tried before falling back on the root of the user.
+std::string t_workload::pick_parent (t_user& user) {
+  for (int attempt = 0; attempt < 8; ++attempt) {
+    std::string folder;
+    if (!pick(user.folders, folder))
+      break;
+
+    unsigned depth = std::count(folder.begin(), folder.end(), SEP[0]);
+    if (depth < config.depth && tree[folder].children < config.fan_out)
+      return folder;
+  }
+  return user.root;
+}
+
+
+void t_workload::add (t_user& user, const std::string& path, const std::string& hash) {
+  t_entry entry = {hash, 0};
+  tree[path] = entry;
+
+  t_tree_it parent = tree.find(path.substr(0, path.rfind(SEP)));
+  if (parent != tree.end())
+    parent->second.children++;
+
+  if (hash == NULL_HASH_TEXT)
+    user.folders.push_back(path);
+  else
+    user.files.push_back(path);
+
+  user.lines.push_back("ADD " + path + " " + hash);
+}
+
+
+void t_workload::remove (t_user& user, const std::string& path) {
+  t_tree_it it = tree.find(path);
+  user.lines.push_back("DEL " + path + " " + it->second.hash);
+  tree.erase(it);
+
+  t_tree_it parent = tree.find(path.substr(0, path.rfind(SEP)));
+  if (parent != tree.end())
+    parent->second.children--;
+}
+
+
+//! Copies the folder and everything in it, keyed by their path relative to the folder.
+void t_workload::snapshot_tree (const std::string& path, t_tree& snapshot) {
+  snapshot[""] = tree[path];
+
+  t_tree_it last = tree.lower_bound(path + "0");
+  for (t_tree_it it = tree.lower_bound(path + SEP); it != last; ++it) {
+    snapshot[it->first.substr(path.size())] = it->second;
+  }
+}
+
+
+//! Everything in the folder is deleted before the folder (the snapshot is in pre-order).
+void t_workload::remove_tree (t_user& user, const std::string& path, const t_tree& snapshot) {
+  for (t_tree::const_reverse_iterator it = snapshot.rbegin(); it != snapshot.rend(); ++it) {
+    remove(user, path + it->first);
+  }
+}
+
+
+void t_workload::add_tree (t_user& user, const std::string& path, const t_tree& snapshot) {
+  for (t_tree::const_iterator it = snapshot.begin(); it != snapshot.end(); ++it) {
+    add(user, path + it->first, it->second.hash);
+  }
+}
+
+
+double now_seconds () {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+
+//! Prints a line of the report for a stage that started at the given time.
+void report_stage (FILE* report, const char* name, long nb_events, 
+		   double start, unsigned long start_allocs) 
+{
+  double seconds = now_seconds() - start;
+  unsigned long allocs = alloc_count - start_allocs;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  // The rate of stages that take less than a millisecond is mostly noise.
+  char rate[32] = "-";
+  if (seconds >= 1e-3)
+    snprintf(rate, sizeof(rate), "%.0f", nb_events / seconds);
+
+  fprintf(report, "%-16s %10.3f %14s %14.3f %14.1f\n", name, seconds, rate,
+	  nb_events > 0 ? static_cast<double>(allocs) / nb_events : 0.0,
+	  usage.ru_maxrss / 1024.0);
+}
+
+
+/*!
+  Generates a workload (see t_workload) and runs each stage of the pipeline on it on
+  its own: read_events (reading and parsing only), add_to_state, simplify_state and
+  print_state. The whole streaming pipeline is then run on the same input. The events
+  are printed to /dev/null and the report to stdout. Note that the path trie is
+  already filled when the streaming pipeline runs.
+
+  The options are -n (events), -d (depth), -b (fan-out), -u (users) and -x (seed)
+  for the workload and -i as in filevents. The -g option prints the generated log
+  instead.
+*/
+int run_benchmark (int argc, char** argv) {
+  t_workload_config config;
+  long match_window = 0;
+  bool is_generating = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:d:b:u:x:i:g")) != -1) {
+    switch (opt) {
+    case 'n': config.nb_events = atol(optarg); break;
+    case 'd': config.depth = atoi(optarg); break;
+    case 'b': config.fan_out = atoi(optarg); break;
+    case 'u': config.users = atoi(optarg); break;
+    case 'x': config.seed = atol(optarg); break;
+    case 'i': match_window = atol(optarg); break;
+    case 'g': is_generating = true; break;
+    default:
+      std::cerr << "Usage: " << argv[0] << " [-n events] [-d depth] [-b fan-out]"
+		<< " [-u users] [-x seed] [-i timestamps] [-g]" << std::endl;
+      return 1;
+    }
+  }
+
+  if (config.nb_events < 0 || config.depth < 2 || config.fan_out < 1 || 
+      config.users < 1 || match_window < 0) 
+  {
+    std::cerr << "Invalid workload." << std::endl;
+    return 1;
+  }
+
+  double start = now_seconds();
+  std::string log;
+  {
+    t_workload workload (config);
+    workload.generate(log);
+  }
+  double generate_time = now_seconds() - start;
+
+  if (is_generating) {
+    fwrite(log.data(), 1, log.size(), stdout);
+    return 0;
+  }
+
+  char file_name[] = "/tmp/filevents_XXXXXX";
+  int fd = mkstemp(file_name);
+  if (fd < 0 || write(fd, log.data(), log.size()) != static_cast<ssize_t>(log.size())) {
+    std::cerr << "Unable to write the workload." << std::endl;
+    return 1;
+  }
+  close(fd);
+
+  fflush(stdout);
+  FILE* report = fdopen(dup(fileno(stdout)), "w");
+  if (report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    unlink(file_name);
+    return 1;
+  }
+
+  fprintf(report, "Generated %ld events (%.1f MB) with depth %u, fan-out %u and %u users "
+	  "in %.2fs.\n\n", config.nb_events, log.size() / 1e6, config.depth, config.fan_out, 
+	  config.users, generate_time);
+  fprintf(report, "%-16s %10s %14s %14s %14s\n", 
+	  "stage", "seconds", "events/s", "allocs/event", "peak RSS (MB)");
+
+  long nb_events = config.nb_events;
+  std::string().swap(log);
+
+  {
+    t_algo_state state;
+    state.match_window = match_window;
+    std::vector<p_event> input;
+
+    double stage_start = now_seconds();
+    unsigned long stage_allocs = alloc_count;
+    {
+      t_event_reader reader;
+      t_event_parser parser;
+      long nb_read = 0;
+      t_raw_event raw;
+      if (reader.open(file_name) && read_event_count(reader, nb_read)) {
+	while (static_cast<long>(input.size()) < nb_read && read_event(reader, parser, raw)) {
+	  input.push_back(make_input_event(state, raw));
+	}
+      }
+    }
+    report_stage(report, "read_events", nb_events, stage_start, stage_allocs);
+
+    stage_start = now_seconds();
+    stage_allocs = alloc_count;
+    for (std::size_t i = 0; i < input.size(); ++i) {
+      add_to_state(state, input[i]);
+    }
+    report_stage(report, "add_to_state", nb_events, stage_start, stage_allocs);
+
+    stage_start = now_seconds();
+    stage_allocs = alloc_count;
+    simplify_state(state);
+    report_stage(report, "simplify_state", nb_events, stage_start, stage_allocs);
+
+    std::size_t nb_output = state.events.size();
+    stage_start = now_seconds();
+    stage_allocs = alloc_count;
+    print_state(state);
+    report_stage(report, "print_state", nb_events, stage_start, stage_allocs);
+
+    fprintf(report, "\n%lu events were simplified to %lu events.\n\n", 
+	    static_cast<unsigned long>(input.size()), static_cast<unsigned long>(nb_output));
+  }
+
+  {
+    t_algo_state state;
+    state.match_window = match_window;
+    t_reorder_buffer reorder (0, 0);
+
+    double stage_start = now_seconds();
+    unsigned long stage_allocs = alloc_count;
+    read_events(state, file_name, true, reorder);
+    simplify_state(state);
+    print_state(state);
+    report_stage(report, "streaming (-s)", nb_events, stage_start, stage_allocs);
+  }
+
+  unlink(file_name);
+  fclose(report);
+  return 0;
+}
+
+#endif
+
+
+/*******************************************************************************
+ * Path manipulation utilities
+ ******************************************************************************/
+
+//! Converts the part of the path that is under the base folder to a string.
+std::string path_to_string (t_path base, t_path path) {
+  std::vector<t_path> nodes;
+  for (; path != base && path != NULL_PATH; path = path_trie().parent(path)) {
+    nodes.push_back(path);
+  }
+
+  std::string str;
+  for (std::vector<t_path>::reverse_iterator it = nodes.rbegin(); it != nodes.rend(); ++it) {
+    if (!str.empty() && str[str.size()-1] != SEP[0])
+      str += SEP;
+    str += path_trie().name(*it);
+  }
+  return str;
+}
+
+
+//! Converts a path to it's string representation.
+std::string path_to_string (t_path path) {
+  return path_to_string(NULL_PATH, path);
+}
+
+
+//! Converts a string into a path object.
+t_path make_path (const std::string& raw_path) {
+  const char* first = raw_path.data();
+  return make_path(first, first + raw_path.size());
+}
+
+
+//! Converts a range of characters into a path object. Empty components are ignored.
+t_path make_path (const char* first, const char* last) {
+  t_path path = NULL_PATH;
+
+  const char* base_it = first;
+  if (base_it != last && *base_it == SEP[0]) {
+    path = ROOT_PATH;
+    ++base_it;
+  }
+
+  while (base_it != last) {
+    const char* next_it = std::find(base_it, last, SEP[0]);
+
+    if (next_it != base_it)
+      path = path_trie().intern(path, base_it, next_it);
+
+    base_it = next_it == last ? last : next_it + 1;
+  }
+
+  return path;
+}
+
+
+//! Returns the tail of the path object.
+std::string get_name (t_path path) {
+  return path_trie().name(path);
+}
+
+
+//! Returns everything but the tail of the path.
+t_path get_parent (t_path path) {
+  assert (path != NULL_PATH);
+  return path_trie().parent(path);
+}
+
+
+//! Returns true if path is located somewhere under the prefix folder.
+bool is_sub_path (t_path prefix, t_path path) {
+  unsigned prefix_depth = path_trie().depth(prefix);
+  if (path_trie().depth(path) <= prefix_depth)
+    return false;
+  return path_trie().ancestor(path, prefix_depth) == prefix;
+}
+
+
+/*******************************************************************************
+ * Path trie
+ ******************************************************************************/
+
+t_path_trie::t_path_trie () : 
+  nodes(), names(), children(1 << 10, NULL_PATH), free_nodes(), collect_size(TRIE_COLLECT_SIZE)
+{
+  names.push_back(SEP[0]);
+
+  t_node null_node = {NULL_PATH, 0, 0, 0, 0, 1};
+  nodes.push_back(null_node);
+
+  t_node root_node = {NULL_PATH, 1, 0, 1, make_digest(&names[0], &names[0] + 1), 1};
+  nodes.push_back(root_node);
+}
+
+
+//! Returns the child of parent with the given name, creating it if necessary.
+t_path t_path_trie::intern (t_path parent, const char* first, const char* last) {
+  std::size_t size = last - first;
+
+  std::size_t mask = children.size() - 1;
+  std::size_t slot = hash(parent, first, last) & mask;
+
+  for (; children[slot] != NULL_PATH; slot = (slot + 1) & mask) {
+    const t_node& node = nodes[children[slot]];
+    if (node.parent != parent || node.name_size != size)
+      continue;
+    if (std::equal(first, last, &names[node.name_offset]))
+      return children[slot];
+  }
+
+  // Keep the table at most half full.
+  if ((live() + 1) * 2 > children.size()) {
+    rehash(children.size() * 2);
+    mask = children.size() - 1;
+    slot = hash(parent, first, last) & mask;
+    while (children[slot] != NULL_PATH) slot = (slot + 1) & mask;
+  }
+
+  t_node node;
+  node.parent = parent;
+  node.depth = nodes[parent].depth + 1;
+  node.name_offset = names.size();
+  node.name_size = size;
+  names.insert(names.end(), first, last);
+
+  // Must be odd so that it can be inverted (see relative_digest()).
+  node.name_digest = make_digest(first, last);
+  node.scale = nodes[parent].scale * (mix_digest(node.name_digest) | 1);
+
+  t_path path = nodes.size();
+  if (!free_nodes.empty()) {
+    path = free_nodes.back();
+    free_nodes.pop_back();
+    nodes[path] = node;
+  }
+  else {
+    nodes.push_back(node);
+  }
+
+  children[slot] = path;
+  return path;
+}
+
+
+bool t_path_trie::is_same_name (t_path lhs, t_path rhs) const {
+  if (nodes[lhs].name_size != nodes[rhs].name_size)
+    return false;
+  const char* lhs_name = name_data(lhs);
+  return std::equal(lhs_name, lhs_name + nodes[lhs].name_size, name_data(rhs));
+}
+
+
+//! Walks up the path until we reach the given depth.
+t_path t_path_trie::ancestor (t_path path, unsigned depth) const {
+  while (nodes[path].depth > depth) {
+    path = nodes[path].parent;
+  }
+  return path;
+}
+
+
+//! FNV-1a of the name mixed with the parent id.
+std::size_t t_path_trie::hash (t_path parent, const char* first, const char* last) const {
+  std::size_t h = 2166136261U ^ parent;
+  for (; first != last; ++first) {
+    h = (h ^ static_cast<unsigned char>(*first)) * 16777619U;
+  }
+  return h ^ (h >> 15);
+}
+
+
+//! Marks the path and its parents as being used (see collect()).
+void t_path_trie::mark (t_path path, std::vector<char>& marks) const {
+  for (; path != NULL_PATH && !marks[path]; path = nodes[path].parent) {
+    marks[path] = true;
+  }
+}
+
+
+/*!
+  Frees every node that isn't marked. Marks are indexed by path and the nodes made 
+  after the marks were sized are kept. The names of the nodes left are packed again
+  and the next collection waits until the trie doubled.
+*/
+void t_path_trie::collect (const std::vector<char>& marks) {
+  for (t_path path = ROOT_PATH + 1; path < marks.size() && path < nodes.size(); ++path) {
+    if (!marks[path])
+      nodes[path].depth = 0;
+  }
+
+  while (nodes.size() > ROOT_PATH + 1 && nodes.back().depth == 0) {
+    nodes.pop_back();
+  }
+
+  free_nodes.clear();
+  for (t_path path = nodes.size() - 1; path > ROOT_PATH; --path) {
+    if (nodes[path].depth == 0)
+      free_nodes.push_back(path);
+  }
+
+  std::vector<char> new_names (names.begin(), names.begin() + nodes[ROOT_PATH].name_size);
+  for (t_path path = ROOT_PATH + 1; path < nodes.size(); ++path) {
+    t_node& node = nodes[path];
+    if (node.depth == 0)
+      continue;
+
+    std::size_t offset = new_names.size();
+    new_names.insert(new_names.end(), 
+		     names.begin() + node.name_offset, 
+		     names.begin() + node.name_offset + node.name_size);
+    node.name_offset = offset;
+  }
+  names.swap(new_names);
+
+  std::size_t table_size = 1 << 10;
+  while ((live() + 1) * 2 > table_size) table_size *= 2;
+  rehash(table_size);
+
+  collect_size = std::max(TRIE_COLLECT_SIZE, live() * 2);
+}
+
+
+//! Resizes the children table and reinserts every node in it.
+void t_path_trie::rehash (std::size_t table_size) {
+  std::vector<t_path> new_children (table_size, NULL_PATH);
+  std::size_t mask = new_children.size() - 1;
+
+  for (t_path path = ROOT_PATH + 1; path < nodes.size(); ++path) {
+    if (nodes[path].depth == 0)
+      continue;
+
+    const char* name = name_data(path);
+    std::size_t slot = hash(nodes[path].parent, name, name + nodes[path].name_size) & mask;
+
+    while (new_children[slot] != NULL_PATH) slot = (slot + 1) & mask;
+    new_children[slot] = path;
+  }
+
+  children.swap(new_children);
+}
+
+
+//! Returns the id of the hash, interning it if necessary.
+unsigned t_path_trie::intern_hash (const char* first, const char* last) {
+  std::string text (first, last);
+
+  std::map<std::string, unsigned>::iterator it = long_hash_ids.find(text);
+  if (it != long_hash_ids.end())
+    return it->second;
+
+  unsigned id = long_hashes.size();
+  long_hashes.push_back(text);
+  long_hash_ids.insert(std::make_pair(text, id));
+  return id;
+}
+
+
+//! The long hashes are saved as their size followed by their text.
+void t_path_trie::save (t_checkpoint_writer& out) const {
+  out.write_vector(nodes);
+  out.write_vector(names);
+  out.write_vector(children);
+  out.write_vector(free_nodes);
+  out.write_value(collect_size);
+
+  out.write_value(long_hashes.size());
+  for (std::size_t i = 0; i < long_hashes.size(); ++i) {
+    out.write_value(long_hashes[i].size());
+    out.write(long_hashes[i].data(), long_hashes[i].size());
+  }
+}
+
+
+//! A node must be one level below its parent so that walking up always ends.
+void t_path_trie::load (t_checkpoint_reader& in) {
+  in.read_vector(nodes);
+  in.read_vector(names);
+  in.read_vector(children);
+  in.read_vector(free_nodes);
+  collect_size = in.read_value();
+
+  long_hashes.clear();
+  long_hash_ids.clear();
+  for (uint64_t count = in.read_value(); count > 0 && in.ok(); --count) {
+    uint64_t size = in.read_value();
+    const char* text = in.read(size);
+    if (text && intern_hash(text, text + size) != long_hashes.size() - 1)
+      in.fail();
+  }
+
+  bool is_valid = nodes.size() > ROOT_PATH && free_nodes.size() < nodes.size() &&
+    !children.empty() && (children.size() & (children.size() - 1)) == 0 &&
+    live() * 2 <= children.size();
+
+  for (t_path path = 0; path < nodes.size() && is_valid; ++path) {
+    const t_node& node = nodes[path];
+    is_valid = node.parent < nodes.size() && node.name_offset <= names.size() &&
+      node.name_size <= names.size() - node.name_offset;
+
+    if (is_valid && path > ROOT_PATH && node.depth != 0)
+      is_valid = nodes[node.parent].depth + 1 == node.depth;
+  }
+  for (std::size_t slot = 0; slot < children.size() && is_valid; ++slot) {
+    is_valid = children[slot] < nodes.size();
+  }
+  for (std::size_t i = 0; i < free_nodes.size() && is_valid; ++i) {
+    is_valid = free_nodes[i] > ROOT_PATH && free_nodes[i] < nodes.size();
+  }
+
+  if (!is_valid)
+    in.fail();
+}
+
+
+/*!
+  Frees the paths of the trie that are no longer used by the state, the reorder buffer,
+  the compactor or the parser once the trie grew enough since the last time. This is only worth
+  it when streaming since the event list holds on to every path otherwise.
+*/
+void collect_paths (const t_algo_state& state, 
+		    const t_reorder_buffer& reorder, 
+		    const t_compactor& compactor, 
+		    const t_event_parser& parser) 
+{
+  if (!path_trie().should_collect())
+    return;
+
+  std::vector<char> marks (path_trie().size(), false);
+
+  for (t_event_cit it = state.events.begin(); it != state.events.end(); ++it) {
+    path_trie().mark((*it)->path, marks);
+    path_trie().mark((*it)->src_path, marks);
+  }
+
+  state.hash_index.mark_paths(marks);
+  state.tree_index.mark_paths(marks);
+  state.pending.mark_paths(marks);
+  reorder.mark_paths(marks);
+  compactor.mark_paths(marks);
+  parser.mark_paths(marks);
+
+  path_trie().collect(marks);
+}
+
+
+/*******************************************************************************
+ * Event utilities
+ ******************************************************************************/
+
+//! Creates an event from the state's pool with the fields common to every event.
+p_event make_event (t_algo_state& state, t_event_type ev, t_file_type f, long ts) {
+  p_event new_ev = state.event_pool.alloc();
+  new_ev->event_type = ev;
+  new_ev->file_type = f;
+  new_ev->timestamp = ts;
+  new_ev->path = new_ev->src_path = NULL_PATH;
+  new_ev->subtree = t_subtree();
+  return new_ev;
+}
+
+
+p_event make_new_event (t_algo_state& state, t_file_type f, long ts, t_path p, 
+			const t_hash& h) 
+{
+  p_event ev = make_event(state, e_new, f, ts);
+  ev->path = p;
+  ev->hash = h;
+  return ev;
+}
+
+
+p_event make_delete_event (t_algo_state& state, t_file_type f, long ts, t_path p, 
+			   const t_hash& h) 
+{
+  p_event ev = make_event(state, e_delete, f, ts);
+  ev->path = p;
+  ev->hash = h;
+  return ev;
+}
+
+
+p_event make_modify_event (t_algo_state& state, t_file_type f, long ts, t_path p, 
+			   const t_hash& old_h, const t_hash& new_h) 
+{
+  p_event ev = make_event(state, e_modify, f, ts);
+  ev->path = p;
+  ev->old_hash = old_h;
+  ev->hash = new_h;
+  return ev;
+}
+
+
+p_event make_move_event (t_algo_state& state, t_file_type f, long ts, 
+			 t_path old_p, t_path new_p)
+{
+  p_event ev = make_event(state, e_move, f, ts);
+  ev->src_path = old_p;
+  ev->path = new_p;
+  return ev;
+}
+
+
+p_event make_copy_event (t_algo_state& state, t_file_type f, long ts, 
+			 t_path src_p, t_path dest_p)
+{
+  p_event ev = make_event(state, e_copy, f, ts);
+  ev->src_path = src_p;
+  ev->path = dest_p;
+  return ev;
+}
+
+
+//! Inserts the event after every event with the same or a lower timestamp.
+t_event_pos insert_event (t_algo_state& state, p_event ev) {
+  t_event_list& events = state.events;
+
+  // Events usually come in order so don't bother searching.
+  if (events.empty() || events.back()->timestamp <= ev->timestamp) {
+    events.push_back(ev);
+    return events.size() - 1;
+  }
+
+  t_event_it it = std::upper_bound(events.begin(), events.end(), ev, t_event_ts_comp());
+  return events.insert(it, ev) - events.begin();
+}
+
+
+//! Position of an event that is in the list.
+t_event_pos find_event (t_algo_state& state, p_event ev) {
+  t_event_list& events = state.events;
+
+  t_event_it it = std::upper_bound(events.begin(), events.end(), ev, t_event_ts_comp());
+  while (*--it != ev);
+  return it - events.begin();
+}
+
+
+//! Will release the event at the position so don't use it afterwards.
+void remove_event (t_algo_state& state, t_event_pos pos) {
+  // std::cout << "REM - "; print_event(*state.events[pos]);
+
+  state.pending.erase(state.events[pos]);
+  state.event_pool.release(state.events[pos]);
+  state.events.erase(state.events.begin() + pos);
+}
+
+
+//! Releases every events from the list that are between the two positions.
+void remove_event (t_algo_state& state, t_event_pos start, t_event_pos end) {
+  for (t_event_pos pos = start; pos != end; ++pos) {
+    state.pending.erase(state.events[pos]);
+    state.event_pool.release(state.events[pos]);
+  }
+  state.events.erase(state.events.begin() + start, state.events.begin() + end);
+}
+
+
+p_event t_event_pool::alloc () {
+  if (!free_events.empty()) {
+    p_event ev = free_events.back();
+    free_events.pop_back();
+    return ev;
+  }
+
+  if (chunk_used == EVENT_CHUNK_SIZE) {
+    chunks.push_back(new t_event[EVENT_CHUNK_SIZE]);
+    chunk_used = 0;
+  }
+
+  return &chunks.back()[chunk_used++];
+}
+
+
+void t_event_pool::release (p_event ev) {
+  free_events.push_back(ev);
+}
+
+
+//! Frees every event ever handed out by the pool.
+void t_event_pool::reset () {
+  for (std::size_t i = 0; i < chunks.size(); ++i) {
+    delete [] chunks[i];
+  }
+  chunks.clear();
+  chunk_used = EVENT_CHUNK_SIZE;
+  free_events.clear();
+}
+
+
+/*******************************************************************************
+ * Digest utilities
+ ******************************************************************************/
+
+//! FNV-1a (64 bits) of a string.
+t_digest make_digest (const char* first, const char* last) {
+  t_digest h = 14695981039346656037ULL;
+  for (; first != last; ++first) {
+    h = (h ^ static_cast<unsigned char>(*first)) * 1099511628211ULL;
+  }
+  return h;
+}
+
+
+//! Finalizer of splitmix64. Spreads every bit of the input over the output.
+t_digest mix_digest (t_digest x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+
+/*!
+  Digest of a single (path, hash) entry of a subtree. 
+
+  Every folder multiplies the digest of what's under it by an odd factor derived from
+  its name so the digest of an entry is the product of the factors of its parents (the
+  scale cached in the trie) times the digest of its name and hash. This means that the
+  sum of the entry digests of a subtree can be made relative to any of the folders
+  above it by dividing it by the scale of that folder (see relative_digest()).
+
+  Two different subtrees can still collide but with 64 bits it's not something we
+  worry about.
+*/
+t_digest entry_digest (t_path path, const t_hash& hash) {
+  const char* first = reinterpret_cast<const char*>(&hash.size);
+  t_digest hash_digest = make_digest(first, first + 1 + hash.length());
+  t_digest leaf = mix_digest(path_trie().name_digest(path) + mix_digest(hash_digest));
+  return path_trie().scale(get_parent(path)) * leaf;
+}
+
+
+//! Removes the factors of base and its parents from the sum of entry digests.
+t_digest relative_digest (t_digest digest, t_path base) {
+  t_digest scale = path_trie().scale(base);
+
+  // Newton's iteration for the inverse modulo 2^64 (each step doubles the valid bits).
+  t_digest inverse = scale;
+  for (int i = 0; i < 5; ++i) {
+    inverse *= 2 - scale * inverse;
+  }
+
+  return digest * inverse;
+}
+
+
+//! Key of the subtree in an index: its digest relative to base and its size.
+t_hash make_subtree_key (const t_subtree& subtree, t_path base) {
+  t_digest digest = relative_digest(subtree.digest, base);
+  uint64_t size = subtree.size;
+
+  t_hash key;
+  std::memcpy(key.bytes, &digest, sizeof(digest));
+  std::memcpy(key.bytes + sizeof(digest), &size, sizeof(size));
+  key.size = sizeof(digest) + sizeof(size);
+  return key;
+}
+
+
+/*******************************************************************************
+ * Tree index
+ ******************************************************************************/
+
+const unsigned t_tree_index::NIL;
+
+
+//! A new folder starts out empty while everything else is added to its parents.
+void t_tree_index::insert (t_file_type type, t_path path, const t_hash& hash) {
+  if (type == e_folder) {
+    t_folder& folder = make_folder(path);
+    folder.subtree = t_subtree();
+    folder.is_live = true;
+    mark_dirty(folder);
+  }
+
+  t_subtree entry;
+  entry.add(path, hash);
+  update_parents(path, entry, true);
+}
+
+
+//! A deleted folder takes whatever is left in it along with it.
+void t_tree_index::erase (t_file_type type, t_path path, const t_hash& hash) {
+  t_subtree entry;
+  entry.add(path, hash);
+
+  t_folder* folder = type == e_folder ? find_folder(path) : NULL;
+  if (folder && folder->is_live) {
+    entry.add(folder->subtree);
+    folder->subtree = t_subtree();
+    folder->is_live = false;
+    mark_dirty(*folder);
+  }
+
+  update_parents(path, entry, false);
+}
+
+
+/*!
+  Looks for a live folder with the same content as the subtree of the base folder. The
+  base folder and its sub-folders are still being created so they're left out.
+*/
+bool t_tree_index::find (const t_subtree& subtree, t_path base, t_path& path) {
+  refresh(base);
+
+  // Every empty folder would match.
+  if (subtree.size == 0)
+    return false;
+
+  return index.find(make_subtree_key(subtree, base), path);
+}
+
+
+t_tree_index::t_folder* t_tree_index::find_folder (t_path path) {
+  if (path >= slots.size() || slots[path] == NIL)
+    return NULL;
+  return &folders[slots[path]];
+}
+
+
+//! Record of the folder, starting out in its initial state if it had none.
+t_tree_index::t_folder& t_tree_index::make_folder (t_path path) {
+  if (slots.size() < path_trie().size()) {
+    slots.resize(path_trie().size(), NIL);
+  }
+
+  if (slots[path] != NIL)
+    return folders[slots[path]];
+
+  if (free_folders.empty()) {
+    free_folders.push_back(folders.size());
+    folders.push_back(t_folder());
+  }
+
+  unsigned slot = free_folders.back();
+  free_folders.pop_back();
+
+  slots[path] = slot;
+  folders[slot].path = path;
+  return folders[slot];
+}
+
+
+//! Drops the record of a folder that is back in its initial state.
+void t_tree_index::release_folder (t_path path) {
+  unsigned slot = slots[path];
+  folders[slot] = t_folder();
+  free_folders.push_back(slot);
+  slots[path] = NIL;
+}
+
+
+void t_tree_index::update_parents (t_path path, const t_subtree& entry, bool is_added) {
+  for (t_path parent = get_parent(path); parent != NULL_PATH; parent = get_parent(parent)) {
+    t_folder* folder = find_folder(parent);
+    if (!folder || !folder->is_live)
+      continue;
+
+    if (is_added)
+      folder->subtree.add(entry);
+    else
+      folder->subtree.remove(entry);
+    mark_dirty(*folder);
+  }
+}
+
+
+void t_tree_index::mark_dirty (t_folder& folder) {
+  if (folder.is_dirty)
+    return;
+  folder.is_dirty = true;
+  dirty.push_back(folder.path);
+}
+
+
+//! Re-keys every folder that changed except for the base folder and its sub-folders.
+void t_tree_index::refresh (t_path base) {
+  std::size_t kept = 0;
+
+  for (std::size_t i = 0; i < dirty.size(); ++i) {
+    t_path path = dirty[i];
+    t_folder& folder = folders[slots[path]];
+
+    if (folder.is_indexed) {
+      index.erase(folder.key, path);
+      folder.is_indexed = false;
+    }
+
+    if (path == base || is_sub_path(base, path)) {
+      dirty[kept++] = path;
+      continue;
+    }
+
+    folder.is_dirty = false;
+    if (folder.is_live && folder.subtree.size != 0) {
+      folder.key = make_subtree_key(folder.subtree, path);
+      index.insert(folder.key, path);
+      folder.is_indexed = true;
+    }
+    else if (!folder.is_live) {
+      release_folder(path);
+    }
+  }
+
+  dirty.resize(kept);
+}
+
+
+void t_tree_index::mark_paths (std::vector<char>& marks) const {
+  for (std::size_t i = 0; i < folders.size(); ++i) {
+    path_trie().mark(folders[i].path, marks);
+  }
+}
+
+
+//! Only the folders that have a record are saved.
+void t_tree_index::save (t_checkpoint_writer& out) const {
+  out.write_value(slots.size());
+
+  for (std::size_t i = 0; i < folders.size(); ++i) {
+    const t_folder& folder = folders[i];
+    if (folder.path == NULL_PATH)
+      continue;
+
+    out.write_value(folder.path);
+    out.write_value(folder.subtree.digest);
+    out.write_value(folder.subtree.size);
+    out.write_value(folder.is_live | folder.is_dirty << 1 | folder.is_indexed << 2);
+    out.write(&folder.key, sizeof(t_hash));
+  }
+  out.write_value(NULL_PATH);
+
+  out.write_vector(dirty);
+  index.save(out);
+}
+
+
+void t_tree_index::load (t_checkpoint_reader& in) {
+  slots.assign(in.read_value(), NIL);
+  folders.clear();
+  free_folders.clear();
+
+  while (t_path path = in.read_value()) {
+    if (path >= slots.size() || slots[path] != NIL) {
+      in.fail();
+      break;
+    }
+
+    t_folder& folder = make_folder(path);
+    folder.subtree.digest = in.read_value();
+    folder.subtree.size = in.read_value();
+
+    uint64_t flags = in.read_value();
+    folder.is_live = flags & 1;
+    folder.is_dirty = flags & 2;
+    folder.is_indexed = flags & 4;
+    in.read_hash(folder.key);
+  }
+
+  in.read_vector(dirty);
+  for (std::size_t i = 0; i < dirty.size(); ++i) {
+    if (dirty[i] >= path_trie().size())
+      in.fail();
+  }
+  index.load(in);
+}
+
+
+/*******************************************************************************
+ * Pending index
+ ******************************************************************************/
+
+const unsigned t_pending_index::NIL;
+
+
+//! Replaces the pending event of the path if there was one.
+void t_pending_index::insert (p_event ev) {
+  t_path path = ev->path;
+  t_path parent = get_parent(path);
+
+  erase(path);
+  make_record(path);
+  make_record(parent);
+
+  t_record& record = get_record(path);
+  t_record& parent_record = get_record(parent);
+
+  record.event = ev;
+  record.prev = NULL_PATH;
+  record.next = parent_record.children;
+  if (parent_record.children != NULL_PATH) 
+    get_record(parent_record.children).prev = path;
+  parent_record.children = path;
+  queue.push_back(make_entry(ev));
+
+  if (ev->file_type == e_file) {
+    files.insert(ev->hash, path);
+    return;
+  }
+
+  // Every empty folder would match.
+  if (ev->subtree.size != 0)
+    folders.insert(make_subtree_key(ev->subtree, path), path);
+}
+
+
+//! The folder DEL event must already be pending.
+void t_pending_index::insert_whole (p_event ev, const t_subtree& subtree) {
+  whole_folders.insert(make_subtree_key(subtree, ev->path), ev->path);
+  whole_queue.push_back(make_entry(ev));
+}
+
+
+void t_pending_index::erase (p_event ev) {
+  if (!is_pending(ev))
+    return;
+
+  t_path path = ev->path;
+  t_path parent = get_parent(path);
+
+  t_record& record = get_record(path);
+  record.event = NULL;
+
+  if (record.prev != NULL_PATH)
+    get_record(record.prev).next = record.next;
+  else 
+    get_record(parent).children = record.next;
+  if (record.next != NULL_PATH)
+    get_record(record.next).prev = record.prev;
+
+  release_record(path);
+  release_record(parent);
+
+  if (ev->file_type == e_file) {
+    files.erase(path);
+  }
+  else {
+    folders.erase(path);
+    whole_folders.erase(path);
+  }
+}
+
+
+/*!
+  Keeps the event pending under its parent but it can no longer be found on its own.
+  Used for the children of a DEL folder event that aren't part of it since they can't
+  be moved anymore once their parent is gone.
+*/
+void t_pending_index::hide (p_event ev) {
+  if (!is_pending(ev))
+    return;
+
+  if (ev->file_type == e_file) {
+    files.erase(ev->path);
+  }
+  else {
+    folders.erase(ev->path);
+    whole_folders.erase(ev->path);
+  }
+}
+
+
+void t_pending_index::erase (t_path path) {
+  const t_record* record = find_record(path);
+  if (record && record->event)
+    erase(record->event);
+}
+
+
+bool t_pending_index::is_pending (p_event ev) const {
+  const t_record* record = find_record(ev->path);
+  return record && record->event == ev;
+}
+
+
+p_event t_pending_index::first_child (t_path parent) const {
+  const t_record* record = find_record(parent);
+  if (!record || record->children == NULL_PATH)
+    return NULL;
+  return find_record(record->children)->event;
+}
+
+
+//! Next pending event of the same parent (the event must be pending).
+p_event t_pending_index::next_sibling (p_event ev) const {
+  const t_record* record = find_record(ev->path);
+  if (record->next == NULL_PATH)
+    return NULL;
+  return find_record(record->next)->event;
+}
+
+
+//! Oldest pending DEL file event with the hash. Events that are too old are dropped.
+p_event t_pending_index::find_file (const t_hash& hash, long min_timestamp) {
+  t_path path;
+  while (files.find(hash, path)) {
+    p_event ev = get_record(path).event;
+    if (ev->timestamp >= min_timestamp)
+      return ev;
+    erase(ev);
+  }
+  return NULL;
+}
+
+
+/*!
+  Same as find_file() but for a DEL folder event with the same subtree. Otherwise, a
+  DEL folder event with the same whole subtree is returned and is_whole is set. Its
+  hidden descendants might have changed since so it's up to the caller to check it
+  (the event can be found again once it's erased from the index).
+*/
+p_event t_pending_index::find_folder (const t_subtree& subtree, 
+				      t_path base, 
+				      long min_timestamp, 
+				      bool& is_whole) 
+{
+  is_whole = false;
+  if (subtree.size == 0)
+    return NULL;
+
+  t_hash key = make_subtree_key(subtree, base);
+
+  t_path path;
+  while (folders.find(key, path)) {
+    p_event ev = get_record(path).event;
+    if (ev->timestamp >= min_timestamp)
+      return ev;
+    erase(ev);
+  }
+
+  while (whole_folders.find(key, path)) {
+    p_event ev = get_record(path).event;
+    if (ev->timestamp >= min_timestamp) {
+      is_whole = true;
+      return ev;
+    }
+    erase(ev);
+  }
+  return NULL;
+}
+
 
-  t_event_delete* prev_del_ev = dynamic_cast<t_event_delete*>(prev_ev);
-  t_event_delete* cur_del_ev = dynamic_cast<t_event_delete*>(cur_ev);
+bool t_pending_index::is_whole (p_event ev) const {
+  return is_pending(ev) && whole_folders.contains(ev->path);
+}
 
-  // If prev_del_ev redundant?
-  if (cur_del_ev->path == get_parent(prev_del_ev->path)) {
-    t_tree& prev_subtree = prev_del_ev->subtree;
-    t_tree& cur_subtree = cur_del_ev->subtree;
 
-    std::string prev_name = get_name(prev_del_ev->path);
-    cur_subtree.insert(std::make_pair(prev_name, prev_del_ev->hash));
+//! Forgets the whole subtree of the pending folder DEL event.
+void t_pending_index::erase_whole (p_event ev) {
+  whole_folders.erase(ev->path);
+}
 
-    // Transfer the subtree entries into our own with our folder prefix.
-    for (t_tree_cit it = prev_subtree.begin(); it != prev_subtree.end(); ++it) {
 
-      std::string new_subpath = prev_name;
-      if (SEP[0] != it->first[0]) 
-	new_subpath += SEP;
-      new_subpath += it->first;
-      cur_subtree.insert(std::make_pair(new_subpath, it->second));
-    }
-    
-    remove_event(state, prev_it);
-    prev_it = state.events.end();
-    prev_ev = NULL;
+t_pending_index::t_entry t_pending_index::make_entry (p_event ev) {
+  t_entry entry;
+  entry.event = ev;
+  entry.timestamp = ev->timestamp;
+  return entry;
+}
 
-    return true;			       
+
+/*!
+  Oldest event of the queue that is still there (pending or whole) and isn't older than
+  min_timestamp. Everything before it is dropped from the queue.
+*/
+p_event t_pending_index::oldest (t_queue& queue, long min_timestamp) {
+  while (!queue.empty()) {
+    const t_entry& entry = queue.front();
+    p_event ev = entry.event;
+
+    bool is_queued = entry.timestamp == ev->timestamp && 
+      (&queue == &whole_queue ? is_whole(ev) : is_pending(ev));
+    if (is_queued && entry.timestamp >= min_timestamp)
+      return ev;
+
+    queue.pop_front();
   }
+  return NULL;
+}
 
-  return false;
+
+const t_pending_index::t_record* t_pending_index::find_record (t_path path) const {
+  if (path >= slots.size() || slots[path] == NIL)
+    return NULL;
+  return &records[slots[path]];
+}
+
+
+//! Record of the path, starting out empty if it had none.
+t_pending_index::t_record& t_pending_index::make_record (t_path path) {
+  if (slots.size() < path_trie().size()) {
+    slots.resize(path_trie().size(), NIL);
+  }
+
+  if (slots[path] != NIL)
+    return records[slots[path]];
+
+  if (free_records.empty()) {
+    free_records.push_back(records.size());
+    records.push_back(t_record());
+  }
+
+  unsigned slot = free_records.back();
+  free_records.pop_back();
+
+  t_record& record = records[slot];
+  record.path = path;
+  record.event = NULL;
+  record.prev = NULL_PATH;
+  record.next = NULL_PATH;
+  record.children = NULL_PATH;
+
+  slots[path] = slot;
+  return record;
 }
 
 
-//! Finds a consecutive series of add events all within the same base folder.
-std::pair<t_event_it, t_tree>
-find_add_bounds (t_algo_state& state, t_event_it start, t_event_it end) {
-  
-  if (start == end || (*start)->event_type != e_new) 
-    return std::make_pair(start, t_tree());
-  
-  t_event_new* base_new_ev = static_cast<t_event_new*> (*start);
-  t_path prefix (base_new_ev->path.begin(), base_new_ev->path.end());
+//! Drops the record of the path once it has neither a pending event nor children.
+void t_pending_index::release_record (t_path path) {
+  unsigned slot = slots[path];
+  if (records[slot].event || records[slot].children != NULL_PATH)
+    return;
+
+  records[slot].path = NULL_PATH;
+  free_records.push_back(slot);
+  slots[path] = NIL;
+}
+
 
-  t_event_it ev_it = inc(start);
+void t_pending_index::mark_paths (std::vector<char>& marks) const {
+  for (std::size_t i = 0; i < records.size(); ++i) {
+    path_trie().mark(records[i].path, marks);
+  }
+}
 
-  t_tree subtree;
 
-  for (; ev_it != end; ++ev_it) {
+//! The links of every record are saved as path, prev, next and children.
+void t_pending_index::save (t_checkpoint_writer& out, const t_event_list& list) const {
+  out.write_value(slots.size());
+
+  std::vector<uint64_t> positions;
+  for (t_event_pos pos = 0; pos < list.size(); ++pos) {
+    if (is_pending(list[pos]))
+      positions.push_back(pos);
+  }
+  out.write_vector(positions);
+
+  std::vector<t_path> links;
+  for (std::size_t i = 0; i < records.size(); ++i) {
+    const t_record& record = records[i];
+    if (!record.event && record.children == NULL_PATH)
+      continue;
+
+    links.push_back(record.path);
+    links.push_back(record.prev);
+    links.push_back(record.next);
+    links.push_back(record.children);
+  }
+  out.write_vector(links);
+
+  files.save(out);
+  folders.save(out);
+  whole_folders.save(out);
+}
 
-    if ((*ev_it)->event_type != e_new)
-      break;
-    
-    t_event_new* cur_new_ev = static_cast<t_event_new*> (*ev_it);
 
-    // Do we have the same path prefix?
-    if (cur_new_ev->path.size() <= prefix.size())
+void t_pending_index::load (t_checkpoint_reader& in, const t_event_list& list) {
+  slots.assign(in.read_value(), NIL);
+  records.clear();
+  free_records.clear();
+  queue.clear();
+  whole_queue.clear();
+
+  std::vector<uint64_t> positions;
+  in.read_vector(positions);
+  for (std::size_t i = 0; i < positions.size(); ++i) {
+    if (positions[i] >= list.size() || list[positions[i]]->path >= slots.size()) {
+      in.fail();
       break;
-    if (!std::equal(prefix.begin(), prefix.end(), cur_new_ev->path.begin()))
+    }
+    p_event ev = list[positions[i]];
+    make_record(ev->path).event = ev;
+    queue.push_back(make_entry(ev));
+  }
+
+  std::vector<t_path> links;
+  in.read_vector(links);
+  if (links.size() % 4 != 0)
+    in.fail();
+
+  for (std::size_t i = 0; i + 4 <= links.size() && in.ok(); i += 4) {
+    for (std::size_t j = i; j < i + 4; ++j) {
+      if (links[j] >= slots.size())
+	in.fail();
+    }
+    if (!in.ok())
       break;
 
-    t_path_it subpath_start = cur_new_ev->path.begin();
-    std::advance(subpath_start, base_new_ev->path.size());
-    std::string subpath = path_to_string(subpath_start, cur_new_ev->path.end());
+    t_record& record = make_record(links[i]);
+    record.prev = links[i + 1];
+    record.next = links[i + 2];
+    record.children = links[i + 3];
+  }
+
+  files.load(in);
+  folders.load(in);
+  whole_folders.load(in);
 
-    subtree.insert(std::make_pair(subpath, cur_new_ev->hash));
+  for (std::size_t i = 0; i < queue.size() && in.ok(); ++i) {
+    if (is_whole(queue[i].event))
+      whole_queue.push_back(queue[i]);
   }
+}
+
+
+/*******************************************************************************
+ * Index utilities
+ ******************************************************************************/
+
+void print_index (t_algo_state& state) {
+  state.hash_index.print();
+}
+
 
-  return std::make_pair(ev_it, subtree);
+//! Value of a hex digit or -1 if it isn't one. Letters are added to the case flags.
+int hex_digit (char c, bool& has_lower, bool& has_upper) {
+  if (c >= '0' && c <= '9') 
+    return c - '0';
+  if (c >= 'a' && c <= 'f') {
+    has_lower = true;
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    has_upper = true;
+    return c - 'A' + 10;
+  }
+  return -1;
 }
 
 
 /*!
-  Simplifies a folder DEL event and a range of ADD event to a single MOVE event if the
-  affected files are the same.
+  Decodes the hex representation of the hash. Anything that isn't hex, including hex
+  with letters of both cases, is kept as is. Hashes that are too long for either are
+  interned in the path trie as is.
 */
-t_event_it simplify_to_folder_move (t_algo_state& state, 
-				    t_event_it prev_it, 
-				    t_event_it cur_it)
-{
-  
-  if ((*prev_it)->event_type != e_delete || (*cur_it)->event_type != e_new)
-    return cur_it;
-
-  if ((*prev_it)->file_type != e_folder && (*prev_it)->file_type != e_folder)
-    cur_it;
+t_hash make_hash (const char* first, const char* last) {
+  std::size_t size = last - first;
+  if (size == 1 && *first == NULL_HASH_TEXT[0])
+    return NULL_HASH;
 
-  t_event_delete* prev_del_ev = static_cast<t_event_delete*> (*prev_it);
-  t_event_new* base_new_ev = static_cast<t_event_new*> (*cur_it);
+  t_hash hash;
 
-  // Get the subtree.
-  std::pair<t_event_it, t_tree> bounds_result = 
-    find_add_bounds(state, cur_it, state.events.end());
+  bool has_lower = false;
+  bool has_upper = false;
+  bool is_hex = size % 2 == 0;
+  for (std::size_t i = 0; is_hex && i < size; i += 2) {
+    int high = hex_digit(first[i], has_lower, has_upper);
+    int low = hex_digit(first[i+1], has_lower, has_upper);
 
-  t_event_it end_bound_it = bounds_result.first;
-  if (end_bound_it == cur_it)
-    return cur_it;
-  t_tree& add_subtree = bounds_result.second;
+    is_hex = high >= 0 && low >= 0 && !(has_lower && has_upper);
+    if (is_hex && i/2 < HASH_SIZE)
+      hash.bytes[i/2] = (high << 4) | low;
+  }
 
-  // Are the subtree the same?
-  if (add_subtree.size() != prev_del_ev->subtree.size())
-    return cur_it;
-  if (!std::equal(add_subtree.begin(), add_subtree.end(), prev_del_ev->subtree.begin()))
-    return cur_it;
+  if (is_hex && size <= HASH_SIZE * 2) {
+    hash.size = size / 2;
+    hash.is_upper = has_upper;
+    return hash;
+  }
 
-  // Ok, we have a move/rename event.
-  p_event move_ev = new t_event_move(e_folder, 
-				     base_new_ev->timestamp, 
-				     prev_del_ev->path,
-				     base_new_ev->path);
+  std::memset(hash.bytes, 0, sizeof(hash.bytes));
 
-  // std::cout << "COP - "; move_ev->print();
+  if (!is_hex && size <= HASH_SIZE) {
+    std::copy(first, first + size, hash.bytes);
+    hash.size = size | HASH_RAW;
+    return hash;
+  }
 
-  remove_event(state, prev_it, end_bound_it);
-  return state.events.insert(move_ev);
+  unsigned id = path_trie().intern_hash(first, last);
+  std::memcpy(hash.bytes, &id, sizeof(id));
+  hash.size = sizeof(id) | HASH_LONG;
+  return hash;
 }
 
 
 /*!
-  Iterates throught the event list looking for folder events to simplify.
+  Returns the text of the hash as it was read and sets its size. The text is written
+  in the buffer (of HASH_SIZE * 2 characters) unless it's a long hash, in which case
+  it's the one interned in the path trie.
+*/
+const char* format_hash (const t_hash& hash, char* buffer, std::size_t& size) {
+  if (hash == NULL_HASH) {
+    size = 1;
+    return NULL_HASH_TEXT;
+  }
 
-  Note that if we supported COPY folder events then that would be handled here but we
-  don't do that because of the inconsistencies it would introduce.
-  Basically, the entire folder would have to have been seen before in order to
-  truly identify a COPY folder event. In a real life practical scenario
-  it's going to be pretty rare that this actually happens and we risk identifying random
-  bits and pieces as an entire folder tree and base our copy decisions on that which is
-  wrong.
+  if (hash.is_long()) {
+    const std::string& text = path_trie().long_hash(hash.long_id());
+    size = text.size();
+    return text.data();
+  }
 
-  Anyway, long story short, if we want to support it we'd need another index which takes 
-  time which would make this code even more complicated then it already is.
-*/
-void simplify_state (t_algo_state& state) {
+  char* out = buffer;
+  if (hash.size & HASH_RAW) {
+    std::copy(hash.bytes, hash.bytes + hash.length(), out);
+    size = hash.length();
+    return buffer;
+  }
 
-  // std::cout << "SIM - Simplifying state." << std::endl;
+  const char* digits = hash.is_upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  for (std::size_t i = 0; i < hash.length(); ++i) {
+    *out++ = digits[hash.bytes[i] >> 4];
+    *out++ = digits[hash.bytes[i] & 0xF];
+  }
+  size = hash.length() * 2;
+  return buffer;
+}
 
-  t_event_it prev_it = state.events.begin();
-  t_event_it cur_it = inc(prev_it);
 
-  for (; cur_it != state.events.end(); ++cur_it, ++prev_it) {
-    p_event cur_ev = *cur_it;
+std::string hash_to_string (const t_hash& hash) {
+  char buffer[HASH_SIZE * 2];
+  std::size_t size;
+  const char* text = format_hash(hash, buffer, size);
+  return std::string(text, size);
+}
 
-    while (simplify_folder_delete(state, prev_it, cur_it)) {
-      if (cur_it == state.events.begin())
-	break;
-      prev_it = dec(cur_it);
+
+const unsigned t_hash_index::NIL;
+
+
+t_hash_index::t_hash_index () :
+  table(1 << 10, NIL), 
+  buckets(), free_bucket(NIL), bucket_count(0),
+  entries(), free_entry(NIL), entry_count(0),
+  path_entries()
+{}
+
+
+//! Adds the path at the end of the hash's list. A path can only be indexed once.
+void t_hash_index::insert (const t_hash& hash, t_path path) {
+  if (path < path_entries.size() && path_entries[path] != NIL)
+    erase_entry(path_entries[path]);
+
+  std::size_t h = hash_key(hash);
+
+  std::size_t slot;
+  unsigned bucket = find_bucket(hash, h, slot);
+
+  if (bucket == NIL) {
+
+    // Keep the table at most half full.
+    if ((bucket_count + 1) * 2 > table.size()) {
+      grow();
+      find_bucket(hash, h, slot);
     }
 
-    if (cur_it == state.events.begin()) 
-      continue;
+    if (free_bucket != NIL) {
+      bucket = free_bucket;
+      free_bucket = buckets[bucket].head;
+    }
+    else {
+      bucket = buckets.size();
+      buckets.push_back(t_bucket());
+    }
 
-    cur_it = simplify_to_folder_move(state, prev_it, cur_it);
+    t_bucket& new_bucket = buckets[bucket];
+    new_bucket.key = hash;
+    new_bucket.hash = h;
+    new_bucket.head = new_bucket.tail = NIL;
 
-    if (cur_it == state.events.begin())
-      continue;
+    table[slot] = bucket;
+    ++bucket_count;
+  }
+
+  unsigned entry;
+  if (free_entry != NIL) {
+    entry = free_entry;
+    free_entry = entries[entry].next;
+  }
+  else {
+    entry = entries.size();
+    entries.push_back(t_entry());
+  }
+
+  t_bucket& cur_bucket = buckets[bucket];
+  t_entry& new_entry = entries[entry];
+  new_entry.path = path;
+  new_entry.bucket = bucket;
+  new_entry.prev = cur_bucket.tail;
+  new_entry.next = NIL;
 
-    prev_it = dec(cur_it);
+  if (cur_bucket.tail != NIL)
+    entries[cur_bucket.tail].next = entry;
+  else
+    cur_bucket.head = entry;
+  cur_bucket.tail = entry;
 
-  }  
+  if (path >= path_entries.size())
+    path_entries.resize(std::max<std::size_t>(path + 1, path_entries.size() * 2), NIL);
+  path_entries[path] = entry;
+
+  ++entry_count;
 }
 
 
-/*******************************************************************************
- * I/O
- ******************************************************************************/
+//! Removes the path from the index if it was indexed with that hash.
+void t_hash_index::erase (const t_hash& hash, t_path path) {
+  if (path >= path_entries.size() || path_entries[path] == NIL)
+    return;
 
-void print_state (t_algo_state& state) {
-  for (t_event_it it = state.events.begin(); it != state.events.end(); ++it) {
-    (*it)->print();
-  }
+  unsigned entry = path_entries[path];
+  if (buckets[entries[entry].bucket].key != hash)
+    return;
+
+  erase_entry(entry);
 }
 
-//! Reads the events from std in as specified by the challenge's spec.
-void read_events (t_algo_state& state) {
-  static const std::string ADD_EV = "ADD";
-  static const std::string DEL_EV = "DEL";
 
-  int nb_events;
-  std::cin >> nb_events;
-  
-  for (int i = 0; i < nb_events; ++i) {
-    char buffer [255];
+//! Removes the path from the index whatever its hash is (nothing if it isn't indexed).
+void t_hash_index::erase (t_path path) {
+  if (path >= path_entries.size() || path_entries[path] == NIL)
+    return;
+
+  erase_entry(path_entries[path]);
+}
 
-    std::string ev_name;
-    std::cin >> ev_name;
 
-    long timestamp;
-    std::cin >> timestamp;
+//! Returns the oldest path with the given hash.
+bool t_hash_index::find (const t_hash& hash, t_path& path) const {
+  std::size_t slot;
+  unsigned bucket = find_bucket(hash, hash_key(hash), slot);
+  if (bucket == NIL)
+    return false;
 
-    std::string raw_path;
-    std::cin >> raw_path;
-    t_path path = make_path(raw_path);
+  path = entries[buckets[bucket].head].path;
+  return true;
+}
 
-    t_hash hash;
-    std::cin >> hash;
 
-    t_file_type file_type = hash == NULL_HASH ? e_folder : e_file;
+void t_hash_index::print () const {
+  std::cout << "I== - ";
+  for (std::size_t slot = 0; slot < table.size(); ++slot) {
+    if (table[slot] == NIL) 
+      continue;
 
-    p_event ev;
-    if (ev_name == ADD_EV)
-      ev = new t_event_new (file_type, timestamp, path, hash);
-    else if (ev_name == DEL_EV)
-      ev = new t_event_delete (file_type, timestamp, path, hash);
-    else
-      assert(false && "Unknown event");
+    const t_bucket& bucket = buckets[table[slot]];
+    for (unsigned entry = bucket.head; entry != NIL; entry = entries[entry].next) {
+      std::cout << "(" << hash_to_string(bucket.key) << ", " 
+		<< path_to_string(entries[entry].path) << ") ";
+    }
+  }
+  std::cout << std::endl;
+}
 
-    // ev->print();
 
-    add_to_state(state, ev);
+//! Mixes the used words of the key (the rest is 0).
+void t_hash_index::mark_paths (std::vector<char>& marks) const {
+  for (t_path path = 0; path < path_entries.size(); ++path) {
+    if (path_entries[path] != NIL)
+      path_trie().mark(path, marks);
   }
 }
 
 
-/*******************************************************************************
- * Tests
- ******************************************************************************/
+std::size_t t_hash_index::hash_key (const t_hash& key) {
+  t_digest h = key.size;
+  for (std::size_t i = 0; i < key.length(); i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, key.bytes + i, sizeof(word));
+    h = mix_digest(h ^ word);
+  }
+  return h;
+}
 
-void run_tests() {
 
-  // File tests.
+/*!
+  Returns the bucket of the key or NIL if there's none. Slot is set to where the key
+  is in the table or to the empty slot where it should go.
+*/
+unsigned t_hash_index::find_bucket (const t_hash& key, 
+				    std::size_t hash, 
+				    std::size_t& slot) const 
+{
+  std::size_t mask = table.size() - 1;
+  for (slot = hash & mask; table[slot] != NIL; slot = (slot + 1) & mask) {
+    const t_bucket& bucket = buckets[table[slot]];
+    if (bucket.hash == hash && bucket.key == key)
+      return table[slot];
+  }
+  return NIL;
+}
 
-  {
-    std::cout << std::endl << " === TEST FILE ===" << std::endl;
 
-    t_algo_state s;
-    long ts = 0;
+//! Unlinks the entry from its bucket and gets rid of the bucket if it's now empty.
+void t_hash_index::erase_entry (unsigned entry) {
+  t_entry& old_entry = entries[entry];
+  t_bucket& bucket = buckets[old_entry.bucket];
 
-    add_to_state(s, new t_event_new(e_folder, ++ts, make_path("/a")));
-    add_to_state(s, new t_event_new(e_file, ++ts, make_path("/a/b.t"), "1111"));
-    add_to_state(s, new t_event_new(e_file, ++ts, make_path("/a/c.t"), "2222"));
-    
-    // Rename
-    add_to_state(s, new t_event_delete(e_file, ++ts, make_path("/a/c.t"), "2222"));
-    add_to_state(s, new t_event_new(e_file, ++ts, make_path("/a/d.t"), "2222"));
-    
-    // Modify
-    add_to_state(s, new t_event_delete(e_file, ++ts, make_path("/a/b.t"), "1111"));
-    add_to_state(s, new t_event_new(e_file, ++ts, make_path("/a/b.t"), "1112"));
+  if (old_entry.prev != NIL)
+    entries[old_entry.prev].next = old_entry.next;
+  else
+    bucket.head = old_entry.next;
 
-    add_to_state(s, new t_event_new(e_folder, ++ts, make_path("/a/e")));
+  if (old_entry.next != NIL)
+    entries[old_entry.next].prev = old_entry.prev;
+  else
+    bucket.tail = old_entry.prev;
 
-    // Copy of /a/b.t
-    add_to_state(s, new t_event_new(e_file, ++ts, make_path("/a/e/f.t"), "1112"));    
+  path_entries[old_entry.path] = NIL;
+  old_entry.next = free_entry;
+  free_entry = entry;
+  --entry_count;
 
-    // Move and Rename
-    add_to_state(s, new t_event_delete(e_file, ++ts, make_path("/a/b.t"), "1112"));    
-    add_to_state(s, new t_event_new(e_file, ++ts, make_path("/a/e/g.t"), "1112"));    
+  if (bucket.head != NIL)
+    return;
 
+  std::size_t mask = table.size() - 1;
+  std::size_t slot = bucket.hash & mask;
+  while (table[slot] != old_entry.bucket) slot = (slot + 1) & mask;
+  erase_slot(slot);
 
-    simplify_state(s);
-    std::cout << std::endl;
-    print_state(s);
-  }
+  bucket.head = free_bucket;
+  free_bucket = old_entry.bucket;
+  --bucket_count;
+}
 
-  // Folder tests
 
-  {
-    std::cout << std::endl << std::endl << " === TEST FOLDER ===" << std::endl;
+//! Empties the slot and shifts back any following bucket that would become unreachable.
+void t_hash_index::erase_slot (std::size_t slot) {
+  std::size_t mask = table.size() - 1;
 
-    t_algo_state s;
-    long ts = 0;
+  std::size_t hole = slot;
+  for (std::size_t next = (slot + 1) & mask; table[next] != NIL; next = (next + 1) & mask) {
+    std::size_t home = buckets[table[next]].hash & mask;
 
-    // Delete folder tree.
-    add_to_state(s, new t_event_delete(e_file, ++ts, make_path("/a/b/c.t"), "1111"));
-    add_to_state(s, new t_event_delete(e_folder, ++ts, make_path("/a/b")));
-    add_to_state(s, new t_event_delete(e_file, ++ts, make_path("/a/d.t"), "2222"));
-    add_to_state(s, new t_event_delete(e_folder, ++ts, make_path("/a")));
+    // Can only move the bucket if its home isn't between the hole and where it is.
+    bool is_reachable = hole <= next ? 
+      (hole < home && home <= next) : (hole < home || home <= next);
+    if (is_reachable)
+      continue;
 
-    // Move & rename folder /f to /g/h.
-    add_to_state(s, new t_event_delete(e_file, ++ts, make_path("/f/b/c.t"), "3333"));
-    add_to_state(s, new t_event_delete(e_folder, ++ts, make_path("/f/b")));
-    add_to_state(s, new t_event_delete(e_file, ++ts, make_path("/f/d.t"), "4444"));
-    add_to_state(s, new t_event_delete(e_folder, ++ts, make_path("/f")));
+    table[hole] = table[next];
+    hole = next;
+  }
 
-    add_to_state(s, new t_event_new(e_folder, ++ts, make_path("/g/h")));
-    add_to_state(s, new t_event_new(e_file, ++ts, make_path("/g/h/d.t"), "4444"));
-    add_to_state(s, new t_event_new(e_folder, ++ts, make_path("/g/h/b")));
-    add_to_state(s, new t_event_new(e_file, ++ts, make_path("/g/h/b/c.t"), "3333"));
+  table[hole] = NIL;
+}
 
-    simplify_state(s);
-    std::cout << std::endl;
-    print_state(s);
+
+//! Doubles the size of the table and reinserts every bucket in it.
+void t_hash_index::grow () {
+  std::vector<unsigned> new_table (table.size() * 2, NIL);
+  std::size_t mask = new_table.size() - 1;
+
+  for (std::size_t i = 0; i < table.size(); ++i) {
+    if (table[i] == NIL)
+      continue;
+
+    std::size_t slot = buckets[table[i]].hash & mask;
+    while (new_table[slot] != NIL) slot = (slot + 1) & mask;
+    new_table[slot] = table[i];
   }
 
+  table.swap(new_table);
+}
 
-  // Provided examples.
-  {
-    std::cout << std::endl << " === TEST DROPBOX ===" << std::endl;
 
-    t_algo_state s;
-    long ts = 0;
+//! The buckets are copied field by field so that their padding is written as zeros.
+void t_hash_index::save (t_checkpoint_writer& out) const {
+  std::vector<t_bucket> saved_buckets (buckets.size());
+  if (!buckets.empty())
+    std::memset(&saved_buckets[0], 0, buckets.size() * sizeof(t_bucket));
 
-    add_to_state(s, new t_event_new(e_folder, ++ts, make_path("/test")));
-    add_to_state(s, new t_event_new(e_file, ++ts, make_path("/test/1.txt"), "f2fa762f"));
+  for (std::size_t i = 0; i < buckets.size(); ++i) {
+    saved_buckets[i].key = buckets[i].key;
+    saved_buckets[i].hash = buckets[i].hash;
+    saved_buckets[i].head = buckets[i].head;
+    saved_buckets[i].tail = buckets[i].tail;
+  }
 
-    add_to_state(s, new t_event_delete(e_file, ++ts, make_path("/test/1.txt"), "f2fa762f"));
-    add_to_state(s, new t_event_delete(e_folder, ++ts, make_path("/test")));
+  out.write_vector(table);
+  out.write_vector(saved_buckets);
+  out.write_value(free_bucket);
+  out.write_value(bucket_count);
+  out.write_vector(entries);
+  out.write_value(free_entry);
+  out.write_value(entry_count);
+  out.write_vector(path_entries);
+}
 
-    add_to_state(s, new t_event_new(e_folder, ++ts, make_path("/test2")));
-    add_to_state(s, new t_event_new(e_file, ++ts, make_path("/test2/1.txt"), "f2fa762f"));
 
-    simplify_state(s);
-    std::cout << std::endl;
-    print_state(s);    
+void t_hash_index::load (t_checkpoint_reader& in) {
+  in.read_vector(table);
+  in.read_vector(buckets);
+  free_bucket = in.read_value();
+  bucket_count = in.read_value();
+  in.read_vector(entries);
+  free_entry = in.read_value();
+  entry_count = in.read_value();
+  in.read_vector(path_entries);
+
+  // Every link must stay within the vectors and the table must have an empty slot.
+  std::size_t used_slots = 0;
+  bool is_valid = !table.empty() && (table.size() & (table.size() - 1)) == 0 &&
+    is_index(free_bucket, buckets.size()) && is_index(free_entry, entries.size());
+
+  for (std::size_t slot = 0; slot < table.size() && is_valid; ++slot) {
+    is_valid = is_index(table[slot], buckets.size());
+    used_slots += table[slot] != NIL;
+  }
+  is_valid = is_valid && used_slots == bucket_count && used_slots < table.size();
+
+  for (std::size_t i = 0; i < buckets.size() && is_valid; ++i) {
+    is_valid = is_index(buckets[i].head, entries.size()) && 
+      is_index(buckets[i].tail, entries.size());
+  }
+  for (std::size_t i = 0; i < entries.size() && is_valid; ++i) {
+    is_valid = is_index(entries[i].bucket, buckets.size()) && 
+      is_index(entries[i].prev, entries.size()) && is_index(entries[i].next, entries.size());
   }
+  for (t_path path = 0; path < path_entries.size() && is_valid; ++path) {
+    unsigned entry = path_entries[path];
+    is_valid = entry == NIL || 
+      (entry < entries.size() && entries[entry].path == path && path < path_trie().size());
+  }
+
+  if (!is_valid)
+    in.fail();
+}
 
+#ifdef FILEVENTS_LIBRARY
 }
+#endif
 
 
 /*******************************************************************************
- * Path manipulation utilities
+ * class t_filevents
  ******************************************************************************/
 
-//! Converts a pair of path iterators to it's string representation.
-std::string path_to_string (const t_path_cit start, const t_path_cit end) {
-  std::stringstream ss;
+static void queue_filevent (const t_event& ev, void* data);
+
 
-  for(t_path_cit it = start; it != end; ++it) {
-    ss << *it;
-    if (*it != SEP && inc(it) != end)
-      ss << SEP;
+//! The compactor queues its events in the output of the t_filevents.
+struct t_filevents_impl {
+  t_filevents_impl (const t_filevents_config& config, std::deque<t_filevent>& output) :
+    trie(), state(), reorder(config.reorder_window, config.reorder_count), parser(),
+    compactor(queue_filevent, &output)
+  {
+    state.match_window = config.match_window;
+    compactor.set_window(config.compact_window);
   }
-  return ss.str();
-}
 
+  void push (const t_raw_event& raw) {
+    reorder.push(make_input_event(state, raw));
+    while (p_event ev = reorder.pop(false)) {
+      add_to_state(state, ev);
+    }
+  }
 
-//! Converts a path to it's string representation.
-std::string path_to_string (const t_path& path) {
-  return path_to_string(path.begin(), path.end());
-}
+  // Current during every call that makes or reads paths (see t_trie_scope).
+  t_path_trie trie;
 
+  t_algo_state state;
+  t_reorder_buffer reorder;
+  t_event_parser parser;
+  t_compactor compactor;
+};
 
-//! Converts a string into a path object.
-t_path make_path (const std::string& raw_path) {
-  t_path path;
 
-  std::size_t base_it = 0;
-  while (true) {
-    std::size_t next_it = raw_path.find(SEP, base_it);
+//! Sink of pop_done_events() that converts the events and queues them.
+static void queue_filevent (const t_event& ev, void* data) {
+  static const t_filevent_type types[] = {
+    e_filevent_add, e_filevent_delete, e_filevent_modify, e_filevent_move, e_filevent_copy
+  };
 
-    if (next_it != base_it) {
-      path.push_back(std::string (raw_path, base_it, next_it - base_it));
-    }
-    // add the root.
-    else {
-      path.push_back(SEP);
-    }
+  // Nothing happened (see t_event_writer::write()).
+  if (ev.event_type == e_move && !ev.is_rename() && !ev.is_move())
+    return;
+
+  std::deque<t_filevent>& output = *static_cast<std::deque<t_filevent>*>(data);
+  output.push_back(t_filevent());
+
+  t_filevent& out = output.back();
+  out.type = types[ev.event_type];
+  out.is_folder = ev.file_type == e_folder;
+  out.timestamp = ev.timestamp;
 
-    if (next_it == std::string::npos) break;
+  out.path = path_to_string(ev.path);
+  if (ev.event_type == e_move || ev.event_type == e_copy)
+    out.src_path = path_to_string(ev.src_path);
 
-    base_it = next_it + 1;
+  // The hash of a move is left as is by make_move_event().
+  if (!out.is_folder && ev.event_type != e_move) {
+    out.hash = hash_to_string(ev.hash);
+    if (ev.event_type == e_modify)
+      out.old_hash = hash_to_string(ev.old_hash);
   }
+}
 
-  return path;
+
+t_filevents::t_filevents (const t_filevents_config& config) :
+  impl(new t_filevents_impl(config, output)),
+  callback(NULL), callback_data(NULL), output(), is_finished(false)
+{}
+
+
+t_filevents::~t_filevents () {
+  delete impl;
 }
 
 
-//! Returns the tail of the path object.
-std::string get_name (const t_path& path) {
-  return *path.rbegin();
+//! Events that are already queued are handed over to the callback right away.
+void t_filevents::set_callback (t_callback new_callback, void* data) {
+  callback = new_callback;
+  callback_data = data;
+  deliver();
 }
 
 
-//! Returns everything but the tail of the path.
-t_path get_parent (const t_path& path) {
-  assert (!path.empty());
-  return t_path(path.begin(), dec(path.end()));
+void t_filevents::push (const t_filevent_input& ev) {
+  push(&ev, 1);
 }
 
 
-//! Used to compare two paths together.
-bool operator== (const t_path& lhs, const t_path& rhs) {
-  if (lhs.size() != rhs.size()) 
-    return false;
+/*!
+  Simplifies every event of the batch before looking for the events that are done so
+  it's cheaper than pushing them one at a time.
+*/
+void t_filevents::push (const t_filevent_input* events, std::size_t count) {
+  assert(!is_finished && "Events pushed after finish()");
 
-  t_path_cit lhs_it = lhs.begin();
-  t_path_cit rhs_it = rhs.begin();
+  t_trie_scope scope (impl->trie);
+  t_algo_state& state = impl->state;
 
-  for (; lhs_it != lhs.end(); ++lhs_it, ++rhs_it) {
-    if (*lhs_it != *rhs_it)
-      return false;
+  for (std::size_t i = 0; i < count; ++i) {
+    const t_filevent_input& ev = events[i];
+    assert((ev.type == e_filevent_add || ev.type == e_filevent_delete) && ev.path);
+
+    const char* hash = ev.hash ? ev.hash : NULL_HASH_TEXT;
+
+    t_raw_event raw;
+    raw.event_type = ev.type == e_filevent_add ? e_new : e_delete;
+    raw.timestamp = ev.timestamp;
+    raw.path = make_path(ev.path, ev.path + std::strlen(ev.path));
+    raw.hash.first = hash;
+    raw.hash.last = hash + std::strlen(hash);
+    raw.file_type = raw.hash.is(NULL_HASH_TEXT) ? e_folder : e_file;
+
+    impl->push(raw);
   }
-  return true;
+
+  pop_done_events(state, compact_event, &impl->compactor);
+  collect_paths(state, impl->reorder, impl->compactor, impl->parser);
+  deliver();
 }
 
 
-/*******************************************************************************
- * Event utilities
- ******************************************************************************/
+/*!
+  Pushes every event of a block of lines in the log format, without the count line.
+  A line can't be split across two blocks. Blank lines are skipped.
+*/
+void t_filevents::push_log (const char* first, const char* last) {
+  assert(!is_finished && "Events pushed after finish()");
 
-//! Will delete the event at the iterator so don't use it afterwards.
-t_event_it remove_event (t_algo_state& state, t_event_it it) {
-  p_event ev = *it;
-  t_event_it next_it = inc(it);
+  t_trie_scope scope (impl->trie);
+  impl->parser.parse(first, last);
 
-  // std::cout << "REM - "; ev->print();
+  t_raw_event raw;
+  while (impl->parser.next(raw)) {
+    impl->push(raw);
+  }
 
-  state.events.erase(it);
-  delete ev; // Should really be handled by boost::shared_ptr...
-  return next_it;
+  pop_done_events(impl->state, compact_event, &impl->compactor);
+  collect_paths(impl->state, impl->reorder, impl->compactor, impl->parser);
+  deliver();
 }
 
 
-//! Deletes every events from the list that are between the two iterators.
-t_event_it remove_event (t_algo_state& state, t_event_it start, t_event_it end) {
-  t_event_it it = start;
-  while (it != end) {
-    it = remove_event(state, it);
-  }
-  return it;
-}
+//! Simplifies and delivers whatever is left.
+void t_filevents::finish () {
+  if (is_finished)
+    return;
+  is_finished = true;
 
+  t_trie_scope scope (impl->trie);
+  t_algo_state& state = impl->state;
 
-/*******************************************************************************
- * Tree utilities
- ******************************************************************************/
+  while (p_event ev = impl->reorder.pop(true)) {
+    add_to_state(state, ev);
+  }
+  simplify_state(state);
 
-void print_tree (const t_tree& tree) {
-  std::cout << "TRE - ";
-  for (t_tree_cit it = tree.begin(); it != tree.end(); ++it) {
-    std::cout << "(" << it->first << ", " << it->second << ") ";
+  for (t_event_it it = state.events.begin(); it != state.events.end(); ++it) {
+    impl->compactor.write(**it);
   }
-  std::cout << std::endl;
+  impl->compactor.flush();
+  remove_event(state, 0, state.events.size());
+  state.add_pos = NULL_POS;
+
+  deliver();
 }
 
 
-/*******************************************************************************
- * Index utilities
- ******************************************************************************/
+//! Takes the oldest simplified event. Always false if a callback is set.
+bool t_filevents::pop (t_filevent& ev) {
+  if (output.empty())
+    return false;
 
-void print_index (t_algo_state& state) {
-  std::cout << "I== - ";
-  for (t_index_it it = state.hash_index.begin(); it != state.hash_index.end(); ++it) {
-    std:: cout << "(" << it->first << ", " << path_to_string(it->second) << ") ";
-  }
-  std::cout << std::endl;
+  ev = output.front();
+  output.pop_front();
+  return true;
 }
 
 
-void remove_from_index (t_algo_state& state, const t_hash& key, const t_path& value){
-  std::pair<t_index_it, t_index_it> range = state.hash_index.equal_range(key);
-  const t_index_it start = range.first;
-  const t_index_it end = range.second;
+std::size_t t_filevents::pending () const {
+  return impl->state.events.size() + impl->reorder.size();
+}
 
-  for (t_index_it it = start; it != end; it++) {
-    if (it->second == value) {
-      state.hash_index.erase(it);
-      break;
-    }
+
+void t_filevents::deliver () {
+  if (!callback)
+    return;
+
+  while (!output.empty()) {
+    callback(output.front(), callback_data);
+    output.pop_front();
   }
 }
-
@@ -0,0 +1,169 @@
+/*!
+
+\author Rémi Attab
+\license FreeBSD (see LICENSE file).
+
+Library interface of the filevents simplifier (see filevents.cpp for the algorithm).
+It's built as the filevents_lib static library which is the same code as the
+filevents program minus the main function.
+
+Basic events are pushed one at a time, in batches or as blocks of log lines as they
+happen and the simplified events come out through a callback or through pop() once they can no
+longer be simplified. Nothing is read from std in or written to std out.
+
+  t_filevents simplifier;
+  simplifier.push(t_filevent_input(e_filevent_add, 1, "/a", NULL));
+  simplifier.push(t_filevent_input(e_filevent_add, 2, "/a/b.txt", "f2fa762f"));
+  simplifier.finish();
+
+  t_filevent ev;
+  while (simplifier.pop(ev)) { ... }
+
+Every instance has its own path table which is freed along with it. An instance
+must only be used from one thread at a time but different instances can be used
+from different threads.
+
+ */
+
+#ifndef FILEVENTS_H
+#define FILEVENTS_H
+
+#include <string>
+#include <deque>
+#include <cstddef>
+
+
+/*******************************************************************************
+ * Events
+ ******************************************************************************/
+
+enum t_filevent_type {
+  e_filevent_add,
+  e_filevent_delete,
+  e_filevent_modify,
+  e_filevent_move,
+  e_filevent_copy
+};
+
+
+/*!
+  Basic event as found in the logs. The strings only need to live until push()
+  returns. The hash of a folder is either NULL or "-".
+*/
+struct t_filevent_input {
+  t_filevent_type type;
+  long timestamp;
+  const char* path;
+  const char* hash;
+
+  t_filevent_input () : type(e_filevent_add), timestamp(0), path(NULL), hash(NULL) {}
+  t_filevent_input (t_filevent_type t, long ts, const char* p, const char* h) :
+    type(t), timestamp(ts), path(p), hash(h)
+  {}
+};
+
+
+/*!
+  Simplified event. The fields that are used depend on the type:
+
+    - add and delete: path and hash.
+    - modify: path, old_hash and hash (the new hash).
+    - move: src_path is the old path and path the new one.
+    - copy: src_path is the original, path the copy and hash the hash of a file.
+
+  The hashes of folders are empty.
+*/
+struct t_filevent {
+  t_filevent_type type;
+  bool is_folder;
+  long timestamp;
+
+  std::string path;
+  std::string src_path;
+
+  std::string hash;
+  std::string old_hash;
+
+  t_filevent () :
+    type(e_filevent_add), is_folder(false), timestamp(0),
+    path(), src_path(), hash(), old_hash()
+  {}
+};
+
+
+/*******************************************************************************
+ * class t_filevents
+ ******************************************************************************/
+
+/*!
+  Options of the simplifier. They're the same as those of the filevents program:
+  match_window is -i, reorder_window and reorder_count are -w and -c while 
+  compact_window is -d.
+*/
+struct t_filevents_config {
+  long match_window;
+  long reorder_window;
+  long reorder_count;
+  long compact_window;
+
+  t_filevents_config () : 
+    match_window(0), reorder_window(0), reorder_count(0), compact_window(0) 
+  {}
+};
+
+
+struct t_filevents_impl;
+
+
+/*!
+  Incremental simplifier. The events must be pushed in timestamp order unless a
+  reorder window is given in the config.
+
+  If a callback is set, it's called for every simplified event (in order) as soon as
+  it's done. Otherwise the events are queued until they're popped. Once finish() is
+  called, every remaining event is delivered and nothing else can be pushed.
+*/
+class t_filevents {
+
+  // Equivalent of boost::noncopyable.
+  t_filevents(const t_filevents& src) {}
+  t_filevents& operator= (const t_filevents& src) {return *this;}
+
+public :
+
+  typedef void (*t_callback) (const t_filevent& ev, void* data);
+
+  explicit t_filevents (const t_filevents_config& config = t_filevents_config());
+  ~t_filevents ();
+
+  void set_callback (t_callback callback, void* data);
+
+  void push (const t_filevent_input& ev);
+  void push (const t_filevent_input* events, std::size_t count);
+  void push_log (const char* first, const char* last);
+  void finish ();
+
+  bool pop (t_filevent& ev);
+
+  //! Number of events that are done but weren't popped yet.
+  std::size_t ready () const {return output.size();}
+
+  //! Number of pushed events that are still waiting on later events.
+  std::size_t pending () const;
+
+private :
+
+  void deliver ();
+
+  t_filevents_impl* impl;
+
+  t_callback callback;
+  void* callback_data;
+
+  std::deque<t_filevent> output;
+  bool is_finished;
+
+};
+
+
+#endif // FILEVENTS_H